@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "parser_harness.h"
+
+#define DEFAULT_CORPUS "bench/corpus"
+#define EXPECTED_SUFFIX ".expected"
+#define MAX_INPUTS 4096
+#define TARGET_NSEC 200000000L
+#define BENCH_USAGE "Usage: %s [--check | --record] [--iterations=n] [corpus...]\n"
+
+struct Input
+{
+    char *name;
+    char *data;
+    size_t len;
+};
+
+static struct option bench_longopts[] = {
+    {"check", no_argument, NULL, 'c'},
+    {"record", no_argument, NULL, 'r'},
+    {"iterations", required_argument, NULL, 'i'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0},
+};
+
+static struct Input inputs[MAX_INPUTS];
+static int ninputs = 0;
+
+static void load_path(char *path);
+static void load_file(char *path);
+static int has_suffix(char *s, char *suffix);
+static char *dump_input(struct Input *in);
+static void dump_request(struct HTTPRequest *req, void *arg);
+static void dump_string(FILE *out, char *s);
+static int check_inputs(int record);
+static void bench_inputs(long iterations);
+static long nsec_now(void);
+static uint64_t cycles_now(void);
+static int compare_inputs(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int check = 0;
+    int record = 0;
+    long iterations = 0;
+
+    while ((opt = getopt_long(argc, argv, "", bench_longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            check = 1;
+            break;
+        case 'r':
+            record = 1;
+            break;
+        case 'i':
+            iterations = atol(optarg);
+            break;
+        case 'h':
+            fprintf(stdout, BENCH_USAGE, argv[0]);
+            exit(0);
+        default:
+            fprintf(stderr, BENCH_USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc)
+        load_path(DEFAULT_CORPUS);
+    while (optind < argc)
+        load_path(argv[optind++]);
+    if (ninputs == 0)
+    {
+        fprintf(stderr, "no corpus inputs\n");
+        exit(1);
+    }
+    qsort(inputs, ninputs, sizeof(struct Input), compare_inputs);
+    /* Parse errors are expected in the corpus; keep their messages quiet. */
+    debug_mode = 1;
+    if (!freopen("/dev/null", "w", stderr))
+        exit(1);
+    if (check || record)
+        exit(check_inputs(record));
+    bench_inputs(iterations);
+    exit(0);
+}
+
+static void load_path(char *path)
+{
+    DIR *d;
+    struct dirent *ent;
+
+    d = opendir(path);
+    if (!d)
+    {
+        load_file(path);
+        return;
+    }
+    while ((ent = readdir(d)))
+    {
+        char buf[PATH_MAX];
+
+        if (ent->d_name[0] == '.' || has_suffix(ent->d_name, EXPECTED_SUFFIX))
+            continue;
+        snprintf(buf, sizeof(buf), "%s/%s", path, ent->d_name);
+        load_file(buf);
+    }
+    closedir(d);
+}
+
+static void load_file(char *path)
+{
+    FILE *f;
+    long len;
+
+    if (ninputs == MAX_INPUTS)
+    {
+        fprintf(stderr, "too many corpus inputs (max %d)\n", MAX_INPUTS);
+        exit(1);
+    }
+    f = fopen(path, "rb");
+    if (!f || fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    rewind(f);
+    inputs[ninputs].name = strdup(path);
+    inputs[ninputs].data = xmalloc(len + 1);
+    inputs[ninputs].len = fread(inputs[ninputs].data, 1, len, f);
+    fclose(f);
+    ninputs++;
+}
+
+static int has_suffix(char *s, char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+
+    return (n >= m && strcmp(s + n - m, suffix) == 0);
+}
+
+/* The textual form of everything the parser extracted; the expected files
+   are these dumps, so any change in what gets parsed shows up as a diff. */
+static char *dump_input(struct Input *in)
+{
+    FILE *out;
+    char *buf;
+    size_t len;
+    long n;
+    int failed;
+
+    out = open_memstream(&buf, &len);
+    if (!out)
+        exit(1);
+    n = harness_parse(in->data, in->len, dump_request, out, &failed);
+    fprintf(out, "requests %ld\n", n);
+    fprintf(out, "result %s\n", failed ? "error" : "ok");
+    fclose(out);
+    return (buf);
+}
+
+static void dump_request(struct HTTPRequest *req, void *arg)
+{
+    FILE *out = (FILE *)arg;
+    struct HTTPHeaderField *h;
+
+    fprintf(out, "request\n");
+    fprintf(out, "  method ");
+    dump_string(out, req->method);
+    fprintf(out, "\n  path ");
+    dump_string(out, req->path);
+    fprintf(out, "\n  version 1.%d\n", req->protocol_minor_version);
+    for (h = req->header; h; h = h->next)
+    {
+        fprintf(out, "  header ");
+        dump_string(out, h->name);
+        fprintf(out, ": ");
+        dump_string(out, h->value);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "  body %ld\n", req->length);
+}
+
+static void dump_string(FILE *out, char *s)
+{
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+
+        if (c >= 0x20 && c < 0x7f && c != '\\')
+            fputc(c, out);
+        else
+            fprintf(out, "\\x%02x", c);
+    }
+}
+
+static int check_inputs(int record)
+{
+    int failures = 0;
+
+    for (int i = 0; i < ninputs; i++)
+    {
+        char path[PATH_MAX];
+        char *got;
+        FILE *f;
+
+        got = dump_input(&inputs[i]);
+        snprintf(path, sizeof(path), "%s%s", inputs[i].name, EXPECTED_SUFFIX);
+        if (record)
+        {
+            f = fopen(path, "w");
+            if (!f || fputs(got, f) == EOF || fclose(f) == EOF)
+            {
+                printf("%s: %s\n", path, strerror(errno));
+                return (1);
+            }
+        }
+        else
+        {
+            char want[65536];
+            size_t n = 0;
+
+            f = fopen(path, "r");
+            if (f)
+            {
+                n = fread(want, 1, sizeof(want) - 1, f);
+                fclose(f);
+            }
+            want[n] = '\0';
+            if (!f || strcmp(want, got) != 0)
+            {
+                printf("FAIL %s\n--- expected\n%s--- got\n%s", inputs[i].name,
+                       f ? want : "(missing)\n", got);
+                failures++;
+            }
+        }
+        free(got);
+    }
+    if (!record)
+        printf("%d/%d corpus inputs parsed as expected\n", ninputs - failures, ninputs);
+    return (failures != 0);
+}
+
+static void bench_inputs(long iterations)
+{
+    long total_req = 0, total_ns = 0, total_allocs = 0;
+    uint64_t total_cycles = 0, total_bytes = 0;
+
+    printf("%-36s %8s %10s %10s %10s\n", "input", "requests", "ns/req", "bytes/cyc", "allocs/req");
+    for (int i = 0; i < ninputs; i++)
+    {
+        struct Input *in = &inputs[i];
+        long iters = iterations;
+        long n = 0, start, ns;
+        uint64_t c0, cycles;
+        unsigned long a0;
+        int failed;
+        char *name;
+
+        if (iters == 0)
+        {
+            /* Calibrate so that every input runs for roughly the same time. */
+            start = nsec_now();
+            harness_parse(in->data, in->len, NULL, NULL, &failed);
+            ns = nsec_now() - start;
+            iters = ns > 0 ? TARGET_NSEC / ns : 1000;
+            if (iters < 10)
+                iters = 10;
+        }
+        a0 = harness_allocs;
+        start = nsec_now();
+        c0 = cycles_now();
+        for (long k = 0; k < iters; k++)
+            n += harness_parse(in->data, in->len, NULL, NULL, &failed);
+        cycles = cycles_now() - c0;
+        ns = nsec_now() - start;
+        if (n == 0)
+            n = iters;
+        name = strrchr(in->name, '/') ? strrchr(in->name, '/') + 1 : in->name;
+        printf("%-36.36s %8ld %10.1f %10.3f %10.1f%s\n", name, n / iters, (double)ns / n,
+               cycles ? (double)in->len * iters / cycles : 0.0,
+               (double)(harness_allocs - a0) / n, failed ? "  (error)" : "");
+        total_req += n;
+        total_ns += ns;
+        total_cycles += cycles;
+        total_bytes += in->len * iters;
+        total_allocs += harness_allocs - a0;
+    }
+    printf("%-36s %8s %10.1f %10.3f %10.1f\n", "total", "", (double)total_ns / total_req,
+           total_cycles ? (double)total_bytes / total_cycles : 0.0,
+           (double)total_allocs / total_req);
+}
+
+static long nsec_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000L + ts.tv_nsec);
+}
+
+/* Bytes per cycle needs a cycle counter; elsewhere it is reported as 0. */
+static uint64_t cycles_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (__rdtsc());
+#else
+    return (0);
+#endif
+}
+
+static int compare_inputs(const void *a, const void *b)
+{
+    return (strcmp(((struct Input *)a)->name, ((struct Input *)b)->name));
+}
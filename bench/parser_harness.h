@@ -0,0 +1,86 @@
+/*
+ * Drives the request parser of r3u_http.c over in-memory buffers.
+ *
+ * The server is compiled into the including program as is: its main() is
+ * renamed out of the way, exit(3) is redirected so that a parse error
+ * unwinds back to the harness instead of ending the process, and malloc(3)
+ * is counted so allocations per request can be reported.
+ */
+#ifndef R3U_PARSER_HARNESS_H
+#define R3U_PARSER_HARNESS_H
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static jmp_buf *harness_jmp = NULL;
+static unsigned long harness_allocs = 0;
+
+__attribute__((noreturn)) static void harness_exit(int status)
+{
+    if (harness_jmp)
+        longjmp(*harness_jmp, status + 1);
+    exit(status);
+}
+
+static void *harness_malloc(size_t sz)
+{
+    harness_allocs++;
+    return (malloc(sz));
+}
+
+#define main r3u_http_main
+#define exit(status) harness_exit(status)
+#define malloc(sz) harness_malloc(sz)
+#include "../r3u_http.c"
+#undef malloc
+#undef exit
+#undef main
+
+typedef void (*harness_callback)(struct HTTPRequest *req, void *arg);
+
+/*
+ * Parses every request in buf, as a pipelining client would send them on
+ * one connection, calling cb (if any) for each. Returns the number of
+ * requests parsed; *failed is set when parsing stopped on an error.
+ */
+static long harness_parse(char *buf, size_t len, harness_callback cb, void *arg, int *failed)
+{
+    jmp_buf jb;
+    FILE *in;
+    volatile long n = 0;
+    int c;
+
+    *failed = 0;
+    if (len == 0)
+        return (0);
+    in = fmemopen(buf, len, "r");
+    if (!in)
+        return (0);
+    /* No socket behind the stream: skip poll(2) and alarm(2) deadlines. */
+    timeouts.idle = 0;
+    timeouts.header = 0;
+    timeouts.body = 0;
+    harness_jmp = &jb;
+    if (setjmp(jb) == 0)
+    {
+        while ((c = getc(in)) != EOF)
+        {
+            struct HTTPRequest *req;
+
+            ungetc(c, in);
+            req = read_request(in);
+            if (cb)
+                cb(req, arg);
+            free_request(req);
+            n++;
+        }
+    }
+    else
+        *failed = 1;
+    harness_jmp = NULL;
+    fclose(in);
+    return (n);
+}
+
+#endif
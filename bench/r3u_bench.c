@@ -0,0 +1,738 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "80"
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DURATION 10
+#define MAX_PIPELINE 64
+#define MAX_MIX 1024
+#define READ_BUFSIZE 65536
+#define HIST_SUB_BITS 8
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << (HIST_SUB_BITS - 1))
+#define USAGE "Usage: %s [--host=h] [--port=n] [--connections=n]\n"             \
+              "       [--duration=sec | --requests=n] [--keep-alive]\n"         \
+              "       [--pipeline=n] [--mix=file] [path...]\n"
+
+struct MixEntry
+{
+    char *path;
+    int weight;
+    char *request;
+    size_t request_len;
+};
+
+/* Log-linear histogram in the style of HdrHistogram: every power of two is
+   split into 2^(HIST_SUB_BITS-1) linear buckets, which keeps the relative
+   error under 1% from microseconds up to hours in a fixed array. */
+struct Histogram
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+struct Pending
+{
+    int mix;
+    uint64_t sent_at;
+};
+
+struct Connection
+{
+    int fd;
+    int connected;
+    int want_out;
+    struct Pending pending[MAX_PIPELINE];
+    int head;
+    int npending;
+    char *wbuf;
+    size_t wlen;
+    size_t woff;
+    char *rbuf;
+    size_t rlen;
+    long body_left;
+    int in_body;
+    int close_delimited;
+    int server_closes;
+    int status;
+};
+
+struct Stats
+{
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t status[6];
+    struct Histogram latency;
+};
+
+static struct option longopts[] = {
+    {"host", required_argument, NULL, 'H'},
+    {"port", required_argument, NULL, 'p'},
+    {"connections", required_argument, NULL, 'c'},
+    {"duration", required_argument, NULL, 'd'},
+    {"requests", required_argument, NULL, 'n'},
+    {"pipeline", required_argument, NULL, 'P'},
+    {"keep-alive", no_argument, NULL, 'k'},
+    {"mix", required_argument, NULL, 'm'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0},
+};
+
+static char *host = DEFAULT_HOST;
+static char *port = DEFAULT_PORT;
+static int nconnections = DEFAULT_CONNECTIONS;
+static int duration = DEFAULT_DURATION;
+static long max_requests = 0;
+static int pipeline = 1;
+static int keep_alive = 0;
+static struct MixEntry mix[MAX_MIX];
+static int nmix = 0;
+static int total_weight = 0;
+static struct addrinfo *target;
+static struct Stats stats;
+static uint64_t issued = 0;
+static uint32_t rng_state = 2463534242u;
+
+static void add_mix(char *path, int weight);
+static void load_mix(char *file);
+static void build_requests(void);
+static void resolve_target(void);
+static void open_connection(int epfd, struct Connection *c);
+static void close_connection(int epfd, struct Connection *c);
+static void fill_pipeline(struct Connection *c, uint64_t now);
+static int flush_connection(struct Connection *c);
+static void update_events(int epfd, struct Connection *c);
+static int read_responses(struct Connection *c, uint64_t now);
+static int parse_response(struct Connection *c, uint64_t now);
+static void complete_response(struct Connection *c, uint64_t now);
+static int pick_request(void);
+static int want_more(uint64_t now, uint64_t deadline);
+static uint32_t xorshift32(void);
+static void hist_record(struct Histogram *h, uint64_t v);
+static uint64_t hist_percentile(struct Histogram *h, double p);
+static int hist_index(uint64_t v);
+static uint64_t hist_value(int idx);
+static void report(double elapsed);
+static uint64_t now_usec(void);
+static int parse_int(char *name, char *val, int min);
+static void *xmalloc(size_t sz);
+static void die(char *fmt, ...);
+
+int main(int argc, char **argv)
+{
+    struct Connection *conns;
+    struct epoll_event events[256];
+    uint64_t start, deadline, now;
+    int epfd;
+    int opt;
+    int active;
+
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'c':
+            nconnections = parse_int("--connections", optarg, 1);
+            break;
+        case 'd':
+            duration = parse_int("--duration", optarg, 1);
+            break;
+        case 'n':
+            max_requests = parse_int("--requests", optarg, 1);
+            break;
+        case 'P':
+            pipeline = parse_int("--pipeline", optarg, 1);
+            if (pipeline > MAX_PIPELINE)
+                die("--pipeline must be at most %d", MAX_PIPELINE);
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'm':
+            load_mix(optarg);
+            break;
+        case 'h':
+            fprintf(stdout, USAGE, argv[0]);
+            exit(0);
+        case '?':
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    while (optind < argc)
+        add_mix(argv[optind++], 1);
+    if (nmix == 0)
+        add_mix("/", 1);
+    if (!keep_alive)
+        pipeline = 1;
+    build_requests();
+    resolve_target();
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        die("epoll_create1(2) failed: %s", strerror(errno));
+    conns = (struct Connection *)xmalloc(sizeof(struct Connection) * nconnections);
+    memset(conns, 0, sizeof(struct Connection) * nconnections);
+    memset(&stats, 0, sizeof(stats));
+    stats.latency.min = UINT64_MAX;
+    start = now_usec();
+    deadline = start + (uint64_t)duration * 1000000;
+    for (int i = 0; i < nconnections; i++)
+    {
+        conns[i].rbuf = (char *)xmalloc(READ_BUFSIZE);
+        conns[i].wbuf = NULL;
+        conns[i].fd = -1;
+        open_connection(epfd, &conns[i]);
+    }
+    active = nconnections;
+    while (active > 0)
+    {
+        int n;
+
+        n = epoll_wait(epfd, events, 256, 100);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait(2) failed: %s", strerror(errno));
+        }
+        now = now_usec();
+        for (int i = 0; i < n; i++)
+        {
+            struct Connection *c = (struct Connection *)events[i].data.ptr;
+            int ok = 1;
+
+            if (c->fd < 0)
+                continue;
+            if (!c->connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err)
+                    ok = 0;
+                else
+                {
+                    c->connected = 1;
+                    stats.connects++;
+                    fill_pipeline(c, now);
+                }
+            }
+            if (ok && c->connected && (events[i].events & EPOLLOUT))
+                ok = flush_connection(c);
+            if (ok && c->connected && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                ok = read_responses(c, now);
+            if (!ok)
+            {
+                close_connection(epfd, c);
+                if (want_more(now, deadline))
+                    open_connection(epfd, c);
+                else
+                    active--;
+                continue;
+            }
+            if (c->npending == 0 && !want_more(now, deadline))
+            {
+                close_connection(epfd, c);
+                active--;
+                continue;
+            }
+            fill_pipeline(c, now);
+            if (!flush_connection(c))
+            {
+                close_connection(epfd, c);
+                if (want_more(now, deadline))
+                    open_connection(epfd, c);
+                else
+                    active--;
+                continue;
+            }
+            update_events(epfd, c);
+        }
+        /* Give stragglers a grace period instead of waiting forever. */
+        if (!max_requests && now > deadline + 5000000)
+            break;
+    }
+    report((now_usec() - start) / 1e6);
+    exit(stats.requests > 0 ? 0 : 1);
+}
+
+static void add_mix(char *path, int weight)
+{
+    if (nmix == MAX_MIX)
+        die("too many request paths (max %d)", MAX_MIX);
+    mix[nmix].path = strdup(path);
+    mix[nmix].weight = weight;
+    total_weight += weight;
+    nmix++;
+}
+
+/* A mix file has one "weight path" pair per line; # starts a comment. */
+static void load_mix(char *file)
+{
+    FILE *f;
+    char line[4096];
+
+    f = fopen(file, "r");
+    if (!f)
+        die("%s: %s", file, strerror(errno));
+    while (fgets(line, sizeof(line), f))
+    {
+        char path[4096];
+        int weight;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%d %4095s", &weight, path) != 2 || weight <= 0)
+            die("%s: malformed line: %s", file, line);
+        add_mix(path, weight);
+    }
+    fclose(f);
+}
+
+static void build_requests(void)
+{
+    for (int i = 0; i < nmix; i++)
+    {
+        char buf[8192];
+        int n;
+
+        n = snprintf(buf, sizeof(buf),
+                     "GET %s HTTP/1.1\r\n"
+                     "Host: %s:%s\r\n"
+                     "User-Agent: r3u-bench\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n",
+                     mix[i].path, host, port, keep_alive ? "keep-alive" : "close");
+        if (n < 0 || (size_t)n >= sizeof(buf))
+            die("request for %s is too long", mix[i].path);
+        mix[i].request = strdup(buf);
+        mix[i].request_len = n;
+    }
+}
+
+static void resolve_target(void)
+{
+    struct addrinfo hints;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &target)) != 0)
+        die("%s: %s", host, gai_strerror(err));
+}
+
+static void open_connection(int epfd, struct Connection *c)
+{
+    struct epoll_event ev;
+    int on = 1;
+
+    c->fd = socket(target->ai_family, target->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, target->ai_protocol);
+    if (c->fd < 0)
+        die("socket(2) failed: %s", strerror(errno));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    c->connected = 0;
+    c->head = 0;
+    c->rlen = 0;
+    c->woff = 0;
+    c->wlen = 0;
+    c->in_body = 0;
+    c->server_closes = 0;
+    if (connect(c->fd, target->ai_addr, target->ai_addrlen) < 0 && errno != EINPROGRESS)
+    {
+        stats.errors++;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    c->want_out = 1;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        die("epoll_ctl(2) failed: %s", strerror(errno));
+}
+
+/* Requests still in flight when the server closes are not errors: the
+   server answers one request per connection, so they are simply issued
+   again on the next connection. */
+static void close_connection(int epfd, struct Connection *c)
+{
+    if (c->fd < 0)
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    issued -= c->npending;
+    c->npending = 0;
+    free(c->wbuf);
+    c->wbuf = NULL;
+}
+
+static void fill_pipeline(struct Connection *c, uint64_t now)
+{
+    size_t need = c->wlen - c->woff;
+    char *buf;
+    int room;
+
+    if (c->server_closes)
+        return;
+    room = pipeline - c->npending;
+    if (room <= 0)
+        return;
+    buf = (char *)xmalloc(need + (size_t)room * 8192);
+    memcpy(buf, c->wbuf ? c->wbuf + c->woff : "", need);
+    while (room-- > 0 && want_more(now, UINT64_MAX))
+    {
+        int idx = pick_request();
+        struct Pending *p = &c->pending[(c->head + c->npending) % MAX_PIPELINE];
+
+        memcpy(buf + need, mix[idx].request, mix[idx].request_len);
+        need += mix[idx].request_len;
+        p->mix = idx;
+        p->sent_at = now;
+        c->npending++;
+        issued++;
+        if (!keep_alive)
+            break;
+    }
+    free(c->wbuf);
+    c->wbuf = buf;
+    c->wlen = need;
+    c->woff = 0;
+}
+
+static int flush_connection(struct Connection *c)
+{
+    while (c->woff < c->wlen)
+    {
+        ssize_t n;
+
+        n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+                return (1);
+            if (errno == EINTR)
+                continue;
+            return (0);
+        }
+        c->woff += n;
+    }
+    return (1);
+}
+
+/* Epoll is level-triggered, so EPOLLOUT is only requested while there
+   is unsent data or a connect(2) in progress. */
+static void update_events(int epfd, struct Connection *c)
+{
+    struct epoll_event ev;
+    int want_out = !c->connected || c->woff < c->wlen;
+
+    if (want_out == c->want_out)
+        return;
+    c->want_out = want_out;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        die("epoll_ctl(2) failed: %s", strerror(errno));
+}
+
+static int read_responses(struct Connection *c, uint64_t now)
+{
+    while (1)
+    {
+        ssize_t n;
+
+        n = recv(c->fd, c->rbuf + c->rlen, READ_BUFSIZE - c->rlen, 0);
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+                return (1);
+            if (errno == EINTR)
+                continue;
+            if (c->npending)
+                stats.errors++;
+            return (0);
+        }
+        if (n == 0)
+        {
+            /* Responses without Content-Length end at EOF. */
+            if (c->npending && c->status && (c->close_delimited || !c->in_body))
+                complete_response(c, now);
+            else if (c->npending && !c->server_closes)
+                stats.errors++;
+            return (0);
+        }
+        stats.bytes += n;
+        c->rlen += n;
+        while (c->rlen > 0 && c->npending > 0)
+        {
+            int r = parse_response(c, now);
+
+            if (r < 0)
+            {
+                stats.errors++;
+                return (0);
+            }
+            if (r == 0)
+                break;
+        }
+        if (c->rlen == READ_BUFSIZE)
+            die("response header larger than %d bytes", READ_BUFSIZE);
+    }
+}
+
+/* Returns 1 when progress was made, 0 when more input is needed and -1 on
+   a malformed response. Bodies are counted and discarded, never stored. */
+static int parse_response(struct Connection *c, uint64_t now)
+{
+    if (!c->in_body)
+    {
+        char *end;
+        char *line;
+        char *p;
+
+        end = memmem(c->rbuf, c->rlen, "\r\n\r\n", 4);
+        if (!end && c->rlen < 12)
+            return (0);
+        if (strncmp(c->rbuf, "HTTP/1.", 7) != 0)
+            return (-1);
+        c->status = atoi(c->rbuf + 9);
+        if (!end)
+            return (0);
+        *end = '\0';
+        c->body_left = -1;
+        c->close_delimited = 0;
+        for (line = strstr(c->rbuf, "\r\n"); line; line = strstr(line, "\r\n"))
+        {
+            line += 2;
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+                c->body_left = atol(line + 15);
+            else if (strncasecmp(line, "Connection:", 11) == 0)
+            {
+                p = line + 11 + strspn(line + 11, " \t");
+                if (strncasecmp(p, "close", 5) == 0)
+                    c->server_closes = 1;
+            }
+        }
+        if (c->body_left < 0)
+        {
+            c->close_delimited = 1;
+            c->body_left = 0;
+        }
+        if (c->pending[c->head].mix >= 0 && strncmp(mix[c->pending[c->head].mix].request, "HEAD", 4) == 0)
+            c->body_left = 0;
+        end += 4;
+        c->rlen -= end - c->rbuf;
+        memmove(c->rbuf, end, c->rlen);
+        c->in_body = 1;
+    }
+    if (c->close_delimited)
+    {
+        c->rlen = 0;
+        return (0);
+    }
+    if ((long)c->rlen < c->body_left)
+    {
+        c->body_left -= c->rlen;
+        c->rlen = 0;
+        return (0);
+    }
+    c->rlen -= c->body_left;
+    memmove(c->rbuf, c->rbuf + c->body_left, c->rlen);
+    complete_response(c, now);
+    return (1);
+}
+
+static void complete_response(struct Connection *c, uint64_t now)
+{
+    struct Pending *p = &c->pending[c->head];
+    int cls = c->status / 100;
+
+    hist_record(&stats.latency, now - p->sent_at);
+    stats.requests++;
+    stats.status[cls >= 1 && cls <= 5 ? cls : 0]++;
+    c->head = (c->head + 1) % MAX_PIPELINE;
+    c->npending--;
+    c->in_body = 0;
+    c->status = 0;
+}
+
+static int pick_request(void)
+{
+    int r;
+
+    if (nmix == 1)
+        return (0);
+    r = xorshift32() % total_weight;
+    for (int i = 0; i < nmix; i++)
+    {
+        r -= mix[i].weight;
+        if (r < 0)
+            return (i);
+    }
+    return (nmix - 1);
+}
+
+static int want_more(uint64_t now, uint64_t deadline)
+{
+    if (max_requests)
+        return (issued < (uint64_t)max_requests);
+    return (now < deadline);
+}
+
+static uint32_t xorshift32(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (rng_state);
+}
+
+static void hist_record(struct Histogram *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static uint64_t hist_percentile(struct Histogram *h, double p)
+{
+    uint64_t target = (uint64_t)(h->total * p / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= target)
+        {
+            uint64_t v = hist_value(i);
+
+            return (v > h->max ? h->max : v);
+        }
+    }
+    return (h->max);
+}
+
+static int hist_index(uint64_t v)
+{
+    int shift;
+
+    if (v < (1u << HIST_SUB_BITS))
+        return ((int)v);
+    shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+    return ((shift << (HIST_SUB_BITS - 1)) + (int)(v >> shift));
+}
+
+/* Upper edge of a bucket, so percentiles never understate latency. */
+static uint64_t hist_value(int idx)
+{
+    int shift;
+
+    if (idx < (1 << HIST_SUB_BITS))
+        return ((uint64_t)idx);
+    shift = (idx >> (HIST_SUB_BITS - 1)) - 1;
+    return ((((uint64_t)(idx - (shift << (HIST_SUB_BITS - 1))) + 1) << shift) - 1);
+}
+
+static void report(double elapsed)
+{
+    struct Histogram *h = &stats.latency;
+
+    printf("target          %s:%s (%d paths)\n", host, port, nmix);
+    printf("connections     %d (%s, pipeline %d)\n", nconnections,
+           keep_alive ? "keep-alive" : "close", pipeline);
+    printf("duration        %.2f s\n", elapsed);
+    printf("requests        %llu (%.1f req/s)\n", (unsigned long long)stats.requests,
+           stats.requests / elapsed);
+    printf("transfer        %.2f MiB (%.2f MiB/s)\n", stats.bytes / 1048576.0,
+           stats.bytes / 1048576.0 / elapsed);
+    printf("connects        %llu\n", (unsigned long long)stats.connects);
+    printf("errors          %llu\n", (unsigned long long)stats.errors);
+    printf("status          2xx=%llu 3xx=%llu 4xx=%llu 5xx=%llu other=%llu\n",
+           (unsigned long long)stats.status[2], (unsigned long long)stats.status[3],
+           (unsigned long long)stats.status[4], (unsigned long long)stats.status[5],
+           (unsigned long long)(stats.status[0] + stats.status[1]));
+    if (h->total == 0)
+        return;
+    printf("latency (usec)  min=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n",
+           (unsigned long long)h->min,
+           (unsigned long long)hist_percentile(h, 50.0),
+           (unsigned long long)hist_percentile(h, 90.0),
+           (unsigned long long)hist_percentile(h, 99.0),
+           (unsigned long long)hist_percentile(h, 99.9),
+           (unsigned long long)h->max);
+}
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static int parse_int(char *name, char *val, int min)
+{
+    char *end;
+    long n;
+
+    n = strtol(val, &end, 10);
+    if (*val == '\0' || *end != '\0' || n < min || n > 1000000000)
+        die("invalid value for %s: %s", name, val);
+    return ((int)n);
+}
+
+static void *xmalloc(size_t sz)
+{
+    void *p;
+
+    p = malloc(sz);
+    if (!p)
+        die("failed to allocate memory");
+    return (p);
+}
+
+static void die(char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
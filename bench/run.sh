@@ -0,0 +1,84 @@
+#!/bin/sh
+# Builds the server and the load generator, serves a copy of root/ plus
+# generated fixtures of several sizes on localhost, and runs each scenario.
+#
+# Usage: bench/run.sh [scenario...]
+# Environment: PORT (default 18080), DURATION (default 10),
+#              CONNECTIONS (default 32), CFLAGS (default -O2)
+
+set -eu
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+port=${PORT:-18080}
+duration=${DURATION:-10}
+connections=${CONNECTIONS:-32}
+cflags=${CFLAGS:--O2}
+work=$(mktemp -d "${TMPDIR:-/tmp}/r3u-bench.XXXXXX")
+server_pid=
+
+cleanup() {
+    [ -n "$server_pid" ] && kill "$server_pid" 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+gcc -Wall -Wextra -Werror $cflags -o "$work/r3u_http" "$top/r3u_http.c"
+gcc -Wall -Wextra -Werror $cflags -o "$work/r3u_bench" "$top/bench/r3u_bench.c"
+
+# Fixture sizes follow a rough web asset distribution: many small files,
+# fewer medium ones and a handful of large downloads.
+docroot="$work/root"
+cp -R "$top/root" "$docroot"
+mkdir -p "$docroot/small" "$docroot/medium" "$docroot/large"
+for i in $(seq 1 100); do
+    head -c 1024 /dev/urandom >"$docroot/small/$i.bin"
+done
+for i in $(seq 1 20); do
+    head -c 65536 /dev/urandom >"$docroot/medium/$i.bin"
+done
+for i in $(seq 1 4); do
+    head -c 1048576 /dev/urandom >"$docroot/large/$i.bin"
+done
+head -c 16777216 /dev/urandom >"$docroot/large/huge.bin"
+
+{
+    for i in $(seq 1 100); do echo "8 /small/$i.bin"; done
+    for i in $(seq 1 20); do echo "7 /medium/$i.bin"; done
+    for i in $(seq 1 4); do echo "5 /large/$i.bin"; done
+} >"$work/mixed.mix"
+
+"$work/r3u_http" --debug --port="$port" "$docroot" 2>"$work/server.log" &
+server_pid=$!
+sleep 0.5
+
+bench() {
+    name=$1
+    shift
+    echo "== $name"
+    "$work/r3u_bench" --port="$port" --duration="$duration" "$@"
+    echo
+}
+
+scenario() {
+    case $1 in
+    index) bench index --connections="$connections" /index.html ;;
+    small) bench small --connections="$connections" /small/1.bin ;;
+    medium) bench medium --connections="$connections" /medium/1.bin ;;
+    large) bench large --connections=8 /large/1.bin ;;
+    huge) bench huge --connections=4 /large/huge.bin ;;
+    mixed) bench mixed --connections="$connections" --mix="$work/mixed.mix" ;;
+    notfound) bench notfound --connections="$connections" /missing ;;
+    pipelined) bench pipelined --connections="$connections" --keep-alive --pipeline=8 /index.html ;;
+    *)
+        echo "unknown scenario: $1" >&2
+        exit 1
+        ;;
+    esac
+}
+
+if [ $# -eq 0 ]; then
+    set -- index small medium large huge mixed notfound pipelined
+fi
+for s in "$@"; do
+    scenario "$s"
+done
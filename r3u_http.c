@@ -1,38 +1,422 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
+#include <limits.h>
 #include <linux/limits.h>
+#include <linux/openat2.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pwd.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <sched.h>
+#include <stdint.h>
 #include <syslog.h>
+#include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include <libgen.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+/* USDT probes compile to a single nop when sys/sdt.h is available and to
+   nothing otherwise. List them with "bpftrace -l 'usdt:./r3u_http:*'". */
+#ifndef DTRACE_PROBE2
+#define DTRACE_PROBE2(provider, name, a1, a2) ((void)0)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3) ((void)0)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4) ((void)0)
+#endif
+
+#ifdef R3U_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+#include "r3u_pack.h"
+#include "r3u_hpack.h"
 
 #define SERVER_NAME "r3u http"
 #define SERVER_VERSION "0.0.1"
 #define MAX_REQUEST_BODY_LENGTH 4194304
+#define BODY_BUFFER_SIZE 65536
 #define MAX_BACKLOG 5
 #define DEFAULT_PORT "80"
-#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] <docroot>\n"
+#define DEFAULT_IDLE_TIMEOUT 15
+#define DEFAULT_HEADER_TIMEOUT 15
+#define DEFAULT_BODY_TIMEOUT 60
+#define DEFAULT_WRITE_TIMEOUT 60
+#define DEFAULT_RETRY_AFTER 1
+#define LAG_EWMA_SHIFT 3
+#define UPGRADE_READY_TIMEOUT 10
+#define ENV_LISTEN_FD "R3U_LISTEN_FD"
+#define ENV_CONNECTIONS "R3U_CONNECTIONS"
+#define ENV_READY_FD "R3U_READY_FD"
+#define ENV_ADMIN_FD "R3U_ADMIN_FD"
+#define ENV_METRICS_FD "R3U_METRICS_FD"
+#define METRICS_MAGIC 0x72337506
+#define METRICS_PATH "/metrics"
+#define DEFAULT_PATH_CACHE_SLOTS 4096
+#define DEFAULT_PATH_CACHE_TTL 1
+#define PATH_CACHE_KEY_MAX 256
+#define INDEX_FILE "index.html"
+#define AUTOINDEX_SLOTS 64
+#define AUTOINDEX_SLOT_SIZE 262144
+#define WATCH_EPOCHS 4096
+#define WATCH_EVENTS (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+#define WATCH_BUFSIZE 65536
+#define MAX_ROUTES 16
+#define MAX_BACKENDS 16
+#define PROXY_HEAD_MAX 16384
+#define PROXY_SPLICE_CHUNK 65536
+#define DEFAULT_PROXY_CONNECT_TIMEOUT 5
+#define DEFAULT_PROXY_TIMEOUT 60
+#define DEFAULT_PROXY_RETRIES 1
+#define PROXY_MAX_FAILS 2
+#define PROXY_FAIL_TIMEOUT 10
+#define ROUTE_PROXY 0
+#define ROUTE_FASTCGI 1
+#define ROUTE_WEBSOCKET 2
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_READ_CHUNK 16384
+#define WEBSOCKET_PROTOCOL_ERROR 1002
+#define FCGI_VERSION 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_REQUEST_ID 1
+#define FCGI_RECORD_MAX 65535
+#define FCGI_STDIN_CHUNK 32768
+#define PROXY_RING_POINTS 160
+#define MICROCACHE_ENTRY_SIZE 65536
+#define MICROCACHE_KEY_MAX 512
+#define MICROCACHE_WAYS 4
+#define MICROCACHE_LEASES 1024
+#define MICROCACHE_POLL_USEC 5000
+#define MICROCACHE_PASS_USEC 10000000L
+#define DEFAULT_DISK_CACHE_SIZE 1024
+#define DISK_CACHE_MAGIC 0x72337543
+#define DISK_CACHE_VERSION 1
+#define DISK_CACHE_SLAB_SIZE 67108864
+#define DISK_CACHE_MAX_SLABS 256
+#define DISK_CACHE_OBJECT_MAX 8388608
+#define DISK_CACHE_PROBES 8
+#define DISK_OBJECT_MAGIC 0x72336f62
+#define PROXY_HASH_LOAD 1.25
+#define H2_PREFACE_LINE "PRI * HTTP/2.0\r\n"
+#define H2_PREFACE_REST "\r\nSM\r\n\r\n"
+#define H2_FRAME_SIZE 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 2147483647
+#define H2_MAX_STREAMS 128
+#define H2_DEFAULT_WEIGHT 16
+#define H2_HEADER_TABLE_SIZE 4096
+#define H2_HEADER_BLOCK_MAX 65536
+#define H2_HEADER_LIST_MAX 65536
+#define H2_OUTPUT_HIGH 262144
+#define H2_DATA 0
+#define H2_HEADERS 1
+#define H2_PRIORITY 2
+#define H2_RST_STREAM 3
+#define H2_SETTINGS 4
+#define H2_PUSH_PROMISE 5
+#define H2_PING 6
+#define H2_GOAWAY 7
+#define H2_WINDOW_UPDATE 8
+#define H2_CONTINUATION 9
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+#define H2_SETTINGS_HEADER_TABLE_SIZE 1
+#define H2_SETTINGS_ENABLE_PUSH 2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 4
+#define H2_SETTINGS_MAX_FRAME_SIZE 5
+#define H2_NO_ERROR 0
+#define H2_PROTOCOL_ERROR 1
+#define H2_INTERNAL_ERROR 2
+#define H2_FLOW_CONTROL_ERROR 3
+#define H2_STREAM_CLOSED 5
+#define H2_FRAME_SIZE_ERROR 6
+#define H2_REFUSED_STREAM 7
+#define H2_COMPRESSION_ERROR 9
+#define H2_ENHANCE_YOUR_CALM 11
+#define HPACK_DYNAMIC_ENTRIES (H2_HEADER_TABLE_SIZE / 32)
+#define ENV_HELPER_PIDS "R3U_HELPER_PIDS"
+#define MAX_HELPERS 16
+#define MAX_ADMIN_CONNECTIONS 8
+#define ACCESS_LOG_LINE_MAX PIPE_BUF
+#define ACCESS_LOG_FIELD_MAX 512
+#define ACCESS_LOG_BUFSIZE 262144
+#define ACCESS_LOG_PIPESIZE 1048576
+#define ACCESS_LOG_FLUSH_INTERVAL 1000
+#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g]\n" \
+              "       [--tcp-nodelay] [--quickack] [--sndbuf=n] [--rcvbuf=n]\n" \
+              "       [--notsent-lowat=n] [--busy-poll=usec]\n" \
+              "       [--idle-timeout=sec] [--header-timeout=sec]\n" \
+              "       [--body-timeout=sec] [--write-timeout=sec]\n" \
+              "       [--max-connections=n [--overload=pause|reject]]\n" \
+              "       [--shed-lag=msec] [--retry-after=sec]\n" \
+              "       [--admin-port=n] [--access-log=path\n" \
+              "       [--access-log-format=common|combined|json]]\n" \
+              "       [--trace-phases] [--slow-request=msec] [--snapshot[=pack]]\n" \
+              "       [--path-cache=slots] [--path-cache-ttl=sec] [--autoindex] [--watch]\n" \
+              "       [--proxy=/prefix=host:port[,host:port...]] [--proxy-timeout=sec]\n" \
+              "       [--proxy-connect-timeout=sec] [--proxy-retries=n]\n" \
+              "       [--proxy-balance=/prefix=rr|leastconn|p2c|hash[:header]]\n" \
+              "       [--fastcgi=/prefix=unix:path|host:port[,...]]\n" \
+              "       [--websocket=/prefix=unix:path|host:port[,...]] [--microcache=MiB]\n" \
+              "       [--disk-cache=dir [--disk-cache-size=MiB]]\n" \
+              "       [--tls-cert=file [--tls-key=file]] [--spool-dir=dir] <docroot>\n"
 
 static int debug_mode = 0;
 
+struct SocketOptions
+{
+    int nodelay;
+    int quickack;
+    int sndbuf;
+    int rcvbuf;
+    int notsent_lowat;
+    int busy_poll;
+};
+
+static struct SocketOptions sockopts = {0, 0, 0, 0, 0, 0};
+
+struct Timeouts
+{
+    int idle;
+    int header;
+    int body;
+    int write;
+};
+
+static struct Timeouts timeouts = {
+    DEFAULT_IDLE_TIMEOUT,
+    DEFAULT_HEADER_TIMEOUT,
+    DEFAULT_BODY_TIMEOUT,
+    DEFAULT_WRITE_TIMEOUT,
+};
+static char *deadline_phase = NULL;
+
+/* Points in the life of a request; phase i runs from stamp i to i + 1. */
+enum
+{
+    STAMP_ACCEPT,
+    STAMP_FIRST_BYTE,
+    STAMP_PARSED,
+    STAMP_RESOLVED,
+    STAMP_FIRST_WRITE,
+    STAMP_COMPLETE,
+    STAMP_SLOTS,
+};
+
+#define PHASE_SLOTS (STAMP_SLOTS - 1)
+
+static char *phase_names[PHASE_SLOTS] = {"wait", "header", "resolve", "respond", "transfer"};
+
+struct Tracing
+{
+    int enabled;
+    long slow_usec;
+};
+
+static struct Tracing tracing = {0, 0};
+
+struct Overload
+{
+    int max_connections;
+    int reject;
+    int shed_lag;
+    int retry_after;
+    long lag;
+    char response[256];
+    int response_len;
+};
+
+static struct Overload overload = {0, 0, 0, DEFAULT_RETRY_AFTER, 0, "", 0};
+static volatile sig_atomic_t active_connections = 0;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile pid_t successor_pid = 0;
+static int upgrade_fd = -1;
+static long upgrade_deadline = 0;
+static char *exec_path = NULL;
+static char **exec_argv = NULL;
+static char *admin_port = NULL;
+static int admin_fd = -1;
+
+enum
+{
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_POST,
+    METHOD_OTHER,
+    METHOD_SLOTS,
+};
+
+static char *metric_methods[METHOD_SLOTS] = {"GET", "HEAD", "POST", "OTHER"};
+static int metric_statuses[] = {200, 206, 304, 400, 403, 404, 405, 408, 413, 500, 501, 502, 503, 504, 0};
+#define STATUS_SLOTS (int)(sizeof(metric_statuses) / sizeof(int))
+static double latency_bounds[] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+#define LATENCY_SLOTS (int)(sizeof(latency_bounds) / sizeof(double) + 1)
+
+/* One slot per CPU, each on its own cache lines. Writers only touch the
+   slot of the CPU they run on, so increments never bounce a line between
+   cores; a scrape adds all slots up. */
+struct CoreMetrics
+{
+    uint64_t requests[METHOD_SLOTS][STATUS_SLOTS];
+    uint64_t response_bytes;
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t failed;
+    uint64_t latency[LATENCY_SLOTS];
+    uint64_t latency_usec;
+    uint64_t log_dropped;
+    uint64_t phase[PHASE_SLOTS][LATENCY_SLOTS];
+    uint64_t phase_usec[PHASE_SLOTS];
+    uint64_t path_cache_hits;
+    uint64_t path_cache_misses;
+    uint64_t microcache_hits;
+    uint64_t microcache_stale;
+    uint64_t microcache_misses;
+    uint64_t disk_cache_hits;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
+    uint64_t tls_ktls;
+} __attribute__((aligned(64)));
+
+struct Metrics
+{
+    uint32_t magic;
+    uint32_t ncpu;
+    uint64_t size;
+    struct CoreMetrics core[] __attribute__((aligned(64)));
+};
+
+static struct Metrics *metrics = NULL;
+static int metrics_fd = -1;
+
+/* State of the one connection a child process serves. */
+struct Connection
+{
+    int fd;
+    long start;
+    int method;
+    int status;
+    uint64_t bytes_sent;
+    FILE *out;
+    struct HTTPRequest *req;
+    int finished;
+    char peer[INET6_ADDRSTRLEN];
+    long stamp[STAMP_SLOTS];
+    int buffered_only;
+};
+
+static struct Connection conn = {-1, 0, METHOD_OTHER, 0, 0, NULL, NULL, 0, "-", {0}, 0};
+
+enum
+{
+    LOG_FORMAT_COMMON,
+    LOG_FORMAT_COMBINED,
+    LOG_FORMAT_JSON,
+};
+
+/* Connection processes hand finished records to a logger process through
+   a pipe. Records are smaller than PIPE_BUF, so each write(2) is atomic
+   with any number of writers; the write end is non-blocking and a full
+   pipe costs a dropped record instead of a stalled response. */
+struct AccessLog
+{
+    char *path;
+    int format;
+    int fd;
+    int pipe[2];
+    pid_t pid;
+};
+
+static struct AccessLog access_log = {NULL, LOG_FORMAT_COMBINED, -1, {-1, -1}, 0};
+static volatile sig_atomic_t reopen_requested = 0;
+static volatile sig_atomic_t logger_reopen = 0;
+static volatile pid_t helper_pids[MAX_HELPERS];
+static volatile sig_atomic_t nhelpers = 0;
+/* Admin connections are not counted in active_connections, so scrapes
+   never add to the load that --max-connections measures. */
+static volatile pid_t admin_pids[MAX_ADMIN_CONNECTIONS];
+
 static struct option longopts[] = {
     {"debug", no_argument, &debug_mode, 1},
     {"chroot", no_argument, NULL, 'c'},
     {"user", required_argument, NULL, 'u'},
     {"group", required_argument, NULL, 'g'},
     {"port", required_argument, NULL, 'p'},
+    {"tcp-nodelay", no_argument, &sockopts.nodelay, 1},
+    {"quickack", no_argument, &sockopts.quickack, 1},
+    {"sndbuf", required_argument, NULL, 'S'},
+    {"rcvbuf", required_argument, NULL, 'R'},
+    {"notsent-lowat", required_argument, NULL, 'L'},
+    {"busy-poll", required_argument, NULL, 'B'},
+    {"idle-timeout", required_argument, NULL, 'I'},
+    {"header-timeout", required_argument, NULL, 'H'},
+    {"body-timeout", required_argument, NULL, 'T'},
+    {"write-timeout", required_argument, NULL, 'W'},
+    {"max-connections", required_argument, NULL, 'M'},
+    {"overload", required_argument, NULL, 'O'},
+    {"shed-lag", required_argument, NULL, 'G'},
+    {"retry-after", required_argument, NULL, 'A'},
+    {"admin-port", required_argument, NULL, 'a'},
+    {"access-log", required_argument, NULL, 'l'},
+    {"access-log-format", required_argument, NULL, 'f'},
+    {"trace-phases", no_argument, &tracing.enabled, 1},
+    {"slow-request", required_argument, NULL, 'Q'},
+    {"snapshot", optional_argument, NULL, 'N'},
+    {"path-cache", required_argument, NULL, 'C'},
+    {"path-cache-ttl", required_argument, NULL, 't'},
+    {"autoindex", no_argument, NULL, 'i'},
+    {"watch", no_argument, NULL, 'w'},
+    {"proxy", required_argument, NULL, 'P'},
+    {"proxy-timeout", required_argument, NULL, 'x'},
+    {"proxy-connect-timeout", required_argument, NULL, 'k'},
+    {"proxy-retries", required_argument, NULL, 'r'},
+    {"proxy-balance", required_argument, NULL, 'b'},
+    {"fastcgi", required_argument, NULL, 'F'},
+    {"websocket", required_argument, NULL, 'U'},
+    {"microcache", required_argument, NULL, 'm'},
+    {"disk-cache", required_argument, NULL, 'D'},
+    {"disk-cache-size", required_argument, NULL, 'z'},
+    {"tls-cert", required_argument, NULL, 'E'},
+    {"tls-key", required_argument, NULL, 'K'},
+    {"spool-dir", required_argument, NULL, 'y'},
     {"help", no_argument, NULL, 'h'},
     {0, 0, 0, 0},
 };
@@ -47,6 +431,7 @@ struct HTTPHeaderField
 struct HTTPRequest
 {
     int protocol_minor_version;
+    int http2;
     char *method;
     char *path;
     struct HTTPHeaderField *header;
@@ -59,36 +444,744 @@ struct FileInfo
     char *path;
     long size;
     int ok;
+    int dir;
+    int fd;
+};
+
+/* The body of the request this process serves. One that fits the buffer
+   is read into it; a larger one is spooled to an unnamed file in
+   --spool-dir (O_TMPFILE) before the handler runs, so neither takes
+   memory in proportion to its size. Where no spool file can be made, the
+   body is left in the socket and read as the handler takes it, which
+   paces the client to the handler. data points at a body in memory. */
+struct RequestBody
+{
+    FILE *in;
+    long length;
+    long delivered;
+    char *data;
+    int spool;
+    char buf[BODY_BUFFER_SIZE];
+};
+
+static struct RequestBody req_body = {NULL, 0, 0, NULL, -1, {0}};
+
+struct Spool
+{
+    char *dir;
+    int fd;
+};
+
+static struct Spool spool = {P_tmpdir, -1};
+
+static char *docroot_path = NULL;
+static char *document_root = NULL;
+static int docroot_fd = -1;
+static int have_openat2 = 1;
+
+/* --snapshot serves from a pack image instead of the docroot: built in
+   memory at startup, or mapped from a file made by tools/r3u_pack.c. */
+struct Pack
+{
+    int enabled;
+    char *path;
+    int dirfd;
+    char *name;
+    struct PackHeader *image;
+    size_t size;
+    struct stat st;
+    time_t checked;
+};
+
+static struct Pack pack = {0, NULL, -1, NULL, NULL, 0, {0}, 0};
+
+/* Raw request path to resolved file, shared by all connection processes
+   so that a path seen once skips normalization and lstat(2) until the
+   entry expires. Slots are direct mapped and each is guarded by a
+   sequence count: odd while a writer fills it, so readers never see a
+   torn entry and writers never wait for each other. */
+struct PathCacheEntry
+{
+    uint32_t seq;
+    int32_t ok;
+    int32_t dir;
+    uint64_t hash;
+    uint64_t generation;
+    int64_t expires;
+    char raw[PATH_CACHE_KEY_MAX];
+    char path[PATH_CACHE_KEY_MAX];
+} __attribute__((aligned(64)));
+
+struct PathCache
+{
+    int slots;
+    int ttl;
+    struct PathCacheEntry *entry;
+};
+
+static struct PathCache path_cache = {DEFAULT_PATH_CACHE_SLOTS, DEFAULT_PATH_CACHE_TTL, NULL};
+
+/* --watch runs a process that keeps an inotify watch on every directory
+   of the docroot and publishes what changes through shared counters:
+   the generation moves on any change to names or permissions anywhere in
+   the tree, a directory's epoch on any event inside it. Caches remember
+   the counters they were filled under and stay valid while those are
+   current, with no expiry; they fall back to their TTL while the tree is
+   not completely watched. */
+struct WatchState
+{
+    uint64_t generation;
+    uint64_t resets;
+    int32_t complete;
+    uint64_t epoch[WATCH_EPOCHS];
+};
+
+struct Watcher
+{
+    int enabled;
+    pid_t pid;
+    int fd;
+    int lifeline[2];
+    struct WatchState *state;
+};
+
+static struct Watcher watcher = {0, 0, -1, {-1, -1}, NULL};
+
+/* Watcher process only: what each watch descriptor refers to. */
+struct WatchedDir
+{
+    dev_t dev;
+    ino_t ino;
+    char *path;
+};
+
+static struct WatchedDir *watched = NULL;
+static int nwatched = 0;
+static int watch_incomplete = 0;
+
+/* Rendered directory listings, shared like the path cache and kept while
+   the watcher reports no change in the directory. */
+struct AutoindexSlot
+{
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t epoch;
+    uint64_t resets;
+    uint64_t hash;
+    size_t len;
+    char path[PATH_CACHE_KEY_MAX];
+    char data[AUTOINDEX_SLOT_SIZE];
+};
+
+struct Autoindex
+{
+    int enabled;
+    struct AutoindexSlot *slot;
+};
+
+static struct Autoindex autoindex = {0, NULL};
+
+/* --proxy forwards requests under a path prefix to upstream servers, and
+   --fastcgi to FastCGI applications, which share the balancing, health
+   and retry logic. Addresses are resolved once at startup, before
+   chroot(2). */
+struct Backend
+{
+    char *name;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+enum
+{
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONN,
+    BALANCE_P2C,
+    BALANCE_HASH,
+};
+
+/* A point on the consistent hash ring, PROXY_RING_POINTS per backend. */
+struct RingPoint
+{
+    uint64_t hash;
+    int backend;
+};
+
+struct Route
+{
+    char *prefix;
+    size_t prefix_len;
+    int nbackends;
+    struct Backend backend[MAX_BACKENDS];
+    int fastcgi;
+    int websocket;
+    int balance;
+    char *hash_header;
+    int nring;
+    struct RingPoint *ring;
+};
+
+/* Passive health, shared by all connection processes: a backend that
+   failed PROXY_MAX_FAILS times in a row is skipped for a while. */
+struct BackendState
+{
+    uint32_t fails;
+    uint32_t active;
+    int64_t down_until;
+    uint64_t requests;
+    uint64_t failures;
+} __attribute__((aligned(64)));
+
+struct ProxyState
+{
+    uint64_t next[MAX_ROUTES];
+    struct BackendState backend[MAX_ROUTES][MAX_BACKENDS];
+};
+
+struct Proxy
+{
+    int nroutes;
+    struct Route route[MAX_ROUTES];
+    int timeout;
+    int connect_timeout;
+    int retries;
+    int nbalance;
+    char *balance[MAX_ROUTES];
+    struct ProxyState *state;
+    uint32_t *held;
+};
+
+static struct Proxy proxy = {0, {{0}}, DEFAULT_PROXY_TIMEOUT, DEFAULT_PROXY_CONNECT_TIMEOUT, DEFAULT_PROXY_RETRIES, 0, {0}, NULL, NULL};
+
+/* Reads the application's stdout out of the records of one FastCGI
+   connection, without collecting the whole response first. */
+struct FastCGIReader
+{
+    int fd;
+    int type;
+    size_t content;
+    size_t padding;
+    int ended;
+    size_t pos;
+    size_t len;
+    char buf[16384];
+};
+
+static struct FastCGIReader fcgi;
+
+/* Frames from a WebSocket client, unmasked as they stream through: the
+   header being read, then what is left of the payload. phase is the
+   payload offset modulo the 4 bytes of the masking key. */
+struct WebSocketReader
+{
+    unsigned char head[14];
+    size_t head_len;
+    uint64_t left;
+    unsigned char key[4];
+    unsigned int phase;
+};
+
+static struct WebSocketReader ws;
+
+/* --microcache keeps the responses of proxy and FastCGI routes that allow
+   it with Cache-Control or Expires in shared memory, keyed by route, Host
+   and path. An entry goes into one of MICROCACHE_WAYS slots of the set
+   its hash picks, replacing the oldest, and is guarded by a sequence
+   count like the path cache. Times are on the monotonic clock. */
+struct CacheEntry
+{
+    uint32_t seq;
+    int32_t status;
+    uint64_t hash;
+    int64_t stored;
+    int64_t fresh_until;
+    int64_t stale_until;
+    int64_t error_until;
+    uint32_t key_len;
+    uint32_t head_len;
+    uint32_t len;
+    int32_t slab;
+    uint32_t offset;
+    char key[MICROCACHE_KEY_MAX];
+    char status_line[64];
+    char data[MICROCACHE_ENTRY_SIZE];
+} __attribute__((aligned(64)));
+
+/* Whoever takes the lease of a missing key fetches it, and the others
+   requesting it meanwhile wait for the entry instead of going upstream
+   too. A fetch that could not be stored lets later requests for the key
+   pass without waiting for a while. */
+struct CacheLease
+{
+    uint64_t hash;
+    int64_t until;
+    int64_t pass_until;
+} __attribute__((aligned(32)));
+
+struct Microcache
+{
+    int size;
+    int nsets;
+    struct CacheEntry *entry;
+    struct CacheLease *lease;
+};
+
+static struct Microcache microcache = {0, 0, NULL, NULL};
+
+/* --disk-cache adds a second tier on local disk below the microcache.
+   Responses are appended to slab files and found through an open
+   addressing index in a file of its own, mapped shared by all
+   processes, so that a restarted server finds its cache as it was left.
+   Eviction works on whole slabs, with a CLOCK hand that gives slabs read
+   from since it last passed a second chance: reusing a slab bumps its
+   generation, which invalidates every slot still pointing into it. A
+   fetch writes its response and index slot under a lock on the index
+   file; lookups go by sequence counts and are served with sendfile(2)
+   straight from the slab. While a process sends from a slab it holds a
+   read lock on byte 1 + slab of the index file, which eviction skips;
+   the kernel drops it however the process ends. */
+struct DiskSlab
+{
+    uint32_t generation;
+    uint32_t referenced;
+    uint64_t used;
+};
+
+struct DiskCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslabs;
+    uint32_t nslots;
+    uint64_t slab_size;
+    uint32_t hand;
+    uint32_t reserved;
+    struct DiskSlab slab[DISK_CACHE_MAX_SLABS];
+} __attribute__((aligned(64)));
+
+/* Times are on the wall clock, which unlike the monotonic one survives
+   a reboot. */
+struct DiskSlot
+{
+    uint32_t seq;
+    uint32_t slab;
+    uint64_t hash;
+    uint32_t generation;
+    uint32_t offset;
+    int64_t stored;
+    int64_t fresh_until;
+    int64_t stale_until;
+    int64_t error_until;
+} __attribute__((aligned(64)));
+
+/* Precedes the key and the response in a slab. */
+struct DiskObject
+{
+    uint32_t magic;
+    int32_t status;
+    uint32_t key_len;
+    uint32_t head_len;
+    uint32_t len;
+    char status_line[64];
+};
+
+struct DiskCache
+{
+    char *dir;
+    int size;
+    int index_fd;
+    struct DiskCacheHeader *header;
+    struct DiskSlot *slot;
+    int fd[DISK_CACHE_MAX_SLABS];
+};
+
+static struct DiskCache disk_cache = {NULL, DEFAULT_DISK_CACHE_SIZE, -1, NULL, NULL, {0}};
+
+/* The cache lookup of the request this process serves. While capturing,
+   what goes to the client after the status line and common header
+   fields is also collected for storing; while discarding, it only is. */
+struct CacheRequest
+{
+    int active;
+    uint64_t hash;
+    size_t key_len;
+    char key[MICROCACHE_KEY_MAX];
+    struct CacheLease *lease;
+    int64_t lease_until;
+    struct CacheEntry *stale;
+    int capturing;
+    int discard;
+    char status_line[64];
+    size_t len;
+    size_t size;
+    char *buf;
+};
+
+static struct CacheRequest cache_req;
+
+/* --tls-cert: the port speaks TLS only (built with -DR3U_TLS). The
+   context is made by the listener, so the session ticket keys are shared
+   by all its connections; each connection process has its own session.
+   With ktls_send the kernel encrypts, and responses may still go to the
+   socket with sendfile(2) and splice(2). */
+struct Tls
+{
+    char *cert;
+    char *key;
+#ifdef R3U_TLS
+    SSL_CTX *ctx;
+    SSL *ssl;
+#endif
+    int ktls_send;
+};
+
+static struct Tls tls;
+
+struct HpackField
+{
+    char *name;
+    char *value;
+};
+
+/* Entry 62 of the index space is field[head], the newest. */
+struct HpackTable
+{
+    struct HpackField field[HPACK_DYNAMIC_ENTRIES];
+    int head;
+    int count;
+    size_t size;
+    size_t max_size;
+};
+
+struct H2Buffer
+{
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/* A stream is open from its HEADERS until the response has been sent or
+   either side resets it; pid is set once the request is complete. */
+struct H2Stream
+{
+    uint32_t id;
+    struct HTTPRequest *req;
+    char *body;
+    size_t body_len;
+    int spool;
+    pid_t pid;
+    int fd;
+    int eof;
+    int head_sent;
+    int64_t window;
+    uint32_t parent;
+    int weight;
+    uint64_t pass;
+    size_t len;
+    char *buf;
+};
+
+struct H2Connection
+{
+    int fd;
+    uint32_t last_stream;
+    int goaway;
+    int64_t window;
+    uint32_t initial_window;
+    uint32_t max_frame;
+    int nstreams;
+    uint64_t pass;
+    struct H2Stream stream[H2_MAX_STREAMS];
+    struct HpackTable decoder;
+    struct HpackTable encoder;
+    int table_update;
+    char *block;
+    size_t block_len;
+    uint32_t block_stream;
+    int block_end_stream;
+    uint32_t block_parent;
+    int block_weight;
+    int block_malformed;
+    size_t in_len;
+    char in[9 + H2_FRAME_SIZE];
+    struct H2Buffer out;
+};
+
+static struct H2Connection *h2 = NULL;
+
+/* What getdents64(2) returns; glibc does not export it everywhere. */
+struct LinuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
 };
 
 static void setup_environment(char *root, char *user, char *group);
 static void become_daemon();
 static int listen_socket(char *port);
-static void server_main(int server_fd, char *docroot);
-static void service(FILE *in, FILE *out, char *docroot);
+static void tune_socket(int sock, void (*fail)(char *fmt, ...));
+static int parse_int_option(char *name, char *val, int min);
+static void save_exec_args(int argc, char **argv, char *docroot, int do_chroot);
+static char *absolute_path(char *path);
+static int inherited_fd(char *name);
+static int inherited_socket(char *name);
+static void export_fds(int server_fd);
+static void unexport_fds(void);
+static void notify_ready(void);
+static void setup_overload_response(void);
+static void server_main(int server_fd);
+static void accept_connection(int server_fd, sigset_t *mask);
+static void accept_admin(int server_fd, sigset_t *mask);
+static int forget_admin(pid_t pid);
+static FILE *open_input(int sock);
+static ssize_t input_read(void *cookie, char *buf, size_t size);
+static size_t read_buffered(FILE *in, char *buf, size_t size);
+static FILE *open_output(int sock);
+static ssize_t output_write(void *cookie, const char *buf, size_t size);
+static void setup_tls(void);
+static void start_tls(int sock);
+static void tls_handshake(void);
+static void close_tls(void);
+static void drop_tls(void);
+static int direct_output(void);
+static ssize_t sock_read(int fd, void *buf, size_t len);
+static ssize_t sock_write(int fd, const void *buf, size_t len);
+static int sock_pending(void);
+#ifdef R3U_TLS
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg);
+static ssize_t tls_result(int n);
+static char *tls_error(void);
+#endif
+static void setup_metrics(void);
+static struct CoreMetrics *core_metrics(void);
+static void metric_add(uint64_t *counter, uint64_t n);
+static void finish_connection(void);
+static void finish_request(void);
+static void record_metrics(void);
+static void trace_stamp(int stamp);
+static void trace_phases(void);
+static int latency_slot(long usec);
+static void open_access_log(void);
+static void start_logger(void);
+static void logger_main(void);
+static void flush_log_buffer(char *buf, size_t *len);
+static void log_access(void);
+static size_t format_access_log(char *buf, size_t size);
+static size_t append_quoted(char *buf, size_t len, char *s, size_t n, int json);
+static char *header_value(char *name, size_t *len);
+static void add_helper(pid_t pid);
+static int is_helper(pid_t pid);
+static void inherit_helpers(void);
+static int method_slot(char *method);
+static int status_slot(int status);
+static void serve_admin(FILE *in, FILE *out);
+static void output_metrics(struct HTTPRequest *req, FILE *out);
+static int accept_paused(void);
+static void reexec_server(int server_fd);
+static void upgrade_server(int server_fd);
+static pid_t spawn_server(int server_fd, int ready_fd);
+static int upgrade_finished(int ready);
+static void drain_and_exit(int server_fd, sigset_t *waitmask);
+static int overloaded(void);
+static void reject_connection(int sock);
+static void update_lag(long start);
+static long monotonic_usec(void);
+static void service(FILE *in, FILE *out);
 static struct HTTPRequest *read_request(FILE *in);
+static void wait_request(int fd);
+static void set_deadline(int sec, char *phase);
+static void set_write_timeout(int sock);
 static void read_request_line(struct HTTPRequest *req, FILE *in);
 static void uppcase(char *str);
 static struct HTTPHeaderField *read_header_field(FILE *in);
 static long content_length(struct HTTPRequest *req);
+static void setup_spool(void);
+static int open_spool(void);
+static void read_body(FILE *in, long length);
+static void adopt_body(struct HTTPRequest *req, int spool_fd);
+static ssize_t body_chunk(char **data);
+static size_t read_client_body(char *buf, size_t want);
+static int rewind_body(void);
+static void discard_body(void);
+static int send_body(int fd);
 static char *lookup_header_field_value(struct HTTPRequest *req, char *name);
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot);
-static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot);
+static void respond_to(struct HTTPRequest *req, FILE *out);
+static void do_file_response(struct HTTPRequest *req, FILE *out);
+static void send_file(struct HTTPRequest *req, FILE *out, struct FileInfo *info);
+static void send_file_range(int fd, off_t offset, size_t len);
+static void directory_response(struct HTTPRequest *req, FILE *out, struct FileInfo *info);
+static void redirect_to_directory(struct HTTPRequest *req, FILE *out, char *path);
+static void setup_autoindex(void);
+static void autoindex_response(struct HTTPRequest *req, FILE *out, struct FileInfo *info);
+static char *render_autoindex(struct FileInfo *info, size_t *len);
+static int compare_names(const void *a, const void *b);
+static void output_html_escaped(FILE *f, char *s);
+static void output_url_escaped(FILE *f, char *s);
+static void output_query_escaped(FILE *f, char *s, size_t len);
+static char *autoindex_get(struct FileInfo *info, size_t *len);
+static void autoindex_put(char *path, struct stat *st, uint64_t epoch, uint64_t resets, char *data, size_t len);
+static void setup_watcher(char *root);
+static void start_watcher(void);
+static void watcher_main(void);
+static void rescan_tree(void);
+static int watch_dir(const char *path, const struct stat *st, int type, struct FTW *ftw);
+static void handle_watch_events(char *buf, ssize_t n);
+static int watch_current(uint64_t *generation);
+static uint64_t *dir_epoch(dev_t dev, ino_t ino);
 static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status);
+static size_t format_common_header_fields(struct HTTPRequest *req, char *status, char *buf, size_t size);
+static void write_response(struct iovec *iov, int n);
 static char *guess_content_type(struct FileInfo *info);
+static void build_snapshot(char *root);
+static void open_pack(char *path);
+static int load_pack(void);
+static void refresh_pack(void);
+static void snapshot_response(struct HTTPRequest *req, FILE *out);
+static struct PackEntry *snapshot_lookup(char *path);
+static int snapshot_has_index(char *path);
+static int accepts_gzip(struct HTTPRequest *req);
+static int etag_matches(char *header, char *etag, size_t len);
+static void add_route(char *spec, int kind);
+static void setup_proxy(void);
+static struct Route *find_route(struct HTTPRequest *req);
+static void proxy_request(struct HTTPRequest *req, FILE *out, struct Route *route);
+static void forward_request(struct HTTPRequest *req, FILE *out, struct Route *route);
+static void set_balance(char *spec);
+static void build_ring(struct Route *route);
+static int compare_ring_points(const void *a, const void *b);
+static int pick_backend(struct Route *route, struct HTTPRequest *req, uint32_t tried);
+static int pick_round_robin(struct Route *route, uint32_t tried, int pass);
+static int pick_least_conn(struct Route *route, uint32_t tried, int pass);
+static int pick_p2c(struct Route *route, uint32_t tried, int pass);
+static int pick_hash(struct Route *route, struct HTTPRequest *req, uint32_t tried, int pass);
+static int backend_candidate(struct Route *route, int b, uint32_t tried, int pass);
+static void hold_backend(struct Route *route, int b);
+static void release_backend(void);
+static uint64_t mix_hash(uint64_t h);
+static void backend_failed(struct Route *route, int b);
+static int connect_backend(struct Backend *backend);
+static int send_upstream_request(int fd, struct HTTPRequest *req, struct Backend *backend, int upgrade);
+static ssize_t read_upstream_head(int fd, char *buf, size_t size);
+static void relay_response(struct HTTPRequest *req, FILE *out, int fd, char *head, size_t len);
+static void copy_upstream_fields(FILE *out, char *line, char *end, char *skip);
+static void relay_body(int fd);
+static int hop_by_hop(char *name, size_t len);
+static int send_fastcgi_request(int fd, struct HTTPRequest *req);
+static void local_address(char **host, char **port);
+static void add_fastcgi_param(FILE *f, char *name, char *value, size_t len);
+static int write_fastcgi_record(int fd, int type, char *data, size_t len);
+static ssize_t read_fastcgi_head(int fd, char *buf, size_t size);
+static char *cgi_header_end(char *buf, size_t len);
+static ssize_t read_fastcgi(char *buf, size_t size);
+static int fill_fastcgi(size_t need);
+static void relay_fastcgi_response(struct HTTPRequest *req, FILE *out, char *head, size_t len);
+static int writev_all(int fd, struct iovec *iov, int n);
+static void setup_microcache(void);
+static int microcache_key(struct HTTPRequest *req, struct Route *route);
+static struct CacheEntry *microcache_get(void);
+static int microcache_put(void);
+static int microcache_store(struct CacheEntry *src);
+static void setup_disk_cache(void);
+static struct CacheEntry *disk_cache_get(void);
+static int disk_cache_put(struct CacheEntry *src, char *data);
+static int disk_cache_advance(void);
+static int disk_slot_live(struct DiskSlot *slot, time_t now);
+static int disk_slab_lock(uint32_t slab, short type, int cmd);
+static void send_cached_object(struct CacheEntry *e, size_t len);
+static int cache_policy(char *head, size_t len, size_t body_len, long *fresh, long *swr, long *sie);
+static long cache_directive(char *d, size_t len, char *name);
+static struct CacheEntry *await_fill(void);
+static int acquire_lease(void);
+static void release_lease(int stored);
+static void serve_cached(struct HTTPRequest *req, FILE *out, struct CacheEntry *e, char *state);
+static int serve_stale(struct HTTPRequest *req, FILE *out);
+static void revalidate(struct HTTPRequest *req, FILE *out, struct Route *route);
+static void start_capture(struct HTTPRequest *req, FILE *out, char *status);
+static void capture(const char *buf, size_t size);
+static void websocket_request(struct HTTPRequest *req, FILE *out, struct Route *route);
+static int websocket_switched(char *head, size_t len);
+static void websocket_relay(struct HTTPRequest *req, FILE *out, int fd, char *head, size_t len);
+static int websocket_forward(int fd, int *p);
+static int websocket_unmask(unsigned char *p, size_t len);
+static size_t websocket_head_size(unsigned char *head);
+static void websocket_xor(unsigned char *p, size_t len, unsigned char *key, unsigned int phase);
+static void websocket_accept(char *key, size_t len, char *out);
+static void sha1(unsigned char *data, size_t len, unsigned char *digest);
+static void base64_encode(unsigned char *src, size_t len, char *out);
+static void serve_h2(FILE *in);
+static int h2_read_input(void);
+static void h2_process_input(void);
+static void h2_frame(int type, int flags, uint32_t id, unsigned char *p, uint32_t len);
+static void h2_setting(int id, uint32_t value);
+static int h2_unpad(int flags, unsigned char **p, uint32_t *len);
+static void h2_append_block(unsigned char *p, uint32_t len);
+static void h2_header_block(void);
+static struct H2Stream *h2_open(uint32_t id, struct HTTPRequest *req);
+static struct H2Stream *h2_find(uint32_t id);
+static void h2_set_priority(struct H2Stream *st, uint32_t parent, int weight);
+static void h2_start(struct H2Stream *st);
+static void h2_stream_main(struct HTTPRequest *req, int spool_fd, int *p);
+static void h2_store_body(struct H2Stream *st, unsigned char *p, uint32_t len);
+static void h2_read_stream(struct H2Stream *st);
+static void h2_send_headers(struct H2Stream *st, char *head, size_t len);
+static void h2_schedule(void);
+static int h2_blocked(struct H2Stream *st);
+static void h2_close(struct H2Stream *st);
+static void h2_send_settings(void);
+static void h2_window_update(uint32_t id, uint32_t n);
+static void h2_reset(uint32_t id, uint32_t code);
+static void h2_goaway(uint32_t code);
+static void h2_fail(uint32_t code);
+static void h2_queue_frame(int type, int flags, uint32_t id, char *data, size_t len);
+static void h2_flush(void);
+static void h2_append(struct H2Buffer *b, char *data, size_t len);
+static int hpack_decode(struct HpackTable *t, unsigned char *p, size_t len, struct HTTPRequest *req);
+static void h2_add_field(struct HTTPRequest *req, char *name, char *value);
+static int h2_valid_field(char *name, char *value);
+static int hpack_integer(unsigned char **p, unsigned char *end, int prefix, uint32_t *value);
+static char *hpack_string(unsigned char **p, unsigned char *end);
+static char *huffman_decode(unsigned char *src, size_t len);
+static int hpack_field(struct HpackTable *t, uint32_t index, char **name, char **value);
+static void hpack_add(struct HpackTable *t, char *name, char *value);
+static void hpack_evict(struct HpackTable *t);
+static void hpack_resize(struct HpackTable *t, size_t max_size);
+static void hpack_encode(struct HpackTable *t, struct H2Buffer *b, char *name, char *value);
+static void hpack_put_integer(struct H2Buffer *b, int first, int prefix, uint32_t value);
+static void hpack_put_string(struct H2Buffer *b, char *s);
 static void method_not_allowed(struct HTTPRequest *req, FILE *out);
 static void not_implemented(struct HTTPRequest *req, FILE *out);
 static void not_found(struct HTTPRequest *req, FILE *out);
-static struct FileInfo *get_fileinfo(char *docroot, char *urlpath);
-static char *build_fspath(char *docroot, char *urlpath);
+static void bad_request(struct HTTPRequest *req, FILE *out);
+static struct FileInfo *resolve_file(char *raw);
+static int normalize_path(char *raw, char *out, size_t size);
+static int path_needs_normalizing(char *path, size_t len);
+static int hex_value(int c);
+static void setup_path_cache(void);
+static int path_cache_get(char *raw, struct PathCacheEntry *hit);
+static void path_cache_put(char *raw, struct FileInfo *info, char *path, uint64_t generation);
+static struct FileInfo *get_fileinfo(char *urlpath);
+static void open_docroot(char *root);
+static int open_beneath(char *path);
 static void free_fileinfo(struct FileInfo *info);
 static void free_request(struct HTTPRequest *req);
 static void log_exit(char *fmt, ...);
+static void log_message(char *fmt, ...);
 static void *xmalloc(size_t sz);
 static void install_signal_handlers(void);
 static void trap_signal(int sig, __sighandler_t handler, int flags);
 static void signal_exit(int sig);
-static void noop_handler(int sig);
+static void deadline_exit(int sig);
+static void reap_children(int sig);
+static void request_reload(int sig);
+static void request_upgrade(int sig);
+static void request_reopen(int sig);
+static void logger_reopen_handler(int sig);
 
 int main(int argc, char **argv)
 {
@@ -119,6 +1212,130 @@ int main(int argc, char **argv)
         case 'p':
             port = optarg;
             break;
+        case 'S':
+            sockopts.sndbuf = parse_int_option("--sndbuf", optarg, 1);
+            break;
+        case 'R':
+            sockopts.rcvbuf = parse_int_option("--rcvbuf", optarg, 1);
+            break;
+        case 'L':
+            sockopts.notsent_lowat = parse_int_option("--notsent-lowat", optarg, 1);
+            break;
+        case 'B':
+            sockopts.busy_poll = parse_int_option("--busy-poll", optarg, 1);
+            break;
+        case 'I':
+            timeouts.idle = parse_int_option("--idle-timeout", optarg, 0);
+            break;
+        case 'H':
+            timeouts.header = parse_int_option("--header-timeout", optarg, 0);
+            break;
+        case 'T':
+            timeouts.body = parse_int_option("--body-timeout", optarg, 0);
+            break;
+        case 'W':
+            timeouts.write = parse_int_option("--write-timeout", optarg, 0);
+            break;
+        case 'M':
+            overload.max_connections = parse_int_option("--max-connections", optarg, 0);
+            break;
+        case 'O':
+            if (strcmp(optarg, "pause") == 0)
+                overload.reject = 0;
+            else if (strcmp(optarg, "reject") == 0)
+                overload.reject = 1;
+            else
+            {
+                fprintf(stderr, USAGE, argv[0]);
+                exit(1);
+            }
+            break;
+        case 'G':
+            overload.shed_lag = parse_int_option("--shed-lag", optarg, 0);
+            break;
+        case 'A':
+            overload.retry_after = parse_int_option("--retry-after", optarg, 0);
+            break;
+        case 'a':
+            admin_port = optarg;
+            break;
+        case 'l':
+            access_log.path = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "common") == 0)
+                access_log.format = LOG_FORMAT_COMMON;
+            else if (strcmp(optarg, "combined") == 0)
+                access_log.format = LOG_FORMAT_COMBINED;
+            else if (strcmp(optarg, "json") == 0)
+                access_log.format = LOG_FORMAT_JSON;
+            else
+            {
+                fprintf(stderr, USAGE, argv[0]);
+                exit(1);
+            }
+            break;
+        case 'Q':
+            tracing.slow_usec = parse_int_option("--slow-request", optarg, 1) * 1000L;
+            tracing.enabled = 1;
+            break;
+        case 'N':
+            pack.enabled = 1;
+            pack.path = optarg;
+            break;
+        case 'C':
+            path_cache.slots = parse_int_option("--path-cache", optarg, 0);
+            break;
+        case 't':
+            path_cache.ttl = parse_int_option("--path-cache-ttl", optarg, 0);
+            break;
+        case 'i':
+            autoindex.enabled = 1;
+            break;
+        case 'w':
+            watcher.enabled = 1;
+            break;
+        case 'P':
+            add_route(optarg, ROUTE_PROXY);
+            break;
+        case 'F':
+            add_route(optarg, ROUTE_FASTCGI);
+            break;
+        case 'U':
+            add_route(optarg, ROUTE_WEBSOCKET);
+            break;
+        case 'm':
+            microcache.size = parse_int_option("--microcache", optarg, 0);
+            break;
+        case 'D':
+            disk_cache.dir = optarg;
+            break;
+        case 'z':
+            disk_cache.size = parse_int_option("--disk-cache-size", optarg, 1);
+            break;
+        case 'E':
+            tls.cert = optarg;
+            break;
+        case 'K':
+            tls.key = optarg;
+            break;
+        case 'y':
+            spool.dir = optarg;
+            break;
+        case 'x':
+            proxy.timeout = parse_int_option("--proxy-timeout", optarg, 1);
+            break;
+        case 'k':
+            proxy.connect_timeout = parse_int_option("--proxy-connect-timeout", optarg, 1);
+            break;
+        case 'r':
+            proxy.retries = parse_int_option("--proxy-retries", optarg, 0);
+            break;
+        case 'b':
+            if (proxy.nbalance == MAX_ROUTES)
+                log_exit("too many --proxy-balance options (at most %d)", MAX_ROUTES);
+            proxy.balance[proxy.nbalance++] = optarg;
+            break;
         case 'h':
             fprintf(stdout, USAGE, argv[0]);
             exit(0);
@@ -152,51 +1369,283 @@ int main(int argc, char **argv)
     if (!S_ISDIR(fi.st_mode))
         log_exit("%s is not a directory", docroot);
     install_signal_handlers();
+    document_root = strdup(docroot);
+    setup_proxy();
+    setup_microcache();
+    setup_tls();
+    setup_spool();
+    open_access_log();
+    if (pack.path)
+        open_pack(pack.path);
     if (do_chroot)
     {
         setup_environment(docroot, user, group);
         memset(docroot, '\0', sizeof(docroot));
     }
+    save_exec_args(argc, argv, docroot, do_chroot);
+    server_fd = inherited_socket(ENV_LISTEN_FD);
+    admin_fd = inherited_socket(ENV_ADMIN_FD);
+    metrics_fd = inherited_fd(ENV_METRICS_FD);
+    inherit_helpers();
     if (!debug_mode)
     {
         openlog(SERVER_NAME, LOG_PID | LOG_NDELAY, LOG_DAEMON);
-        become_daemon();
+        if (server_fd < 0)
+            become_daemon();
+    }
+    setup_overload_response();
+    if (server_fd < 0)
+        server_fd = listen_socket(port);
+    if (admin_port && admin_fd < 0)
+        admin_fd = listen_socket(admin_port);
+    else if (!admin_port && admin_fd >= 0)
+    {
+        close(admin_fd);
+        admin_fd = -1;
     }
-    server_fd = listen_socket(port);
-    server_main(server_fd, docroot);
+    setup_metrics();
+    if (pack.enabled && !pack.path)
+        build_snapshot(docroot[0] ? docroot : "/");
+    setup_path_cache();
+    open_docroot(docroot[0] ? docroot : "/");
+    setup_watcher(docroot);
+    setup_autoindex();
+    start_logger();
+    server_main(server_fd);
     exit(0);
 }
 
-static void setup_environment(char *root, char *user, char *group)
+static void setup_watcher(char *root)
 {
-    struct passwd *pw;
-    struct group *gr;
+    /* Listings are only worth caching when they can be invalidated. */
+    if (autoindex.enabled)
+        watcher.enabled = 1;
+    if (!watcher.enabled || pack.enabled)
+        return;
+    docroot_path = absolute_path(root[0] ? root : "/");
+    watcher.fd = inotify_init1(IN_CLOEXEC);
+    if (watcher.fd < 0)
+    {
+        log_message("inotify_init1(2) failed, not watching %s: %s", docroot_path, strerror(errno));
+        return;
+    }
+    /* The watcher exits once the last process holding the write end,
+       this generation's listener or one of its connections, is gone. */
+    if (pipe2(watcher.lifeline, O_CLOEXEC) < 0)
+        log_exit("pipe(2) failed: %s", strerror(errno));
+    watcher.state = (struct WatchState *)mmap(NULL, sizeof(struct WatchState), PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (watcher.state == MAP_FAILED)
+        log_exit("mmap(2) failed: %s", strerror(errno));
+}
 
-    if (!(user && group))
+static void start_watcher(void)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0)
     {
-        fprintf(stderr, "use both of --user and --group\n");
-        exit(1);
+        log_message("failed to start watcher: %s", strerror(errno));
+        return;
     }
-    gr = getgrnam(group);
-    if (!gr)
+    if (pid == 0)
+        watcher_main();
+    add_helper(pid);
+    watcher.pid = pid;
+}
+
+static void watcher_main(void)
+{
+    static char buf[WATCH_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    sigset_t mask;
+
+    /* Holding the logger's write end would keep it alive, and it ours. */
+    close(watcher.lifeline[1]);
+    if (access_log.pipe[1] >= 0)
+        close(access_log.pipe[1]);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    rescan_tree();
+    while (1)
     {
-        fprintf(stderr, "no such group: %s\n", group);
-        exit(1);
+        struct pollfd pfd[2];
+        ssize_t n;
+
+        pfd[0].fd = watcher.fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = watcher.lifeline[0];
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) < 0)
+            continue;
+        if (pfd[1].revents)
+            _exit(0);
+        n = read(watcher.fd, buf, sizeof(buf));
+        if (n < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN)
+                log_message("failed to read inotify events: %s", strerror(errno));
+            continue;
+        }
+        handle_watch_events(buf, n);
     }
-    if (setgid(gr->gr_gid) < 0)
+}
+
+/* Watches the whole tree again, for a start and whenever events may have
+   been lost or directories moved. Re-adding a watch returns the existing
+   descriptor, so only the recorded paths change. Everything cached
+   before is retired, both at the start and once the walk is done. */
+static void rescan_tree(void)
+{
+    __atomic_store_n(&watcher.state->complete, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&watcher.state->generation, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&watcher.state->resets, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < nwatched; i++)
     {
-        perror("setgid(2)");
-        exit(1);
+        free(watched[i].path);
+        watched[i].path = NULL;
     }
-    if (initgroups(user, gr->gr_gid) < 0)
+    watch_incomplete = 0;
+    nftw(docroot_path, watch_dir, 64, FTW_PHYS);
+    __atomic_add_fetch(&watcher.state->generation, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&watcher.state->resets, 1, __ATOMIC_RELEASE);
+    if (watch_incomplete)
+        log_message("%s is only partly watched, caches expire by time", docroot_path);
+    else
+        __atomic_store_n(&watcher.state->complete, 1, __ATOMIC_RELEASE);
+}
+
+static int watch_dir(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    int wd;
+
+    (void)ftw;
+    if (type != FTW_D)
+        return (0);
+    wd = inotify_add_watch(watcher.fd, path, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0)
     {
-        perror("initgroups(2)");
-        exit(1);
+        /* Most likely fs.inotify.max_user_watches. */
+        if (!watch_incomplete)
+            log_message("failed to watch %s: %s", path, strerror(errno));
+        watch_incomplete = 1;
+        return (0);
     }
-    pw = getpwnam(user);
-    if (!pw)
+    if (wd >= nwatched)
     {
-        fprintf(stderr, "no such user: %s\n", user);
+        int n = nwatched ? nwatched : 64;
+
+        while (n <= wd)
+            n *= 2;
+        watched = (struct WatchedDir *)realloc(watched, n * sizeof(struct WatchedDir));
+        if (!watched)
+            log_exit("failed to allocate memory");
+        memset(watched + nwatched, 0, (n - nwatched) * sizeof(struct WatchedDir));
+        nwatched = n;
+    }
+    free(watched[wd].path);
+    watched[wd].dev = st->st_dev;
+    watched[wd].ino = st->st_ino;
+    watched[wd].path = strdup(path);
+    return (0);
+}
+
+static void handle_watch_events(char *buf, ssize_t n)
+{
+    int changed = 0, rescan = 0;
+
+    for (char *p = buf; p < buf + n;)
+    {
+        struct inotify_event *ev = (struct inotify_event *)p;
+        struct WatchedDir *d;
+
+        p += sizeof(struct inotify_event) + ev->len;
+        if (ev->mask & IN_Q_OVERFLOW)
+        {
+            rescan = 1;
+            continue;
+        }
+        if (ev->wd < 0 || ev->wd >= nwatched || !watched[ev->wd].path)
+            continue;
+        d = &watched[ev->wd];
+        __atomic_add_fetch(dir_epoch(d->dev, d->ino), 1, __ATOMIC_RELEASE);
+        if (ev->mask & (WATCH_EVENTS & ~IN_MODIFY))
+            changed = 1;
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_MOVED_FROM | IN_MOVED_TO)))
+            rescan = 1;
+        else if ((ev->mask & IN_ISDIR) && (ev->mask & IN_CREATE) && !rescan)
+        {
+            char *path = (char *)xmalloc(strlen(d->path) + ev->len + 2);
+
+            /* Whatever was created inside before the watch is found by
+               the walk. */
+            sprintf(path, "%s/%s", d->path, ev->name);
+            nftw(path, watch_dir, 64, FTW_PHYS);
+            free(path);
+            d = &watched[ev->wd];
+        }
+        if (ev->mask & IN_IGNORED)
+        {
+            free(d->path);
+            d->path = NULL;
+        }
+    }
+    if (rescan)
+        rescan_tree();
+    else if (changed)
+        __atomic_add_fetch(&watcher.state->generation, 1, __ATOMIC_RELEASE);
+}
+
+/* Whether caches can rely on the watcher rather than on expiry. */
+static int watch_current(uint64_t *generation)
+{
+    if (!watcher.state || !__atomic_load_n(&watcher.state->complete, __ATOMIC_ACQUIRE))
+        return (0);
+    if (generation)
+        *generation = __atomic_load_n(&watcher.state->generation, __ATOMIC_ACQUIRE);
+    return (1);
+}
+
+static uint64_t *dir_epoch(dev_t dev, ino_t ino)
+{
+    uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32)) * 0x9e3779b97f4a7c15ULL;
+
+    return (&watcher.state->epoch[(h >> 32) % WATCH_EPOCHS]);
+}
+
+static void setup_environment(char *root, char *user, char *group)
+{
+    struct passwd *pw;
+    struct group *gr;
+
+    if (!(user && group))
+    {
+        fprintf(stderr, "use both of --user and --group\n");
+        exit(1);
+    }
+    gr = getgrnam(group);
+    if (!gr)
+    {
+        fprintf(stderr, "no such group: %s\n", group);
+        exit(1);
+    }
+    if (setgid(gr->gr_gid) < 0)
+    {
+        perror("setgid(2)");
+        exit(1);
+    }
+    if (initgroups(user, gr->gr_gid) < 0)
+    {
+        perror("initgroups(2)");
+        exit(1);
+    }
+    pw = getpwnam(user);
+    if (!pw)
+    {
+        fprintf(stderr, "no such user: %s\n", user);
         exit(1);
     }
     if (chroot(root) < 0)
@@ -264,11 +1713,17 @@ static int listen_socket(char *port)
             close(sock);
             continue;
         }
+        /* Buffer sizes must be set before listen(2) to take part in
+           window scaling; doing it here also rejects bad values early. */
+        tune_socket(sock, log_exit);
         if (listen(sock, MAX_BACKLOG) < 0)
         {
             close(sock);
             continue;
         }
+        /* Several generations may share the socket during an upgrade. */
+        if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+            log_exit("fcntl(2) failed: %s", strerror(errno));
         freeaddrinfo(res);
         return (sock);
     }
@@ -276,276 +1731,6224 @@ static int listen_socket(char *port)
     return (-1);
 }
 
-static void server_main(int server_fd, char *docroot)
+/* Failures are reported through fail: fatal for the listening socket,
+   where they mean a bad option, and only noted for a connection. */
+static void tune_socket(int sock, void (*fail)(char *fmt, ...))
+{
+    int on = 1;
+
+    if (sockopts.nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        fail("setsockopt(TCP_NODELAY) failed: %s", strerror(errno));
+    if (sockopts.quickack && setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on)) < 0)
+        fail("setsockopt(TCP_QUICKACK) failed: %s", strerror(errno));
+    if (sockopts.sndbuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sockopts.sndbuf, sizeof(int)) < 0)
+        fail("setsockopt(SO_SNDBUF) failed: %s", strerror(errno));
+    if (sockopts.rcvbuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sockopts.rcvbuf, sizeof(int)) < 0)
+        fail("setsockopt(SO_RCVBUF) failed: %s", strerror(errno));
+    if (sockopts.notsent_lowat && setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &sockopts.notsent_lowat, sizeof(int)) < 0)
+        fail("setsockopt(TCP_NOTSENT_LOWAT) failed: %s", strerror(errno));
+    if (sockopts.busy_poll && setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &sockopts.busy_poll, sizeof(int)) < 0)
+        fail("setsockopt(SO_BUSY_POLL) failed: %s", strerror(errno));
+}
+
+static int parse_int_option(char *name, char *val, int min)
+{
+    char *end;
+    long n;
+
+    n = strtol(val, &end, 10);
+    if (*val == '\0' || *end != '\0' || n < min || n > INT_MAX)
+    {
+        fprintf(stderr, "invalid value for %s: %s\n", name, val);
+        exit(1);
+    }
+    return ((int)n);
+}
+
+/* Serialized once so that shedding a connection costs a single send(2)
+   and never allocates while the machine is already struggling. */
+static void setup_overload_response(void)
+{
+    overload.response_len = snprintf(overload.response, sizeof(overload.response),
+                                     "HTTP/1.1 503 Service Unavailable\r\n"
+                                     "Server: %s/%s\r\n"
+                                     "Retry-After: %d\r\n"
+                                     "Content-Length: 0\r\n"
+                                     "Connection: close\r\n"
+                                     "\r\n",
+                                     SERVER_NAME, SERVER_VERSION, overload.retry_after);
+}
+
+/* Reload and upgrade re-run this program with the same arguments, so
+   remember them in a form that survives chdir(2) and daemonizing. */
+static void save_exec_args(int argc, char **argv, char *docroot, int do_chroot)
+{
+    if (do_chroot)
+        return;
+    exec_argv = (char **)xmalloc(sizeof(char *) * (argc + 1));
+    memcpy(exec_argv, argv, sizeof(char *) * argc);
+    exec_argv[argc] = NULL;
+    /* Path options are relative to where we were started, not to "/". */
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strncmp(argv[i], "--access-log=", 13) == 0 || strncmp(argv[i], "--snapshot=", 11) == 0 ||
+            strncmp(argv[i], "--tls-cert=", 11) == 0 || strncmp(argv[i], "--tls-key=", 10) == 0 ||
+            strncmp(argv[i], "--spool-dir=", 12) == 0)
+        {
+            char *eq = strchr(argv[i], '=');
+            char *path = absolute_path(eq + 1);
+
+            exec_argv[i] = (char *)xmalloc(eq - argv[i] + strlen(path) + 2);
+            sprintf(exec_argv[i], "%.*s=%s", (int)(eq - argv[i]), argv[i], path);
+        }
+        else if ((strcmp(argv[i], "--access-log") == 0 || strcmp(argv[i], "--tls-cert") == 0 ||
+                  strcmp(argv[i], "--tls-key") == 0 || strcmp(argv[i], "--spool-dir") == 0) && i + 1 < argc - 1)
+        {
+            exec_argv[i + 1] = absolute_path(argv[i + 1]);
+            i++;
+        }
+    }
+    exec_argv[argc - 1] = strdup(docroot);
+    if (strchr(argv[0], '/'))
+        exec_path = realpath(argv[0], NULL);
+    else
+        exec_path = argv[0];
+    if (!exec_path || !exec_argv[argc - 1])
+        log_exit("failed to save arguments: %s", strerror(errno));
+}
+
+static char *absolute_path(char *path)
+{
+    char cwd[PATH_MAX];
+    char *p;
+
+    if (path[0] == '/')
+        return (path);
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        log_exit("getcwd(3) failed: %s", strerror(errno));
+    p = (char *)xmalloc(strlen(cwd) + strlen(path) + 2);
+    sprintf(p, "%s/%s", cwd, path);
+    return (p);
+}
+
+static int inherited_fd(char *name)
+{
+    char *val;
+    int fd;
+
+    val = getenv(name);
+    if (!val)
+        return (-1);
+    fd = atoi(val);
+    unsetenv(name);
+    return (fd);
+}
+
+static int inherited_socket(char *name)
+{
+    char *val;
+    int fd;
+    int listening;
+    socklen_t len = sizeof(listening);
+
+    fd = inherited_fd(name);
+    if (fd < 0)
+        return (-1);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening)
+        log_exit("%s=%d is not a listening socket", name, fd);
+    if ((val = getenv(ENV_CONNECTIONS)))
+        active_connections = atoi(val);
+    unsetenv(ENV_CONNECTIONS);
+    tune_socket(fd, log_exit);
+    return (fd);
+}
+
+/* Everything a new generation takes over is passed as inherited file
+   descriptors whose numbers travel in the environment. */
+static void export_fds(int server_fd)
+{
+    int n = active_connections;
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%d", server_fd);
+    setenv(ENV_LISTEN_FD, buf, 1);
+    /* Admin connections still running are reaped by the next image as
+       connections; they are short, so count them as such meanwhile. */
+    for (int i = 0; i < MAX_ADMIN_CONNECTIONS; i++)
+        n += admin_pids[i] != 0;
+    snprintf(buf, sizeof(buf), "%d", n);
+    setenv(ENV_CONNECTIONS, buf, 1);
+    if (admin_fd >= 0)
+    {
+        snprintf(buf, sizeof(buf), "%d", admin_fd);
+        setenv(ENV_ADMIN_FD, buf, 1);
+    }
+    if (metrics_fd >= 0)
+    {
+        fcntl(metrics_fd, F_SETFD, 0);
+        snprintf(buf, sizeof(buf), "%d", metrics_fd);
+        setenv(ENV_METRICS_FD, buf, 1);
+    }
+    if (nhelpers > 0)
+    {
+        char pids[MAX_HELPERS * 12] = "";
+
+        for (int i = 0; i < nhelpers; i++)
+        {
+            snprintf(buf, sizeof(buf), "%s%d", i ? "," : "", (int)helper_pids[i]);
+            strcat(pids, buf);
+        }
+        setenv(ENV_HELPER_PIDS, pids, 1);
+    }
+}
+
+static void unexport_fds(void)
+{
+    unsetenv(ENV_LISTEN_FD);
+    unsetenv(ENV_CONNECTIONS);
+    unsetenv(ENV_ADMIN_FD);
+    unsetenv(ENV_METRICS_FD);
+    unsetenv(ENV_HELPER_PIDS);
+    if (metrics_fd >= 0)
+        fcntl(metrics_fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void notify_ready(void)
+{
+    char *val;
+    int fd;
+
+    val = getenv(ENV_READY_FD);
+    if (!val)
+        return;
+    fd = atoi(val);
+    unsetenv(ENV_READY_FD);
+    if (write(fd, "", 1) < 0)
+        log_exit("failed to notify readiness: %s", strerror(errno));
+    close(fd);
+}
+
+static void server_main(int server_fd)
+{
+    sigset_t mask, waitmask;
+
+    /* Signals are only delivered while waiting, so flags are never missed
+       between checking them and blocking in ppoll(2). */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, &waitmask);
+    sigdelset(&waitmask, SIGCHLD);
+    sigdelset(&waitmask, SIGHUP);
+    sigdelset(&waitmask, SIGUSR2);
+    sigdelset(&waitmask, SIGUSR1);
+    notify_ready();
+    while (1)
+    {
+        struct pollfd pfd[3];
+        struct timespec timeout, *tp = NULL;
+        int npfd = 0;
+
+        /* Either would lose track of a successor still starting up. */
+        if (reload_requested && upgrade_fd < 0)
+            reexec_server(server_fd);
+        if (upgrade_requested && upgrade_fd < 0)
+            upgrade_server(server_fd);
+        if (upgrade_fd >= 0 && monotonic_usec() >= upgrade_deadline)
+            upgrade_finished(0);
+        if (reopen_requested)
+        {
+            reopen_requested = 0;
+            if (access_log.pid > 0)
+                kill(access_log.pid, SIGUSR1);
+        }
+        if (access_log.path && access_log.pid == 0)
+            start_logger();
+        if (watcher.state && watcher.pid == 0)
+            start_watcher();
+        /* The admin listener stays open when accepting is paused, so the
+           server can still be observed at its limit. */
+        if (!accept_paused())
+        {
+            pfd[npfd].fd = server_fd;
+            pfd[npfd++].events = POLLIN;
+        }
+        if (admin_fd >= 0)
+        {
+            pfd[npfd].fd = admin_fd;
+            pfd[npfd++].events = POLLIN;
+        }
+        if (upgrade_fd >= 0)
+        {
+            long left = upgrade_deadline - monotonic_usec();
+
+            if (left < 0)
+                left = 0;
+            pfd[npfd].fd = upgrade_fd;
+            pfd[npfd++].events = POLLIN;
+            timeout.tv_sec = left / 1000000;
+            timeout.tv_nsec = left % 1000000 * 1000;
+            tp = &timeout;
+        }
+        if (npfd == 0)
+        {
+            sigsuspend(&waitmask);
+            continue;
+        }
+        if (ppoll(pfd, npfd, tp, &waitmask) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_exit("ppoll(2) failed: %s", strerror(errno));
+        }
+        for (int i = 0; i < npfd; i++)
+        {
+            /* A successor that died only hangs up. */
+            if (pfd[i].fd == upgrade_fd && pfd[i].revents)
+            {
+                if (upgrade_finished(1))
+                    drain_and_exit(server_fd, &waitmask);
+                continue;
+            }
+            if (!(pfd[i].revents & POLLIN))
+                continue;
+            if (pfd[i].fd == server_fd)
+                accept_connection(server_fd, &mask);
+            else
+                accept_admin(server_fd, &mask);
+        }
+    }
+}
+
+static void accept_connection(int server_fd, sigset_t *mask)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int sock;
+    int pid;
+    long start;
+
+    sock = accept(server_fd, (struct sockaddr *)&addr, &addrlen);
+    if (sock < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED)
+            return;
+        log_exit("accept(2) failed: %s", strerror(errno));
+    }
+    start = monotonic_usec();
+    if (overloaded())
+    {
+        reject_connection(sock);
+        update_lag(start);
+        return;
+    }
+    refresh_pack();
+    trace_stamp(STAMP_ACCEPT);
+    pid = fork();
+    if (pid < 0)
+    {
+        reject_connection(sock);
+        update_lag(start);
+        return;
+    }
+    if (pid == 0)
+    {
+        close(server_fd);
+        if (admin_fd >= 0)
+            close(admin_fd);
+        sigprocmask(SIG_UNBLOCK, mask, NULL);
+        conn.fd = sock;
+        conn.start = start;
+        tune_socket(sock, log_message);
+        getnameinfo((struct sockaddr *)&addr, addrlen, conn.peer, sizeof(conn.peer),
+                    NULL, 0, NI_NUMERICHOST);
+        atexit(finish_connection);
+        start_tls(sock);
+        service(open_input(sock), open_output(sock));
+        exit(0);
+    }
+    active_connections++;
+    DTRACE_PROBE2(r3u, accept, sock, pid);
+    if (metrics)
+        metric_add(&core_metrics()->accepted, 1);
+    close(sock);
+    update_lag(start);
+}
+
+/* Admin connections bypass the overload checks on purpose, but only a
+   few run at a time. */
+static void accept_admin(int server_fd, sigset_t *mask)
+{
+    int slot = 0;
+    int sock;
+    int pid;
+
+    sock = accept(admin_fd, NULL, NULL);
+    if (sock < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED)
+            return;
+        log_exit("accept(2) failed: %s", strerror(errno));
+    }
+    while (slot < MAX_ADMIN_CONNECTIONS && admin_pids[slot])
+        slot++;
+    if (slot == MAX_ADMIN_CONNECTIONS)
+    {
+        close(sock);
+        return;
+    }
+    pid = fork();
+    if (pid == 0)
+    {
+        close(server_fd);
+        close(admin_fd);
+        sigprocmask(SIG_UNBLOCK, mask, NULL);
+        conn.fd = sock;
+        serve_admin(open_input(sock), open_output(sock));
+        exit(0);
+    }
+    if (pid > 0)
+        admin_pids[slot] = pid;
+    close(sock);
+}
+
+static int forget_admin(pid_t pid)
+{
+    for (int i = 0; i < MAX_ADMIN_CONNECTIONS; i++)
+    {
+        if (admin_pids[i] == pid)
+        {
+            admin_pids[i] = 0;
+            return (1);
+        }
+    }
+    return (0);
+}
+
+/* Requests are read through a stdio stream of our own as well, so that
+   they come out of the TLS session when there is one. */
+static FILE *open_input(int sock)
+{
+    cookie_io_functions_t io = {input_read, NULL, NULL, NULL};
+    FILE *in;
+
+    in = fopencookie(&conn, "r", io);
+    if (!in)
+        log_exit("fopencookie(3) failed: %s", strerror(errno));
+    conn.fd = sock;
+    return (in);
+}
+
+static ssize_t input_read(void *cookie, char *buf, size_t size)
+{
+    struct Connection *c = (struct Connection *)cookie;
+    ssize_t n;
+
+    if (c->buffered_only)
+    {
+        errno = EAGAIN;
+        return (-1);
+    }
+    do
+        n = sock_read(c->fd, buf, size);
+    while (n < 0 && errno == EINTR);
+    return (n);
+}
+
+/* Takes only what the stdio buffer of in already holds, up to size: the
+   reads stdio makes past it fail right away, and the error is cleared. */
+static size_t read_buffered(FILE *in, char *buf, size_t size)
+{
+    size_t n;
+
+    conn.buffered_only = 1;
+    n = fread(buf, 1, size, in);
+    conn.buffered_only = 0;
+    clearerr(in);
+    return (n);
+}
+
+/* Responses go through a stdio stream whose writes are counted, so the
+   bytes sent are known however a response was produced. */
+static FILE *open_output(int sock)
+{
+    cookie_io_functions_t io = {NULL, output_write, NULL, NULL};
+    FILE *out;
+
+    out = fopencookie(&conn, "w", io);
+    if (!out)
+        log_exit("fopencookie(3) failed: %s", strerror(errno));
+    conn.fd = sock;
+    conn.out = out;
+    return (out);
+}
+
+static ssize_t output_write(void *cookie, const char *buf, size_t size)
+{
+    struct Connection *c = (struct Connection *)cookie;
+    size_t done = 0;
+
+    if (cache_req.capturing)
+        capture(buf, size);
+    if (cache_req.discard)
+        return (size);
+    while (done < size)
+    {
+        ssize_t n;
+
+        n = sock_write(c->fd, buf + done, size - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (0);
+        }
+        if (c->stamp[STAMP_FIRST_WRITE] == 0)
+            trace_stamp(STAMP_FIRST_WRITE);
+        done += n;
+        c->bytes_sent += n;
+    }
+    return (done);
+}
+
+static void setup_tls(void)
+{
+#ifdef R3U_TLS
+    if (!tls.cert)
+        return;
+    if (!tls.key)
+        tls.key = tls.cert;
+    tls.ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls.ctx)
+        log_exit("SSL_CTX_new(3) failed: %s", tls_error());
+    SSL_CTX_set_min_proto_version(tls.ctx, TLS1_2_VERSION);
+    /* A session cache would only ever see the one session of its
+       process; tickets resume in any process of this generation. */
+    SSL_CTX_set_session_cache_mode(tls.ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(tls.ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(tls.ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    SSL_CTX_set_mode(tls.ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_alpn_select_cb(tls.ctx, select_alpn, NULL);
+    if (SSL_CTX_use_certificate_chain_file(tls.ctx, tls.cert) != 1)
+        log_exit("%s: %s", tls.cert, tls_error());
+    if (SSL_CTX_use_PrivateKey_file(tls.ctx, tls.key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls.ctx) != 1)
+        log_exit("%s: %s", tls.key, tls_error());
+#else
+    if (tls.cert || tls.key)
+        log_exit("TLS support is not compiled in (build with -DR3U_TLS -lssl -lcrypto)");
+#endif
+}
+
+/* HTTP/2 when the client offers it, then HTTP/1.1; without a match the
+   handshake goes on without ALPN. */
+#ifdef R3U_TLS
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg)
+{
+    static unsigned char protos[] = "\x02h2\x08http/1.1";
+
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos, sizeof(protos) - 1, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED)
+        return (SSL_TLSEXT_ERR_NOACK);
+    return (SSL_TLSEXT_ERR_OK);
+}
+#endif
+
+static void start_tls(int sock)
+{
+#ifdef R3U_TLS
+    if (!tls.ctx)
+        return;
+    tls.ssl = SSL_new(tls.ctx);
+    if (!tls.ssl || SSL_set_fd(tls.ssl, sock) != 1)
+        log_exit("SSL_new(3) failed: %s", tls_error());
+    SSL_set_accept_state(tls.ssl);
+#else
+    (void)sock;
+#endif
+}
+
+/* Runs under the header deadline, which thus also bounds the handshake. */
+static void tls_handshake(void)
+{
+#ifdef R3U_TLS
+    if (!tls.ssl)
+        return;
+    if (SSL_accept(tls.ssl) != 1)
+        log_exit("TLS handshake failed: %s", tls_error());
+#ifdef SSL_OP_ENABLE_KTLS
+    tls.ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls.ssl));
+#endif
+    if (metrics)
+    {
+        struct CoreMetrics *m = core_metrics();
+
+        metric_add(&m->tls_handshakes, 1);
+        if (SSL_session_reused(tls.ssl))
+            metric_add(&m->tls_resumed, 1);
+        if (tls.ktls_send)
+            metric_add(&m->tls_ktls, 1);
+    }
+#endif
+}
+
+/* Sends close_notify once the response is out. The client may have
+   closed by then, which is no error. */
+static void close_tls(void)
+{
+#ifdef R3U_TLS
+    if (tls.ssl)
+    {
+        trap_signal(SIGPIPE, SIG_IGN, 0);
+        SSL_shutdown(tls.ssl);
+    }
+#endif
+    drop_tls();
+}
+
+/* For a process that inherited the session but does not own the socket. */
+static void drop_tls(void)
+{
+#ifdef R3U_TLS
+    tls.ssl = NULL;
+#endif
+    tls.ktls_send = 0;
+}
+
+/* Whether a response may bypass the stdio stream and go to the socket
+   with writev(2), sendfile(2) or splice(2): unless the session encrypts
+   in user space. */
+static int direct_output(void)
+{
+#ifdef R3U_TLS
+    if (tls.ssl && !tls.ktls_send)
+        return (0);
+#endif
+    return (1);
+}
+
+/* read(2) and write(2) of the client socket, through the session if
+   there is one. A session that must wait for the socket fails with
+   EAGAIN like a non-blocking socket does. */
+static ssize_t sock_read(int fd, void *buf, size_t len)
+{
+#ifdef R3U_TLS
+    if (tls.ssl)
+    {
+        int n;
+
+        ERR_clear_error();
+        errno = 0;
+        n = SSL_read(tls.ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+
+        return (n > 0 ? n : tls_result(n));
+    }
+#endif
+    return (read(fd, buf, len));
+}
+
+static ssize_t sock_write(int fd, const void *buf, size_t len)
+{
+#ifdef R3U_TLS
+    if (tls.ssl)
+    {
+        int n;
+
+        ERR_clear_error();
+        errno = 0;
+        n = SSL_write(tls.ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+
+        return (n > 0 ? n : tls_result(n));
+    }
+#endif
+    return (write(fd, buf, len));
+}
+
+/* Decrypted input the session holds already; poll(2) does not see it. */
+static int sock_pending(void)
+{
+#ifdef R3U_TLS
+    if (tls.ssl)
+        return (SSL_pending(tls.ssl) > 0);
+#endif
+    return (0);
+}
+
+#ifdef R3U_TLS
+static ssize_t tls_result(int n)
+{
+    switch (SSL_get_error(tls.ssl, n))
+    {
+    case SSL_ERROR_ZERO_RETURN:
+        return (0);
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return (-1);
+    case SSL_ERROR_SYSCALL:
+        /* Closed without close_notify: an end of file all the same. */
+        if (errno == 0)
+            return (0);
+        return (-1);
+    default:
+        errno = EPROTO;
+        return (-1);
+    }
+}
+
+static char *tls_error(void)
+{
+    static char buf[256];
+    unsigned long e = ERR_get_error();
+
+    if (e == 0)
+        return (errno ? strerror(errno) : "connection closed");
+    ERR_error_string_n(e, buf, sizeof(buf));
+    return (buf);
+}
+#endif
+
+static int accept_paused(void)
+{
+    if (overload.max_connections == 0 || overload.reject)
+        return (0);
+    return (active_connections >= overload.max_connections);
+}
+
+/* SIGHUP: replace this process image in place. The pid stays the same,
+   connection processes keep running and are still reaped by us, and the
+   listening socket is handed over without ever being closed. */
+static void reexec_server(int server_fd)
+{
+    reload_requested = 0;
+    if (!exec_argv)
+    {
+        log_message("reload is not supported with --chroot");
+        return;
+    }
+    export_fds(server_fd);
+    log_message("reloading");
+    execvp(exec_path, exec_argv);
+    log_message("reload failed: %s", strerror(errno));
+    unexport_fds();
+}
+
+/* SIGUSR2: start whatever binary is now installed as a new generation
+   sharing the listening socket. We step back only once it reports that it
+   is accepting, so a broken binary leaves the old one serving; until then
+   the main loop keeps accepting and watches the ready pipe. */
+static void upgrade_server(int server_fd)
+{
+    int fds[2];
+    pid_t pid;
+
+    upgrade_requested = 0;
+    if (!exec_argv)
+    {
+        log_message("upgrade is not supported with --chroot");
+        return;
+    }
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        log_message("pipe(2) failed: %s", strerror(errno));
+        return;
+    }
+    pid = spawn_server(server_fd, fds[1]);
+    successor_pid = pid;
+    close(fds[1]);
+    if (pid < 0)
+    {
+        close(fds[0]);
+        log_message("upgrade failed, keep serving");
+        return;
+    }
+    upgrade_fd = fds[0];
+    upgrade_deadline = monotonic_usec() + UPGRADE_READY_TIMEOUT * 1000000L;
+}
+
+static pid_t spawn_server(int server_fd, int ready_fd)
+{
+    char buf[32];
+    sigset_t mask;
+    pid_t pid;
+
+    pid = fork();
+    if (pid != 0)
+        return (pid);
+    fcntl(ready_fd, F_SETFD, 0);
+    export_fds(server_fd);
+    /* Connections and helpers stay children of this generation, which
+       reaps them; the new one starts helpers of its own. */
+    unsetenv(ENV_CONNECTIONS);
+    unsetenv(ENV_HELPER_PIDS);
+    snprintf(buf, sizeof(buf), "%d", ready_fd);
+    setenv(ENV_READY_FD, buf, 1);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    execvp(exec_path, exec_argv);
+    log_exit("exec %s failed: %s", exec_path, strerror(errno));
+    return (-1);
+}
+
+/* Called when the ready pipe polls ready or the successor ran out of
+   time. Returns 1 if it is accepting and this generation should drain. */
+static int upgrade_finished(int ready)
+{
+    char c;
+    int ok;
+
+    ok = ready && read(upgrade_fd, &c, 1) == 1;
+    close(upgrade_fd);
+    upgrade_fd = -1;
+    if (!ok)
+    {
+        log_message("upgrade failed, keep serving");
+        return (0);
+    }
+    log_message("upgraded to pid %d, draining", (int)successor_pid);
+    return (1);
+}
+
+static void drain_and_exit(int server_fd, sigset_t *waitmask)
+{
+    close(server_fd);
+    if (admin_fd >= 0)
+        close(admin_fd);
+    while (active_connections > 0)
+        sigsuspend(waitmask);
+    log_message("drained, exiting");
+    exit(0);
+}
+
+static int overloaded(void)
+{
+    if (overload.max_connections && active_connections >= overload.max_connections)
+        return (1);
+    if (overload.shed_lag && overload.lag > overload.shed_lag * 1000L)
+        return (1);
+    return (0);
+}
+
+static void reject_connection(int sock)
+{
+    /* Best effort: a client that cannot take 256 bytes is simply dropped,
+       as is any TLS client, which the listener has no time to shake hands
+       with. */
+    if (!tls.cert)
+        send(sock, overload.response, overload.response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sock);
+    if (metrics)
+        metric_add(&core_metrics()->rejected, 1);
+}
+
+/* The time the accept loop spends dispatching a connection grows with
+   fork(2) cost and scheduler pressure, so its moving average is used as
+   the overload signal. Rejections are cheap, which lets the average decay
+   and admission resume once the machine recovers. */
+static void update_lag(long start)
+{
+    long sample;
+
+    sample = monotonic_usec() - start;
+    overload.lag += (sample - overload.lag) >> LAG_EWMA_SHIFT;
+}
+
+static long monotonic_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000L + ts.tv_nsec / 1000);
+}
+
+/* The counters live in a memfd so that a reload can hand them over and
+   totals keep growing across generations, as Prometheus expects. */
+static void setup_metrics(void)
+{
+    long ncpu;
+    size_t size;
+    struct stat st;
+
+    if (!admin_port)
+        return;
+    ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    if (ncpu < 1)
+        ncpu = 1;
+    size = sizeof(struct Metrics) + sizeof(struct CoreMetrics) * ncpu;
+    if (metrics_fd >= 0)
+    {
+        metrics = (struct Metrics *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, metrics_fd, 0);
+        if (metrics != MAP_FAILED && fstat(metrics_fd, &st) == 0 && (size_t)st.st_size == size &&
+            metrics->magic == METRICS_MAGIC && metrics->ncpu == ncpu && metrics->size == size)
+        {
+            fcntl(metrics_fd, F_SETFD, FD_CLOEXEC);
+            return;
+        }
+        if (metrics != MAP_FAILED)
+            munmap(metrics, size);
+        close(metrics_fd);
+    }
+    metrics_fd = memfd_create("r3u-metrics", MFD_CLOEXEC);
+    if (metrics_fd < 0 || ftruncate(metrics_fd, size) < 0)
+        log_exit("failed to create metrics area: %s", strerror(errno));
+    metrics = (struct Metrics *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, metrics_fd, 0);
+    if (metrics == MAP_FAILED)
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    metrics->magic = METRICS_MAGIC;
+    metrics->ncpu = ncpu;
+    metrics->size = size;
+}
+
+static struct CoreMetrics *core_metrics(void)
+{
+    int cpu;
+
+    cpu = sched_getcpu();
+    if (cpu < 0)
+        cpu = 0;
+    return (&metrics->core[(uint32_t)cpu % metrics->ncpu]);
+}
+
+/* Processes sharing a CPU can still preempt each other, hence atomic
+   adds; with the line owned by this core they are uncontended. */
+static void metric_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Runs at exit of a connection process, so that requests cut short by
+   log_exit() are still counted and logged. */
+static void finish_connection(void)
+{
+    finish_request();
+    release_lease(0);
+    DTRACE_PROBE3(r3u, connection__close, conn.fd, conn.status, conn.bytes_sent);
+}
+
+static void finish_request(void)
+{
+    release_backend();
+    if (conn.finished)
+        return;
+    conn.finished = 1;
+    if (conn.out)
+        fflush(conn.out);
+    record_metrics();
+    if (conn.req)
+    {
+        DTRACE_PROBE4(r3u, response__done, conn.fd, conn.req->path, conn.status, conn.bytes_sent);
+        trace_phases();
+        log_access();
+    }
+}
+
+static void record_metrics(void)
+{
+    struct CoreMetrics *m;
+    long elapsed;
+
+    if (!metrics)
+        return;
+    m = core_metrics();
+    metric_add(&m->response_bytes, conn.bytes_sent);
+    if (conn.status == 0)
+    {
+        metric_add(&m->failed, 1);
+        return;
+    }
+    metric_add(&m->requests[conn.method][status_slot(conn.status)], 1);
+    elapsed = monotonic_usec() - conn.start;
+    metric_add(&m->latency[latency_slot(elapsed)], 1);
+    metric_add(&m->latency_usec, elapsed);
+}
+
+/* Stamps come from the coarse clock: a vDSO read with no TSC access that
+   costs a few nanoseconds, at the price of one-tick resolution. That is
+   enough to tell which phase a slow request spent its time in. */
+static void trace_stamp(int stamp)
+{
+    struct timespec ts;
+
+    if (!tracing.enabled)
+        return;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    conn.stamp[stamp] = ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void trace_phases(void)
+{
+    long phase[PHASE_SLOTS];
+    long total;
+
+    if (!tracing.enabled || conn.stamp[STAMP_ACCEPT] == 0)
+        return;
+    trace_stamp(STAMP_COMPLETE);
+    /* Stamps a response never reached, say the file lookup of an error
+       response, collapse into the phase before them. */
+    for (int i = 1; i < STAMP_SLOTS; i++)
+    {
+        if (conn.stamp[i] < conn.stamp[i - 1])
+            conn.stamp[i] = conn.stamp[i - 1];
+    }
+    for (int i = 0; i < PHASE_SLOTS; i++)
+    {
+        phase[i] = conn.stamp[i + 1] - conn.stamp[i];
+        if (metrics)
+        {
+            struct CoreMetrics *m = core_metrics();
+
+            metric_add(&m->phase[i][latency_slot(phase[i])], 1);
+            metric_add(&m->phase_usec[i], phase[i]);
+        }
+    }
+    total = conn.stamp[STAMP_COMPLETE] - conn.stamp[STAMP_ACCEPT];
+    if (tracing.slow_usec && total >= tracing.slow_usec)
+        log_message("slow request: %s %s %d %ldms (wait %ld, header %ld, resolve %ld, respond %ld, transfer %ld)",
+                    conn.req->method, conn.req->path, conn.status, total / 1000, phase[0] / 1000,
+                    phase[1] / 1000, phase[2] / 1000, phase[3] / 1000, phase[4] / 1000);
+}
+
+static int latency_slot(long usec)
+{
+    int i;
+
+    for (i = 0; i < LATENCY_SLOTS - 1; i++)
+    {
+        if (usec <= latency_bounds[i] * 1e6)
+            break;
+    }
+    return (i);
+}
+
+static int method_slot(char *method)
+{
+    for (int i = 0; i < METHOD_OTHER; i++)
+    {
+        if (strcmp(method, metric_methods[i]) == 0)
+            return (i);
+    }
+    return (METHOD_OTHER);
+}
+
+static int status_slot(int status)
+{
+    int i;
+
+    for (i = 0; i < STATUS_SLOTS - 1; i++)
+    {
+        if (metric_statuses[i] == status)
+            break;
+    }
+    return (i);
+}
+
+static void serve_admin(FILE *in, FILE *out)
+{
+    struct HTTPRequest *req;
+
+    trap_signal(SIGALRM, deadline_exit, 0);
+    set_write_timeout(conn.fd);
+    req = read_request(in);
+    if (strcmp(req->path, METRICS_PATH) != 0)
+        not_found(req, out);
+    else if (strcmp(req->method, "GET") != 0 && strcmp(req->method, "HEAD") != 0)
+        method_not_allowed(req, out);
+    else
+        output_metrics(req, out);
+    fflush(out);
+    free_request(req);
+}
+
+static void output_metrics(struct HTTPRequest *req, FILE *out)
+{
+    struct CoreMetrics sum;
+    FILE *body;
+    char *buf = NULL;
+    size_t len = 0;
+    uint64_t cumulative;
+
+    memset(&sum, 0, sizeof(sum));
+    if (metrics)
+    {
+        for (uint32_t c = 0; c < metrics->ncpu; c++)
+        {
+            uint64_t *src = (uint64_t *)&metrics->core[c];
+            uint64_t *dst = (uint64_t *)&sum;
+
+            for (size_t k = 0; k < sizeof(struct CoreMetrics) / sizeof(uint64_t); k++)
+                dst[k] += __atomic_load_n(&src[k], __ATOMIC_RELAXED);
+        }
+    }
+    body = open_memstream(&buf, &len);
+    if (!body)
+        log_exit("open_memstream(3) failed: %s", strerror(errno));
+    fprintf(body, "# HELP r3u_requests_total Requests answered, by method and status.\n");
+    fprintf(body, "# TYPE r3u_requests_total counter\n");
+    for (int m = 0; m < METHOD_SLOTS; m++)
+    {
+        for (int st = 0; st < STATUS_SLOTS; st++)
+        {
+            char code[8];
+
+            if (sum.requests[m][st] == 0)
+                continue;
+            if (metric_statuses[st])
+                snprintf(code, sizeof(code), "%d", metric_statuses[st]);
+            else
+                strcpy(code, "other");
+            fprintf(body, "r3u_requests_total{method=\"%s\",status=\"%s\"} %llu\n",
+                    metric_methods[m], code, (unsigned long long)sum.requests[m][st]);
+        }
+    }
+    fprintf(body, "# HELP r3u_response_bytes_total Bytes written to clients.\n");
+    fprintf(body, "# TYPE r3u_response_bytes_total counter\n");
+    fprintf(body, "r3u_response_bytes_total %llu\n", (unsigned long long)sum.response_bytes);
+    fprintf(body, "# HELP r3u_connections_accepted_total Connections handed to a process.\n");
+    fprintf(body, "# TYPE r3u_connections_accepted_total counter\n");
+    fprintf(body, "r3u_connections_accepted_total %llu\n", (unsigned long long)sum.accepted);
+    fprintf(body, "# HELP r3u_connections_rejected_total Connections shed with 503 under overload.\n");
+    fprintf(body, "# TYPE r3u_connections_rejected_total counter\n");
+    fprintf(body, "r3u_connections_rejected_total %llu\n", (unsigned long long)sum.rejected);
+    fprintf(body, "# HELP r3u_connections_failed_total Connections closed without a response.\n");
+    fprintf(body, "# TYPE r3u_connections_failed_total counter\n");
+    fprintf(body, "r3u_connections_failed_total %llu\n", (unsigned long long)sum.failed);
+    fprintf(body, "# HELP r3u_connections_active Connection processes currently running.\n");
+    fprintf(body, "# TYPE r3u_connections_active gauge\n");
+    fprintf(body, "r3u_connections_active %d\n", (int)active_connections);
+    fprintf(body, "# HELP r3u_path_cache_hits_total Request paths resolved from the shared path cache.\n");
+    fprintf(body, "# TYPE r3u_path_cache_hits_total counter\n");
+    fprintf(body, "r3u_path_cache_hits_total %llu\n", (unsigned long long)sum.path_cache_hits);
+    fprintf(body, "# HELP r3u_path_cache_misses_total Request paths normalized and looked up on disk.\n");
+    fprintf(body, "# TYPE r3u_path_cache_misses_total counter\n");
+    fprintf(body, "r3u_path_cache_misses_total %llu\n", (unsigned long long)sum.path_cache_misses);
+    if (microcache.lease)
+    {
+        fprintf(body, "# HELP r3u_microcache_hits_total Proxied requests answered with a fresh cached response.\n");
+        fprintf(body, "# TYPE r3u_microcache_hits_total counter\n");
+        fprintf(body, "r3u_microcache_hits_total %llu\n", (unsigned long long)sum.microcache_hits);
+        fprintf(body, "# HELP r3u_microcache_stale_total Proxied requests answered with a stale cached response.\n");
+        fprintf(body, "# TYPE r3u_microcache_stale_total counter\n");
+        fprintf(body, "r3u_microcache_stale_total %llu\n", (unsigned long long)sum.microcache_stale);
+        fprintf(body, "# HELP r3u_microcache_misses_total Cacheable proxied requests that went upstream.\n");
+        fprintf(body, "# TYPE r3u_microcache_misses_total counter\n");
+        fprintf(body, "r3u_microcache_misses_total %llu\n", (unsigned long long)sum.microcache_misses);
+    }
+    if (disk_cache.header)
+    {
+        fprintf(body, "# HELP r3u_disk_cache_hits_total Cached responses found in the disk tier.\n");
+        fprintf(body, "# TYPE r3u_disk_cache_hits_total counter\n");
+        fprintf(body, "r3u_disk_cache_hits_total %llu\n", (unsigned long long)sum.disk_cache_hits);
+    }
+    if (tls.cert)
+    {
+        fprintf(body, "# HELP r3u_tls_handshakes_total Completed TLS handshakes.\n");
+        fprintf(body, "# TYPE r3u_tls_handshakes_total counter\n");
+        fprintf(body, "r3u_tls_handshakes_total %llu\n", (unsigned long long)sum.tls_handshakes);
+        fprintf(body, "# HELP r3u_tls_resumed_total TLS handshakes that resumed a session from a ticket.\n");
+        fprintf(body, "# TYPE r3u_tls_resumed_total counter\n");
+        fprintf(body, "r3u_tls_resumed_total %llu\n", (unsigned long long)sum.tls_resumed);
+        fprintf(body, "# HELP r3u_tls_ktls_total TLS connections whose records the kernel encrypts.\n");
+        fprintf(body, "# TYPE r3u_tls_ktls_total counter\n");
+        fprintf(body, "r3u_tls_ktls_total %llu\n", (unsigned long long)sum.tls_ktls);
+    }
+    fprintf(body, "# HELP r3u_access_log_dropped_total Access log records dropped on a full pipe.\n");
+    fprintf(body, "# TYPE r3u_access_log_dropped_total counter\n");
+    fprintf(body, "r3u_access_log_dropped_total %llu\n", (unsigned long long)sum.log_dropped);
+    fprintf(body, "# HELP r3u_request_duration_seconds Time from accept to the end of the response.\n");
+    fprintf(body, "# TYPE r3u_request_duration_seconds histogram\n");
+    cumulative = 0;
+    for (int i = 0; i < LATENCY_SLOTS; i++)
+    {
+        cumulative += sum.latency[i];
+        if (i < LATENCY_SLOTS - 1)
+            fprintf(body, "r3u_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+                    latency_bounds[i], (unsigned long long)cumulative);
+        else
+            fprintf(body, "r3u_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n",
+                    (unsigned long long)cumulative);
+    }
+    fprintf(body, "r3u_request_duration_seconds_sum %.6f\n", sum.latency_usec / 1e6);
+    fprintf(body, "r3u_request_duration_seconds_count %llu\n", (unsigned long long)cumulative);
+    if (proxy.state)
+    {
+        fprintf(body, "# HELP r3u_upstream_requests_total Requests sent to each backend.\n");
+        fprintf(body, "# TYPE r3u_upstream_requests_total counter\n");
+        for (int r = 0; r < proxy.nroutes; r++)
+        {
+            for (int b = 0; b < proxy.route[r].nbackends; b++)
+                fprintf(body, "r3u_upstream_requests_total{route=\"%s\",backend=\"%s\"} %llu\n",
+                        proxy.route[r].prefix, proxy.route[r].backend[b].name,
+                        (unsigned long long)proxy.state->backend[r][b].requests);
+        }
+        fprintf(body, "# HELP r3u_upstream_failures_total Failed connections and exchanges with each backend.\n");
+        fprintf(body, "# TYPE r3u_upstream_failures_total counter\n");
+        for (int r = 0; r < proxy.nroutes; r++)
+        {
+            for (int b = 0; b < proxy.route[r].nbackends; b++)
+                fprintf(body, "r3u_upstream_failures_total{route=\"%s\",backend=\"%s\"} %llu\n",
+                        proxy.route[r].prefix, proxy.route[r].backend[b].name,
+                        (unsigned long long)proxy.state->backend[r][b].failures);
+        }
+        fprintf(body, "# HELP r3u_upstream_active Requests currently in progress on each backend.\n");
+        fprintf(body, "# TYPE r3u_upstream_active gauge\n");
+        for (int r = 0; r < proxy.nroutes; r++)
+        {
+            for (int b = 0; b < proxy.route[r].nbackends; b++)
+                fprintf(body, "r3u_upstream_active{route=\"%s\",backend=\"%s\"} %u\n", proxy.route[r].prefix,
+                        proxy.route[r].backend[b].name, proxy.state->backend[r][b].active);
+        }
+        fprintf(body, "# HELP r3u_upstream_up Whether a backend is currently chosen for requests.\n");
+        fprintf(body, "# TYPE r3u_upstream_up gauge\n");
+        for (int r = 0; r < proxy.nroutes; r++)
+        {
+            for (int b = 0; b < proxy.route[r].nbackends; b++)
+                fprintf(body, "r3u_upstream_up{route=\"%s\",backend=\"%s\"} %d\n", proxy.route[r].prefix,
+                        proxy.route[r].backend[b].name, proxy.state->backend[r][b].down_until <= time(NULL));
+        }
+    }
+    if (tracing.enabled)
+    {
+        fprintf(body, "# HELP r3u_request_phase_seconds Time spent in each phase of a request.\n");
+        fprintf(body, "# TYPE r3u_request_phase_seconds histogram\n");
+        for (int p = 0; p < PHASE_SLOTS; p++)
+        {
+            cumulative = 0;
+            for (int i = 0; i < LATENCY_SLOTS; i++)
+            {
+                cumulative += sum.phase[p][i];
+                if (i < LATENCY_SLOTS - 1)
+                    fprintf(body, "r3u_request_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+                            phase_names[p], latency_bounds[i], (unsigned long long)cumulative);
+                else
+                    fprintf(body, "r3u_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n",
+                            phase_names[p], (unsigned long long)cumulative);
+            }
+            fprintf(body, "r3u_request_phase_seconds_sum{phase=\"%s\"} %.6f\n", phase_names[p],
+                    sum.phase_usec[p] / 1e6);
+            fprintf(body, "r3u_request_phase_seconds_count{phase=\"%s\"} %llu\n", phase_names[p],
+                    (unsigned long long)cumulative);
+        }
+    }
+    fclose(body);
+    output_common_header_fields(req, out, "200 OK");
+    fprintf(out, "Content-Length: %zu\r\n", len);
+    fprintf(out, "Content-Type: text/plain; version=0.0.4\r\n");
+    fprintf(out, "\r\n");
+    if (strcmp(req->method, "HEAD") != 0)
+        fwrite(buf, 1, len, out);
+    free(buf);
+}
+
+/* Opened before chroot(2) and daemonizing so that relative and outside
+   paths keep working; the logger process only reopens it on rotation. */
+static void open_access_log(void)
+{
+    if (!access_log.path)
+        return;
+    access_log.path = absolute_path(access_log.path);
+    access_log.fd = open(access_log.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (access_log.fd < 0)
+        log_exit("failed to open %s: %s", access_log.path, strerror(errno));
+    if (pipe2(access_log.pipe, O_CLOEXEC) < 0)
+        log_exit("pipe(2) failed: %s", strerror(errno));
+    if (fcntl(access_log.pipe[1], F_SETFL, O_NONBLOCK) < 0)
+        log_exit("fcntl(2) failed: %s", strerror(errno));
+    /* Best effort; a larger pipe absorbs bursts while the logger writes. */
+    fcntl(access_log.pipe[1], F_SETPIPE_SZ, ACCESS_LOG_PIPESIZE);
+}
+
+/* The parent keeps both ends of the pipe, so a logger that died can be
+   replaced without losing what is still queued in it. */
+static void start_logger(void)
+{
+    pid_t pid;
+
+    if (!access_log.path)
+        return;
+    pid = fork();
+    if (pid < 0)
+    {
+        log_message("failed to start logger: %s", strerror(errno));
+        return;
+    }
+    if (pid == 0)
+        logger_main();
+    add_helper(pid);
+    access_log.pid = pid;
+}
+
+static void logger_main(void)
+{
+    static char buf[ACCESS_LOG_BUFSIZE];
+    size_t len = 0;
+    sigset_t mask;
+
+    close(access_log.pipe[1]);
+    if (watcher.lifeline[1] >= 0)
+        close(watcher.lifeline[1]);
+    trap_signal(SIGUSR1, logger_reopen_handler, 0);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    while (1)
+    {
+        struct pollfd pfd;
+        ssize_t n;
+
+        if (logger_reopen)
+        {
+            int fd;
+
+            logger_reopen = 0;
+            flush_log_buffer(buf, &len);
+            fd = open(access_log.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0)
+                log_message("failed to reopen %s: %s", access_log.path, strerror(errno));
+            else
+            {
+                close(access_log.fd);
+                access_log.fd = fd;
+            }
+        }
+        pfd.fd = access_log.pipe[0];
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, ACCESS_LOG_FLUSH_INTERVAL) <= 0)
+        {
+            flush_log_buffer(buf, &len);
+            continue;
+        }
+        n = read(access_log.pipe[0], buf + len, sizeof(buf) - len);
+        if (n < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN)
+                log_message("failed to read access log pipe: %s", strerror(errno));
+            continue;
+        }
+        if (n == 0)
+        {
+            flush_log_buffer(buf, &len);
+            _exit(0);
+        }
+        len += n;
+        /* Batch into large writes, flushing early only when idle. */
+        if (len > sizeof(buf) - ACCESS_LOG_LINE_MAX * 16)
+            flush_log_buffer(buf, &len);
+    }
+}
+
+static void flush_log_buffer(char *buf, size_t *len)
+{
+    size_t done = 0;
+
+    while (done < *len)
+    {
+        ssize_t n;
+
+        n = write(access_log.fd, buf + done, *len - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_message("failed to write access log: %s", strerror(errno));
+            break;
+        }
+        done += n;
+    }
+    *len = 0;
+}
+
+static void log_access(void)
+{
+    char line[ACCESS_LOG_LINE_MAX];
+    size_t len;
+
+    if (access_log.pipe[1] < 0)
+        return;
+    len = format_access_log(line, sizeof(line));
+    if (write(access_log.pipe[1], line, len) != (ssize_t)len && metrics)
+        metric_add(&core_metrics()->log_dropped, 1);
+}
+
+static size_t format_access_log(char *buf, size_t size)
+{
+    struct HTTPRequest *req = conn.req;
+    struct tm tm;
+    time_t t;
+    char when[64];
+    char *referer, *agent;
+    size_t rlen, alen;
+    size_t len;
+    int n;
+
+    t = time(NULL);
+    localtime_r(&t, &tm);
+    referer = header_value("Referer", &rlen);
+    agent = header_value("User-Agent", &alen);
+    if (access_log.format == LOG_FORMAT_JSON)
+    {
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S%z", &tm);
+        n = snprintf(buf, size, "{\"time\":\"%s\",\"remote\":\"%s\",\"method\":", when, conn.peer);
+        len = append_quoted(buf, n, req->method, strlen(req->method), 1);
+        len += snprintf(buf + len, size - len, ",\"path\":");
+        len = append_quoted(buf, len, req->path, strlen(req->path), 1);
+        len += snprintf(buf + len, size - len,
+                        ",\"protocol\":\"HTTP/%d.%d\",\"status\":%d,\"bytes\":%llu,\"duration\":%.6f,\"referer\":",
+                        req->http2 ? 2 : 1, req->http2 ? 0 : req->protocol_minor_version, conn.status,
+                        (unsigned long long)conn.bytes_sent,
+                        (monotonic_usec() - conn.start) / 1e6);
+        len = append_quoted(buf, len, referer, rlen, 1);
+        len += snprintf(buf + len, size - len, ",\"user_agent\":");
+        len = append_quoted(buf, len, agent, alen, 1);
+        len += snprintf(buf + len, size - len, "}\n");
+    }
+    else
+    {
+        strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        len = snprintf(buf, size, "%s - - [%s] \"%.256s %.1024s HTTP/%d.%d\" %d %llu",
+                       conn.peer, when, req->method, req->path,
+                       req->http2 ? 2 : 1, req->http2 ? 0 : req->protocol_minor_version,
+                       conn.status, (unsigned long long)conn.bytes_sent);
+        if (access_log.format == LOG_FORMAT_COMBINED)
+        {
+            buf[len++] = ' ';
+            len = append_quoted(buf, len, referer, rlen, 0);
+            buf[len++] = ' ';
+            len = append_quoted(buf, len, agent, alen, 0);
+        }
+        buf[len++] = '\n';
+    }
+    return (len);
+}
+
+/* Quotes a field as a JSON string or, for the common formats, the way
+   Apache escapes them. Each field is capped at ACCESS_LOG_FIELD_MAX bytes
+   of output so that a whole record fits in one atomic pipe write. */
+static size_t append_quoted(char *buf, size_t len, char *s, size_t n, int json)
+{
+    size_t limit = len + ACCESS_LOG_FIELD_MAX - 6;
+
+    buf[len++] = '"';
+    for (size_t i = 0; i < n && len < limit; i++)
+    {
+        unsigned char c = s[i];
+
+        if (c == '"' || c == '\\')
+        {
+            buf[len++] = '\\';
+            buf[len++] = c;
+        }
+        else if (c < 0x20 || c >= 0x7f)
+            len += sprintf(buf + len, json ? "\\u%04x" : "\\x%02x", c);
+        else
+            buf[len++] = c;
+    }
+    buf[len++] = '"';
+    return (len);
+}
+
+/* Header values are stored with their line terminator. */
+static char *header_value(char *name, size_t *len)
+{
+    char *val;
+
+    val = lookup_header_field_value(conn.req, name);
+    if (!val)
+    {
+        *len = 1;
+        return ("-");
+    }
+    *len = strcspn(val, "\r\n");
+    return (val);
+}
+
+static void add_helper(pid_t pid)
+{
+    if (nhelpers < MAX_HELPERS)
+        helper_pids[nhelpers++] = pid;
+}
+
+static int is_helper(pid_t pid)
+{
+    for (int i = 0; i < nhelpers; i++)
+    {
+        if (helper_pids[i] == pid)
+            return (1);
+    }
+    return (0);
+}
+
+/* Helpers of a previous generation are still our children after a
+   reload; they must not be mistaken for connections when reaped. */
+static void inherit_helpers(void)
+{
+    char *val;
+    char *p;
+
+    val = getenv(ENV_HELPER_PIDS);
+    if (!val)
+        return;
+    for (p = strtok(val, ","); p; p = strtok(NULL, ","))
+        add_helper(atoi(p));
+    unsetenv(ENV_HELPER_PIDS);
+}
+
+static void service(FILE *in, FILE *out)
+{
+    struct HTTPRequest *req;
+
+    trap_signal(SIGALRM, deadline_exit, 0);
+    set_write_timeout(conn.fd);
+    req = read_request(in);
+    if (req->http2)
+    {
+        free_request(req);
+        serve_h2(in);
+    }
+    conn.req = req;
+    conn.method = method_slot(req->method);
+    DTRACE_PROBE4(r3u, request__parsed, conn.fd, req->method, req->path, req->length);
+    respond_to(req, out);
+    finish_request();
+    discard_body();
+    close_tls();
+    conn.req = NULL;
+    free_request(req);
+}
+
+static struct HTTPRequest *read_request(FILE *in)
+{
+    struct HTTPRequest *req;
+    struct HTTPHeaderField *h;
+
+    req = (struct HTTPRequest *)xmalloc(sizeof(struct HTTPRequest));
+    wait_request(conn.fd);
+    trace_stamp(STAMP_FIRST_BYTE);
+    set_deadline(timeouts.header, "request header");
+    tls_handshake();
+    read_request_line(req, in);
+    req->header = NULL;
+    req->body = NULL;
+    req->length = 0;
+    if (req->http2)
+    {
+        set_deadline(0, NULL);
+        return (req);
+    }
+    while ((h = read_header_field(in)))
+    {
+        h->next = req->header;
+        req->header = h;
+    }
+    req->length = content_length(req);
+    if (req->length > MAX_REQUEST_BODY_LENGTH)
+        log_exit("request body too long");
+    set_deadline(timeouts.body, "request body");
+    read_body(in, req->length);
+    set_deadline(0, NULL);
+    trace_stamp(STAMP_PARSED);
+    return (req);
+}
+
+/* An idle client has not sent a single byte yet, so it is cheaper to
+   wait in poll(2) than to arm the header deadline right away. */
+static void wait_request(int fd)
+{
+    struct pollfd pfd;
+    int n;
+
+    if (timeouts.idle == 0)
+        return;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    do
+        n = poll(&pfd, 1, timeouts.idle * 1000);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+        log_exit("poll(2) failed: %s", strerror(errno));
+    if (n == 0)
+        log_exit("idle timeout");
+}
+
+/* Each phase gets a total deadline rather than a per-read timeout so that
+   a client trickling one byte at a time cannot hold the process forever. */
+static void set_deadline(int sec, char *phase)
+{
+    deadline_phase = phase;
+    alarm(sec);
+}
+
+static void set_write_timeout(int sock)
+{
+    struct timeval tv;
+
+    if (timeouts.write == 0)
+        return;
+    tv.tv_sec = timeouts.write;
+    tv.tv_usec = 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+        log_exit("setsockopt(SO_SNDTIMEO) failed: %s", strerror(errno));
+}
+
+static void read_request_line(struct HTTPRequest *req, FILE *in)
+{
+    char buf[BUFSIZ];
+    char *p;
+    char *path;
+
+    if (!fgets(buf, sizeof(buf), in))
+        log_exit("no request line");
+    req->http2 = strcmp(buf, H2_PREFACE_LINE) == 0;
+    if (req->http2)
+    {
+        char rest[sizeof(H2_PREFACE_REST) - 1];
+
+        if (fread(rest, sizeof(rest), 1, in) < 1 || memcmp(rest, H2_PREFACE_REST, sizeof(rest)) != 0)
+            log_exit("bad http/2 connection preface");
+        req->method = (char *)xmalloc(4);
+        strcpy(req->method, "PRI");
+        req->path = (char *)xmalloc(2);
+        strcpy(req->path, "*");
+        req->protocol_minor_version = 0;
+        return;
+    }
+    p = strchr(buf, ' ');
+    if (!p)
+        log_exit("parse error on request line (1): %s", buf);
+    *p++ = '\0';
+    req->method = (char *)xmalloc(p - buf);
+    strcpy(req->method, buf);
+    uppcase(req->method);
+    path = p;
+    p = strchr(path, ' ');
+    if (!p)
+        log_exit("parse error on request line (2): %s", buf);
+    *p++ = '\0';
+    req->path = (char *)xmalloc(p - path);
+    strcpy(req->path, path);
+    if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0)
+        log_exit("parse error on request line (3): %s", buf);
+    p += strlen("HTTP/1.");
+    req->protocol_minor_version = atoi(p);
+}
+
+static void uppcase(char *str)
+{
+    for (size_t i = 0; i < strlen(str); i++)
+    {
+        if (islower(str[i]))
+            str[i] += 'A' - 'a';
+    }
+}
+
+static struct HTTPHeaderField *read_header_field(FILE *in)
+{
+    struct HTTPHeaderField *h;
+    char buf[BUFSIZ];
+    char *p;
+
+    if (!fgets(buf, sizeof(buf), in))
+        log_exit("failed to read request header field: %s", strerror(errno));
+    if (strcmp(buf, "\n") == 0 || strcmp(buf, "\r\n") == 0)
+        return (NULL);
+
+    p = strchr(buf, ':');
+    if (!p)
+        log_exit("parse error on request header field: %s", buf);
+    *p++ = '\0';
+    h = (struct HTTPHeaderField *)xmalloc(sizeof(struct HTTPHeaderField));
+    h->name = (char *)xmalloc(p - buf);
+    strcpy(h->name, buf);
+    p += strspn(p, " \t");
+    h->value = (char *)xmalloc(strlen(p) + 1);
+    strcpy(h->value, p);
+    return (h);
+}
+
+static long content_length(struct HTTPRequest *req)
+{
+    char *val;
+    long len;
+
+    val = lookup_header_field_value(req, "Content-Length");
+    if (!val)
+        return (0);
+    len = atol(val);
+    if (len < 0)
+        log_exit("negative Content-Length value");
+    return (len);
+}
+
+/* Opened before --chroot, like the docroot. A filesystem without
+   O_TMPFILE (or a directory we cannot use) leaves large bodies in the
+   socket, unless the directory was asked for. */
+static void setup_spool(void)
+{
+    int fd;
+
+    spool.fd = open(spool.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (spool.fd >= 0 && (fd = open_spool()) >= 0)
+    {
+        close(fd);
+        return;
+    }
+    if (strcmp(spool.dir, P_tmpdir) != 0)
+        log_exit("cannot spool request bodies in %s: %s", spool.dir, strerror(errno));
+    log_message("cannot spool request bodies in %s, streaming them: %s", spool.dir, strerror(errno));
+    if (spool.fd >= 0)
+        close(spool.fd);
+    spool.fd = -1;
+}
+
+static int open_spool(void)
+{
+    if (spool.fd < 0)
+        return (-1);
+    return (openat(spool.fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600));
+}
+
+/* Runs under the body deadline. */
+static void read_body(FILE *in, long length)
+{
+    req_body.in = in;
+    req_body.length = length;
+    req_body.delivered = 0;
+    req_body.data = NULL;
+    if (req_body.spool >= 0)
+        close(req_body.spool);
+    req_body.spool = -1;
+    if (length <= BODY_BUFFER_SIZE)
+    {
+        if (length > 0 && fread(req_body.buf, length, 1, in) < 1)
+            log_exit("failed to read request body");
+        req_body.data = req_body.buf;
+        return;
+    }
+    if ((req_body.spool = open_spool()) < 0)
+        return;
+    for (long off = 0; off < length;)
+    {
+        struct iovec iov;
+
+        iov.iov_base = req_body.buf;
+        iov.iov_len = read_client_body(req_body.buf, length - off < BODY_BUFFER_SIZE ? length - off : BODY_BUFFER_SIZE);
+        if (writev_all(req_body.spool, &iov, 1) < 0)
+            log_exit("failed to spool request body: %s", strerror(errno));
+        off += iov.iov_len;
+    }
+}
+
+/* The body of an HTTP/2 stream, collected by the connection process. */
+static void adopt_body(struct HTTPRequest *req, int spool_fd)
+{
+    req_body.in = NULL;
+    req_body.length = req->length;
+    req_body.delivered = 0;
+    req_body.data = spool_fd < 0 ? req->body : NULL;
+    req_body.spool = spool_fd;
+}
+
+/* The next piece of the body, which the handler takes whole before it
+   asks again; 0 at the end. */
+static ssize_t body_chunk(char **data)
+{
+    long left = req_body.length - req_body.delivered;
+    size_t n;
+
+    if (left <= 0)
+        return (0);
+    if (req_body.data)
+    {
+        *data = req_body.data + req_body.delivered;
+        n = left;
+    }
+    else if (req_body.spool >= 0)
+    {
+        ssize_t got;
+
+        n = left < BODY_BUFFER_SIZE ? left : BODY_BUFFER_SIZE;
+        do
+            got = pread(req_body.spool, req_body.buf, n, req_body.delivered);
+        while (got < 0 && errno == EINTR);
+        if (got <= 0)
+            log_exit("failed to read spooled request body: %s", got < 0 ? strerror(errno) : "file shrank");
+        *data = req_body.buf;
+        n = got;
+    }
+    else
+    {
+        set_deadline(timeouts.body, "request body");
+        n = read_client_body(req_body.buf, left < BODY_BUFFER_SIZE ? left : BODY_BUFFER_SIZE);
+        set_deadline(0, NULL);
+        *data = req_body.buf;
+    }
+    req_body.delivered += n;
+    return (n);
+}
+
+/* Takes what the stdio buffer holds first, then whatever one read of the
+   socket returns, so a piece is passed on as soon as it arrives. */
+static size_t read_client_body(char *buf, size_t want)
+{
+    ssize_t n;
+
+    if (conn.fd < 0)
+        n = fread(buf, 1, want, req_body.in);
+    else if ((n = read_buffered(req_body.in, buf, want)) == 0)
+    {
+        do
+            n = sock_read(conn.fd, buf, want);
+        while (n < 0 && errno == EINTR);
+    }
+    if (n <= 0)
+        log_exit("failed to read request body");
+    return (n);
+}
+
+/* For another attempt at an upstream; not possible once a body that was
+   left in the socket has been read from it. */
+static int rewind_body(void)
+{
+    if (!req_body.data && req_body.spool < 0 && req_body.delivered > 0)
+        return (0);
+    req_body.delivered = 0;
+    return (1);
+}
+
+/* The rest of a body left in the socket is read before the connection is
+   closed, which would otherwise reset it under the response. */
+static void discard_body(void)
+{
+    char *data;
+
+    if (req_body.data || req_body.spool >= 0)
+        return;
+    while (body_chunk(&data) > 0)
+        ;
+}
+
+/* Sends the rest of the body upstream; a spooled one with sendfile(2). */
+static int send_body(int fd)
+{
+    char *data;
+    ssize_t n;
+
+    while (req_body.spool >= 0 && req_body.delivered < req_body.length)
+    {
+        off_t offset = req_body.delivered;
+
+        n = sendfile(fd, req_body.spool, &offset, req_body.length - req_body.delivered);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return (-1);
+        req_body.delivered += n;
+    }
+    while ((n = body_chunk(&data)) > 0)
+    {
+        struct iovec iov;
+
+        iov.iov_base = data;
+        iov.iov_len = n;
+        if (writev_all(fd, &iov, 1) < 0)
+            return (-1);
+    }
+    return (0);
+}
+
+static char *lookup_header_field_value(struct HTTPRequest *req, char *name)
+{
+    struct HTTPHeaderField *h;
+
+    h = req->header;
+    while (h)
+    {
+        if (strcasecmp(h->name, name) == 0)
+            return (h->value);
+        h = h->next;
+    }
+    return (NULL);
+}
+
+/* Bodies are only framed by Content-Length here. A Transfer-Encoding
+   next to one leaves the framing ambiguous, which must not reach a
+   backend; without one there is no coding we could decode. */
+static void respond_to(struct HTTPRequest *req, FILE *out)
+{
+    struct Route *route;
+
+    if (lookup_header_field_value(req, "Transfer-Encoding"))
+    {
+        if (lookup_header_field_value(req, "Content-Length"))
+            bad_request(req, out);
+        else
+            not_implemented(req, out);
+    }
+    else if ((route = find_route(req)) && route->websocket)
+        websocket_request(req, out, route);
+    else if (route)
+        proxy_request(req, out, route);
+    else if (strcmp(req->method, "GET") == 0)
+        do_file_response(req, out);
+    else if (strcmp(req->method, "HEAD") == 0)
+        do_file_response(req, out);
+    else if (strcmp(req->method, "POST") == 0)
+        method_not_allowed(req, out);
+    else
+        not_implemented(req, out);
+}
+
+static void do_file_response(struct HTTPRequest *req, FILE *out)
+{
+    struct FileInfo *info;
+
+    if (pack.image)
+    {
+        snapshot_response(req, out);
+        return;
+    }
+    info = resolve_file(req->path);
+    trace_stamp(STAMP_RESOLVED);
+    if (!info)
+    {
+        bad_request(req, out);
+        return;
+    }
+    if (info->dir)
+        directory_response(req, out, info);
+    else if (info->ok)
+        send_file(req, out, info);
+    else
+        not_found(req, out);
+    free_fileinfo(info);
+}
+
+static void send_file(struct HTTPRequest *req, FILE *out, struct FileInfo *info)
+{
+    output_common_header_fields(req, out, "200 OK");
+    fprintf(out, "Content-Length: %ld\r\n", info->size);
+    fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
+    fprintf(out, "\r\n");
+    if (strcmp(req->method, "HEAD") != 0)
+        send_file_range(info->fd, 0, info->size);
+    fflush(out);
+}
+
+/* Sends len bytes of fd from offset after what is buffered, with
+   sendfile(2) when the socket takes it and through the stdio stream
+   otherwise. */
+static void send_file_range(int fd, off_t offset, size_t len)
+{
+    char buf[BUFSIZ];
+    int direct = direct_output();
+
+    fflush(conn.out);
+    while (len > 0)
+    {
+        ssize_t n;
+
+        if (direct)
+            n = sendfile(conn.fd, fd, &offset, len);
+        else
+            n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            log_exit("failed to send file: %s", n < 0 ? strerror(errno) : "file shrank");
+        if (!direct)
+        {
+            if (fwrite(buf, 1, n, conn.out) < (size_t)n)
+                log_exit("failed to write to socket: %s", strerror(errno));
+            offset += n;
+        }
+        else
+        {
+            if (conn.stamp[STAMP_FIRST_WRITE] == 0)
+                trace_stamp(STAMP_FIRST_WRITE);
+            conn.bytes_sent += n;
+        }
+        len -= n;
+    }
+    fflush(conn.out);
+}
+
+/* Relative links in an index only work from a URL that ends in "/", so
+   other directory URLs are redirected there first. */
+static void directory_response(struct HTTPRequest *req, FILE *out, struct FileInfo *info)
+{
+    struct stat st;
+    int fd;
+
+    if (info->path[strlen(info->path) - 1] != '/')
+    {
+        redirect_to_directory(req, out, info->path);
+        return;
+    }
+    /* The directory was opened beneath the docroot and INDEX_FILE is a
+       single component, so a plain openat(2) cannot escape. */
+    fd = openat(info->fd, INDEX_FILE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        char *path = (char *)xmalloc(strlen(info->path) + sizeof(INDEX_FILE));
+
+        sprintf(path, "%s%s", info->path, INDEX_FILE);
+        close(info->fd);
+        free(info->path);
+        info->fd = fd;
+        info->path = path;
+        info->size = st.st_size;
+        send_file(req, out, info);
+        return;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (autoindex.enabled)
+        autoindex_response(req, out, info);
+    else
+        not_found(req, out);
+}
+
+static void redirect_to_directory(struct HTTPRequest *req, FILE *out, char *path)
+{
+    char *query = strchr(req->path, '?');
+
+    output_common_header_fields(req, out, "301 Moved Permanently");
+    fprintf(out, "Location: ");
+    output_url_escaped(out, path);
+    fputc('/', out);
+    if (query)
+        output_query_escaped(out, query, strcspn(query, "#"));
+    fprintf(out, "\r\n");
+    fprintf(out, "Content-Length: 0\r\n");
+    fprintf(out, "\r\n");
+}
+
+static void setup_autoindex(void)
+{
+    if (!autoindex.enabled || !watcher.state)
+        return;
+    /* Slots are only backed by memory once a listing is stored. */
+    autoindex.slot = (struct AutoindexSlot *)mmap(NULL, sizeof(struct AutoindexSlot) * AUTOINDEX_SLOTS,
+                                                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (autoindex.slot == MAP_FAILED)
+        log_exit("mmap(2) failed: %s", strerror(errno));
+}
+
+static void autoindex_response(struct HTTPRequest *req, FILE *out, struct FileInfo *info)
+{
+    char *listing;
+    size_t len;
+
+    listing = autoindex_get(info, &len);
+    if (!listing)
+        listing = render_autoindex(info, &len);
+    output_common_header_fields(req, out, "200 OK");
+    fprintf(out, "Content-Length: %zu\r\n", len);
+    fprintf(out, "Content-Type: text/html; charset=utf-8\r\n");
+    fprintf(out, "\r\n");
+    if (strcmp(req->method, "HEAD") != 0 && fwrite(listing, 1, len, out) < len)
+        log_exit("failed to write to socket: %s", strerror(errno));
+    fflush(out);
+    free(listing);
+}
+
+static char *render_autoindex(struct FileInfo *info, size_t *len)
+{
+    char buf[32768];
+    char **names = NULL;
+    size_t nnames = 0, cap = 0;
+    uint64_t epoch = 0, resets = 0;
+    int cacheable = 0;
+    struct stat dst;
+    char *html;
+    FILE *f;
+    long n;
+
+    /* Note the epoch before reading: a change from here on makes the
+       listing stale before it is even stored. */
+    if (autoindex.slot && strlen(info->path) < PATH_CACHE_KEY_MAX && watch_current(NULL) && fstat(info->fd, &dst) == 0)
+    {
+        epoch = __atomic_load_n(dir_epoch(dst.st_dev, dst.st_ino), __ATOMIC_ACQUIRE);
+        resets = __atomic_load_n(&watcher.state->resets, __ATOMIC_ACQUIRE);
+        cacheable = 1;
+    }
+    while ((n = syscall(SYS_getdents64, info->fd, buf, sizeof(buf))) > 0)
+    {
+        for (long off = 0; off < n;)
+        {
+            struct LinuxDirent64 *d = (struct LinuxDirent64 *)(buf + off);
+
+            off += d->d_reclen;
+            if (d->d_name[0] == '.')
+                continue;
+            if (nnames == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                names = (char **)realloc(names, cap * sizeof(char *));
+                if (!names)
+                    log_exit("failed to allocate memory");
+            }
+            names[nnames] = (char *)xmalloc(strlen(d->d_name) + 1);
+            strcpy(names[nnames++], d->d_name);
+        }
+    }
+    if (n < 0)
+        log_exit("getdents64(2) failed on %s: %s", info->path, strerror(errno));
+    qsort(names, nnames, sizeof(char *), compare_names);
+    f = open_memstream(&html, len);
+    if (!f)
+        log_exit("open_memstream(3) failed: %s", strerror(errno));
+    fprintf(f, "<!DOCTYPE html>\n<html>\n<head><meta charset=\"utf-8\"><title>Index of ");
+    output_html_escaped(f, info->path);
+    fprintf(f, "</title></head>\n<body>\n<h1>Index of ");
+    output_html_escaped(f, info->path);
+    fprintf(f, "</h1>\n<pre>\n");
+    if (strcmp(info->path, "/") != 0)
+        fprintf(f, "<a href=\"../\">../</a>\n");
+    for (size_t i = 0; i < nnames; i++)
+    {
+        struct stat st;
+        char date[32];
+        char size[24];
+        int isdir, width;
+
+        if (fstatat(info->fd, names[i], &st, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+            free(names[i]);
+            continue;
+        }
+        isdir = S_ISDIR(st.st_mode);
+        strftime(date, sizeof(date), "%d-%b-%Y %H:%M", gmtime(&st.st_mtime));
+        fprintf(f, "<a href=\"");
+        output_url_escaped(f, names[i]);
+        fprintf(f, "%s\">", isdir ? "/" : "");
+        output_html_escaped(f, names[i]);
+        if (isdir)
+            strcpy(size, "-");
+        else
+            snprintf(size, sizeof(size), "%lld", (long long)st.st_size);
+        width = strlen(names[i]) + isdir;
+        fprintf(f, "%s</a>%*s %s %12s\n", isdir ? "/" : "", width < 50 ? 50 - width : 1, "", date, size);
+        free(names[i]);
+    }
+    fprintf(f, "</pre>\n</body>\n</html>\n");
+    fclose(f);
+    free(names);
+    if (cacheable)
+        autoindex_put(info->path, &dst, epoch, resets, html, *len);
+    return (html);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return (strcmp(*(char *const *)a, *(char *const *)b));
+}
+
+static void output_html_escaped(FILE *f, char *s)
+{
+    for (; *s; s++)
+    {
+        switch (*s)
+        {
+        case '<':
+            fputs("&lt;", f);
+            break;
+        case '>':
+            fputs("&gt;", f);
+            break;
+        case '&':
+            fputs("&amp;", f);
+            break;
+        case '"':
+            fputs("&quot;", f);
+            break;
+        default:
+            fputc(*s, f);
+        }
+    }
+}
+
+static void output_url_escaped(FILE *f, char *s)
+{
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+
+        if (isalnum(c) || strchr("/-._~!$'()*+,;=:@", c))
+            fputc(c, f);
+        else
+            fprintf(f, "%%%02X", c);
+    }
+}
+
+/* The query is passed on as the client sent it, except for bytes that
+   may not appear in a URI, control characters above all. */
+static void output_query_escaped(FILE *f, char *s, size_t len)
+{
+    for (; len > 0; s++, len--)
+    {
+        unsigned char c = *s;
+
+        if (c > ' ' && c < 0x7f && !strchr("\"<>\\^`{|}", c))
+            fputc(c, f);
+        else
+            fprintf(f, "%%%02X", c);
+    }
+}
+
+static char *autoindex_get(struct FileInfo *info, size_t *len)
+{
+    struct AutoindexSlot *e;
+    size_t plen = strlen(info->path);
+    struct stat st;
+    uint64_t h;
+    uint32_t seq;
+    char *data;
+
+    if (!autoindex.slot || plen >= PATH_CACHE_KEY_MAX || !watch_current(NULL) || fstat(info->fd, &st) < 0)
+        return (NULL);
+    h = pack_hash(info->path, plen);
+    e = &autoindex.slot[h % AUTOINDEX_SLOTS];
+    seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || seq == 0 || e->hash != h || strcmp(e->path, info->path) != 0 || e->len > AUTOINDEX_SLOT_SIZE)
+        return (NULL);
+    /* The same URL may name another directory since, after a rename. */
+    if (e->dev != (uint64_t)st.st_dev || e->ino != (uint64_t)st.st_ino ||
+        e->epoch != __atomic_load_n(dir_epoch(st.st_dev, st.st_ino), __ATOMIC_ACQUIRE) ||
+        e->resets != __atomic_load_n(&watcher.state->resets, __ATOMIC_ACQUIRE))
+        return (NULL);
+    *len = e->len;
+    data = (char *)xmalloc(*len + 1);
+    memcpy(data, e->data, *len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+    {
+        free(data);
+        return (NULL);
+    }
+    return (data);
+}
+
+static void autoindex_put(char *path, struct stat *st, uint64_t epoch, uint64_t resets, char *data, size_t len)
+{
+    struct AutoindexSlot *e;
+    size_t plen = strlen(path);
+    uint64_t h;
+    uint32_t seq;
+
+    if (len > AUTOINDEX_SLOT_SIZE)
+        return;
+    h = pack_hash(path, plen);
+    e = &autoindex.slot[h % AUTOINDEX_SLOTS];
+    seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    e->hash = h;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->epoch = epoch;
+    e->resets = resets;
+    e->len = len;
+    memcpy(e->path, path, plen + 1);
+    memcpy(e->data, data, len);
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status)
+{
+    char buf[BUFSIZ];
+
+    format_common_header_fields(req, status, buf, sizeof(buf));
+    fputs(buf, out);
+}
+
+static size_t format_common_header_fields(struct HTTPRequest *req, char *status, char *buf, size_t size)
+{
+    time_t t;
+    struct tm *tm;
+    char date[64];
+
+    t = time(NULL);
+    tm = gmtime(&t);
+    if (!tm)
+        log_exit("gmtime() failed: %s", strerror(errno));
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", tm);
+    conn.status = atoi(status);
+    DTRACE_PROBE3(r3u, response__start, conn.fd, req->path, conn.status);
+    return (snprintf(buf, size,
+                     "HTTP/1.%d %s\r\n"
+                     "Date: %s\r\n"
+                     "Server: %s/%s\r\n"
+                     "Connection: %s\r\n",
+                     req->protocol_minor_version, status, date, SERVER_NAME, SERVER_VERSION,
+                     conn.status == 101 ? "Upgrade" : "close"));
+}
+
+/* Writes straight to the socket, bypassing the stdio buffer of the
+   connection, which must be empty at this point. */
+static void write_response(struct iovec *iov, int n)
+{
+    if (!direct_output())
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, conn.out) < iov[i].iov_len)
+                log_exit("failed to write to socket: %s", strerror(errno));
+        }
+        fflush(conn.out);
+        return;
+    }
+    while (n > 0)
+    {
+        ssize_t done;
+
+        done = writev(conn.fd, iov, n);
+        if (done < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_exit("failed to write to socket: %s", strerror(errno));
+        }
+        if (conn.stamp[STAMP_FIRST_WRITE] == 0)
+            trace_stamp(STAMP_FIRST_WRITE);
+        conn.bytes_sent += done;
+        while (n > 0 && (size_t)done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+static char *guess_content_type(struct FileInfo *info)
+{
+    return (pack_mime_type(info->path));
+}
+
+/* --snapshot without a pack file: deployments are immutable, so the
+   docroot is packed once at startup into a sealed memfd that every
+   connection process shares. There is no lstat(2), open(2) or read(2)
+   left on the request path. SIGHUP rebuilds the image. */
+static void build_snapshot(char *root)
+{
+    size_t size;
+    int fd;
+
+    fd = memfd_create("r3u-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        log_exit("memfd_create(2) failed: %s", strerror(errno));
+    size = pack_build(root, fd, NULL);
+    if (size == 0)
+        log_exit("failed to build snapshot of %s: %s", root, pack_errmsg);
+    /* Sealed, so not even a stray write in a connection process can
+       change what the others serve. */
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    pack.image = (struct PackHeader *)mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (pack.image == MAP_FAILED)
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    pack.size = size;
+    close(fd);
+    log_message("snapshot of %s: %u files, %zu bytes", root, pack.image->count, size);
+}
+
+/* The directory is held open so that the pack can still be swapped
+   after chroot(2). */
+static void open_pack(char *path)
+{
+    char *dir, *base;
+
+    dir = strdup(path);
+    base = strdup(path);
+    if (!dir || !base)
+        log_exit("failed to allocate memory");
+    pack.dirfd = open(dirname(dir), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (pack.dirfd < 0)
+        log_exit("failed to open %s: %s", dir, strerror(errno));
+    pack.name = strdup(basename(base));
+    free(dir);
+    free(base);
+    if (load_pack() < 0)
+        log_exit("failed to load %s: %s", path, pack_errmsg);
+    log_message("pack %s: %u files, %zu bytes", path, pack.image->count, pack.size);
+}
+
+static int load_pack(void)
+{
+    struct PackHeader *image;
+    struct stat st;
+    int fd;
+
+    fd = openat(pack.dirfd, pack.name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return (pack_fail("%s", strerror(errno)));
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return (pack_fail("%s", strerror(errno)));
+    }
+    image = (struct PackHeader *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return (pack_fail("%s", strerror(errno)));
+    if (pack_validate(image, st.st_size) < 0)
+    {
+        munmap(image, st.st_size);
+        return (-1);
+    }
+    if (pack.image)
+        munmap(pack.image, pack.size);
+    pack.image = image;
+    pack.size = st.st_size;
+    pack.st = st;
+    return (0);
+}
+
+/* Deploys replace the pack with rename(2). At most once a second the
+   listener checks whether the path names another file and maps it; new
+   connections get the new image while running ones finish on the one
+   they inherited. A broken pack is reported once and the old one kept. */
+static void refresh_pack(void)
+{
+    struct stat st;
+    time_t now;
+
+    if (!pack.name)
+        return;
+    now = time(NULL);
+    if (now == pack.checked)
+        return;
+    pack.checked = now;
+    if (fstatat(pack.dirfd, pack.name, &st, 0) < 0)
+        return;
+    if (st.st_dev == pack.st.st_dev && st.st_ino == pack.st.st_ino && st.st_size == pack.st.st_size &&
+        st.st_mtime == pack.st.st_mtime)
+        return;
+    if (load_pack() < 0)
+    {
+        log_message("keeping the current pack, failed to load %s: %s", pack.path, pack_errmsg);
+        pack.st = st;
+        return;
+    }
+    log_message("pack %s: %u files, %zu bytes", pack.path, pack.image->count, pack.size);
+}
+
+static void snapshot_response(struct HTTPRequest *req, FILE *out)
+{
+    struct PackEntry *e;
+    struct PackVariant *v;
+    struct iovec iov[3];
+    char head[BUFSIZ];
+    char *base = (char *)pack.image;
+    char path[PATH_MAX];
+    char *inm;
+    int n = 2;
+
+    if (normalize_path(req->path, path, sizeof(path)) < 0)
+    {
+        bad_request(req, out);
+        return;
+    }
+    e = snapshot_lookup(path);
+    trace_stamp(STAMP_RESOLVED);
+    if (!e)
+    {
+        if (snapshot_has_index(path))
+            redirect_to_directory(req, out, path);
+        else
+            not_found(req, out);
+        return;
+    }
+    v = &e->variant[PACK_IDENTITY];
+    if (e->variant[PACK_GZIP].header_len && accepts_gzip(req))
+        v = &e->variant[PACK_GZIP];
+    inm = lookup_header_field_value(req, "If-None-Match");
+    if (inm && etag_matches(inm, base + v->etag, v->etag_len))
+    {
+        output_common_header_fields(req, out, "304 Not Modified");
+        fprintf(out, "ETag: %.*s\r\n\r\n", (int)v->etag_len, base + v->etag);
+        return;
+    }
+    fflush(out);
+    iov[0].iov_base = head;
+    iov[0].iov_len = format_common_header_fields(req, "200 OK", head, sizeof(head));
+    iov[1].iov_base = base + v->header;
+    iov[1].iov_len = v->header_len;
+    if (strcmp(req->method, "HEAD") != 0 && v->size > 0)
+    {
+        iov[2].iov_base = base + v->body;
+        iov[2].iov_len = v->size;
+        n = 3;
+    }
+    write_response(iov, n);
+}
+
+/* Packs hold files only, so a directory is served by its index. */
+static struct PackEntry *snapshot_lookup(char *path)
+{
+    size_t len = strlen(path);
+    char index[PATH_MAX];
+
+    if (path[len - 1] != '/')
+        return (pack_lookup(pack.image, path));
+    if (len + sizeof(INDEX_FILE) > sizeof(index))
+        return (NULL);
+    sprintf(index, "%s%s", path, INDEX_FILE);
+    return (pack_lookup(pack.image, index));
+}
+
+static int snapshot_has_index(char *path)
+{
+    size_t len = strlen(path);
+    char index[PATH_MAX];
+
+    if (path[len - 1] == '/' || len + sizeof(INDEX_FILE) + 1 > sizeof(index))
+        return (0);
+    sprintf(index, "%s/%s", path, INDEX_FILE);
+    return (pack_lookup(pack.image, index) != NULL);
+}
+
+/* gzip is acceptable if listed without q=0. */
+static int accepts_gzip(struct HTTPRequest *req)
+{
+    char *p;
+
+    p = lookup_header_field_value(req, "Accept-Encoding");
+    if (!p || !(p = strcasestr(p, "gzip")))
+        return (0);
+    p += 4;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p != ';')
+        return (1);
+    p++;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+        return (strtod(p + 2, NULL) > 0);
+    return (1);
+}
+
+/* Weak comparison, as If-None-Match calls for: W/ prefixes are ignored
+   and any tag in the list may match. */
+static int etag_matches(char *header, char *etag, size_t len)
+{
+    char *p;
+
+    for (p = header; *p; p++)
+    {
+        if (*p == '*')
+            return (1);
+        if (*p == '"' && strncmp(p, etag, len) == 0)
+            return (1);
+        if (*p == '"')
+        {
+            p = strchr(p + 1, '"');
+            if (!p)
+                break;
+        }
+    }
+    return (0);
+}
+
+/* Parses /prefix=host:port[,host:port...]; IPv6 hosts go in brackets. */
+static void add_route(char *spec, int kind)
+{
+    static char *options[] = {"--proxy", "--fastcgi", "--websocket"};
+    struct Route *route;
+    char *eq, *p;
+
+    eq = strchr(spec, '=');
+    if (spec[0] != '/' || !eq || !eq[1])
+        log_exit("%s wants /prefix=address[,address...]: %s", options[kind], spec);
+    if (proxy.nroutes == MAX_ROUTES)
+        log_exit("too many --proxy routes (at most %d)", MAX_ROUTES);
+    route = &proxy.route[proxy.nroutes++];
+    route->prefix = strndup(spec, eq - spec);
+    route->prefix_len = eq - spec;
+    route->nbackends = 0;
+    route->fastcgi = kind == ROUTE_FASTCGI;
+    route->websocket = kind == ROUTE_WEBSOCKET;
+    for (p = strtok(strdup(eq + 1), ","); p; p = strtok(NULL, ","))
+    {
+        if (route->nbackends == MAX_BACKENDS)
+            log_exit("too many backends for %s (at most %d)", route->prefix, MAX_BACKENDS);
+        route->backend[route->nbackends++].name = p;
+    }
+}
+
+static void setup_proxy(void)
+{
+    for (int r = 0; r < proxy.nroutes; r++)
+    {
+        for (int b = 0; b < proxy.route[r].nbackends; b++)
+        {
+            struct Backend *backend = &proxy.route[r].backend[b];
+            struct addrinfo hints, *res;
+            char host[NI_MAXHOST];
+            char *colon;
+            int err;
+
+            if (strncmp(backend->name, "unix:", 5) == 0)
+            {
+                struct sockaddr_un *sun = (struct sockaddr_un *)&backend->addr;
+
+                if (strlen(backend->name + 5) >= sizeof(sun->sun_path))
+                    log_exit("socket path too long: %s", backend->name + 5);
+                sun->sun_family = AF_UNIX;
+                strcpy(sun->sun_path, absolute_path(backend->name + 5));
+                backend->addrlen = sizeof(struct sockaddr_un);
+                continue;
+            }
+            colon = strrchr(backend->name, ':');
+            if (!colon || !colon[1] || colon == backend->name || (size_t)(colon - backend->name) >= sizeof(host))
+                log_exit("backend %s is not host:port", backend->name);
+            if (backend->name[0] == '[' && colon[-1] == ']')
+                snprintf(host, sizeof(host), "%.*s", (int)(colon - backend->name - 2), backend->name + 1);
+            else
+                snprintf(host, sizeof(host), "%.*s", (int)(colon - backend->name), backend->name);
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if ((err = getaddrinfo(host, colon + 1, &hints, &res)) != 0)
+                log_exit("%s: %s", backend->name, gai_strerror(err));
+            memcpy(&backend->addr, res->ai_addr, res->ai_addrlen);
+            backend->addrlen = res->ai_addrlen;
+            freeaddrinfo(res);
+        }
+    }
+    for (int i = 0; i < proxy.nbalance; i++)
+        set_balance(proxy.balance[i]);
+    for (int r = 0; r < proxy.nroutes; r++)
+    {
+        if (proxy.route[r].balance == BALANCE_HASH)
+            build_ring(&proxy.route[r]);
+    }
+    if (proxy.nroutes == 0)
+        return;
+    proxy.state = (struct ProxyState *)mmap(NULL, sizeof(struct ProxyState), PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (proxy.state == MAP_FAILED)
+        log_exit("mmap(2) failed: %s", strerror(errno));
+}
+
+/* Routes match the normalized path, so dot segments cannot move a request
+   in or out of a prefix; the longest matching prefix wins. */
+static struct Route *find_route(struct HTTPRequest *req)
+{
+    struct Route *best = NULL;
+    char path[PATH_MAX];
+
+    if (proxy.nroutes == 0 || normalize_path(req->path, path, sizeof(path)) < 0)
+        return (NULL);
+    for (int r = 0; r < proxy.nroutes; r++)
+    {
+        struct Route *route = &proxy.route[r];
+        size_t n = route->prefix_len;
+
+        /* Whole segments only: /api takes /api and /api/x, not /apiary. */
+        if (strncmp(path, route->prefix, n) != 0 || (path[n] != '\0' && path[n] != '/' && route->prefix[n - 1] != '/'))
+            continue;
+        if (!best || n > best->prefix_len)
+            best = route;
+    }
+    return (best);
+}
+
+/* Connection processes serve one request and exit, so there is no
+   process to keep idle upstream connections in: each request opens its
+   own and asks for HTTP/1.0 semantics, which also keeps chunked bodies
+   out of the relay. A failed connect is retried on another backend; a
+   failed exchange only for methods that are safe to repeat. */
+static void proxy_request(struct HTTPRequest *req, FILE *out, struct Route *route)
+{
+    struct CacheEntry *e;
+    long now;
+
+    if (!microcache_key(req, route))
+    {
+        forward_request(req, out, route);
+        return;
+    }
+    e = microcache_get();
+    now = monotonic_usec();
+    if (e && now < e->fresh_until)
+    {
+        if (metrics)
+            metric_add(&core_metrics()->microcache_hits, 1);
+        serve_cached(req, out, e, "HIT");
+        free(e);
+        return;
+    }
+    if (e && now < e->stale_until)
+    {
+        if (metrics)
+            metric_add(&core_metrics()->microcache_stale, 1);
+        serve_cached(req, out, e, "STALE");
+        free(e);
+        if (strcmp(req->method, "GET") == 0 && acquire_lease())
+            revalidate(req, out, route);
+        return;
+    }
+    /* Kept in case the upstream fails (stale-if-error). */
+    cache_req.stale = e;
+    if (strcmp(req->method, "GET") == 0 && (e = await_fill()) != NULL)
+    {
+        if (metrics)
+            metric_add(&core_metrics()->microcache_hits, 1);
+        serve_cached(req, out, e, "HIT");
+        free(e);
+        return;
+    }
+    if (metrics)
+        metric_add(&core_metrics()->microcache_misses, 1);
+    forward_request(req, out, route);
+    release_lease(microcache_put());
+}
+
+static void forward_request(struct HTTPRequest *req, FILE *out, struct Route *route)
+{
+    char head[PROXY_HEAD_MAX];
+    ssize_t len = 0;
+    int idempotent = strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0;
+    uint32_t tried = 0;
+    int timed_out = 0;
+    int fd = -1;
+    int b = 0;
+
+    for (int attempt = 0; attempt <= proxy.retries; attempt++)
+    {
+        struct Backend *backend;
+        int sent;
+
+        if (!rewind_body())
+            break;
+        b = pick_backend(route, req, tried);
+        tried |= 1U << b;
+        backend = &route->backend[b];
+        metric_add(&proxy.state->backend[route - proxy.route][b].requests, 1);
+        hold_backend(route, b);
+        fd = connect_backend(backend);
+        if (fd < 0)
+        {
+            timed_out = errno == ETIMEDOUT;
+            log_message("failed to connect to %s: %s", backend->name, strerror(errno));
+            release_backend();
+            backend_failed(route, b);
+            continue;
+        }
+        if (route->fastcgi)
+        {
+            sent = send_fastcgi_request(fd, req) == 0;
+            if (sent && (len = read_fastcgi_head(fd, head, sizeof(head))) > 0)
+                break;
+        }
+        else
+        {
+            sent = send_upstream_request(fd, req, backend, route->websocket) == 0;
+            if (sent && (len = read_upstream_head(fd, head, sizeof(head))) > 0)
+                break;
+        }
+        timed_out = errno == EAGAIN || errno == EWOULDBLOCK;
+        log_message("no response from %s: %s", backend->name, timed_out ? "timed out" : strerror(errno));
+        release_backend();
+        backend_failed(route, b);
+        close(fd);
+        fd = -1;
+        if (!idempotent)
+            break;
+    }
+    trace_stamp(STAMP_RESOLVED);
+    if (fd < 0 && serve_stale(req, out))
+        return;
+    if (fd < 0)
+    {
+        output_common_header_fields(req, out, timed_out ? "504 Gateway Timeout" : "502 Bad Gateway");
+        fprintf(out, "Content-Length: 0\r\n\r\n");
+        return;
+    }
+    __atomic_store_n(&proxy.state->backend[route - proxy.route][b].fails, 0, __ATOMIC_RELAXED);
+    if (route->fastcgi)
+        relay_fastcgi_response(req, out, head, len);
+    else if (route->websocket && websocket_switched(head, len))
+        websocket_relay(req, out, fd, head, len);
+    else
+        relay_response(req, out, fd, head, len);
+    close(fd);
+    release_backend();
+}
+
+/* Parses /prefix=algorithm for a route given with --proxy. */
+static void set_balance(char *spec)
+{
+    struct Route *route = NULL;
+    char *eq = strchr(spec, '=');
+    char *alg;
+
+    for (int r = 0; eq && r < proxy.nroutes; r++)
+    {
+        if (proxy.route[r].prefix_len == (size_t)(eq - spec) && strncmp(proxy.route[r].prefix, spec, eq - spec) == 0)
+            route = &proxy.route[r];
+    }
+    if (!route)
+        log_exit("--proxy-balance names no --proxy route: %s", spec);
+    alg = eq + 1;
+    if (strcmp(alg, "rr") == 0)
+        route->balance = BALANCE_ROUND_ROBIN;
+    else if (strcmp(alg, "leastconn") == 0)
+        route->balance = BALANCE_LEAST_CONN;
+    else if (strcmp(alg, "p2c") == 0)
+        route->balance = BALANCE_P2C;
+    else if (strcmp(alg, "hash") == 0)
+        route->balance = BALANCE_HASH;
+    else if (strncmp(alg, "hash:", 5) == 0 && alg[5])
+    {
+        route->balance = BALANCE_HASH;
+        route->hash_header = alg + 5;
+    }
+    else
+        log_exit("unknown balancing algorithm: %s", alg);
+}
+
+static void build_ring(struct Route *route)
+{
+    route->nring = route->nbackends * PROXY_RING_POINTS;
+    route->ring = (struct RingPoint *)xmalloc(route->nring * sizeof(struct RingPoint));
+    for (int b = 0; b < route->nbackends; b++)
+    {
+        for (int i = 0; i < PROXY_RING_POINTS; i++)
+        {
+            char point[NI_MAXHOST + 16];
+            int n = snprintf(point, sizeof(point), "%s#%d", route->backend[b].name, i);
+
+            route->ring[b * PROXY_RING_POINTS + i].hash = mix_hash(pack_hash(point, n));
+            route->ring[b * PROXY_RING_POINTS + i].backend = b;
+        }
+    }
+    qsort(route->ring, route->nring, sizeof(struct RingPoint), compare_ring_points);
+}
+
+static int compare_ring_points(const void *a, const void *b)
+{
+    uint64_t x = ((struct RingPoint *)a)->hash;
+    uint64_t y = ((struct RingPoint *)b)->hash;
+
+    return (x < y ? -1 : x > y);
+}
+
+/* Backend state is shared by every connection process, read and updated
+   with single atomic operations rather than under a lock. Each algorithm
+   looks first at the backends that are up and not yet tried for this
+   request, then at any not yet tried, then at all of them. */
+static int pick_backend(struct Route *route, struct HTTPRequest *req, uint32_t tried)
+{
+    for (int pass = 0; pass < 3; pass++)
+    {
+        int b = -1;
+
+        switch (route->balance)
+        {
+        case BALANCE_LEAST_CONN:
+            b = pick_least_conn(route, tried, pass);
+            break;
+        case BALANCE_P2C:
+            b = pick_p2c(route, tried, pass);
+            break;
+        case BALANCE_HASH:
+            b = pick_hash(route, req, tried, pass);
+            break;
+        default:
+            b = pick_round_robin(route, tried, pass);
+        }
+        if (b >= 0)
+            return (b);
+    }
+    return (0);
+}
+
+static int pick_round_robin(struct Route *route, uint32_t tried, int pass)
+{
+    uint64_t next = __atomic_fetch_add(&proxy.state->next[route - proxy.route], 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < route->nbackends; i++)
+    {
+        int b = (next + i) % route->nbackends;
+
+        if (backend_candidate(route, b, tried, pass))
+            return (b);
+    }
+    return (-1);
+}
+
+/* Ties go round robin, so that an idle pool is not all sent to the first. */
+static int pick_least_conn(struct Route *route, uint32_t tried, int pass)
+{
+    struct BackendState *state = proxy.state->backend[route - proxy.route];
+    uint64_t next = __atomic_fetch_add(&proxy.state->next[route - proxy.route], 1, __ATOMIC_RELAXED);
+    uint32_t least = UINT32_MAX;
+    int best = -1;
+
+    for (int i = 0; i < route->nbackends; i++)
+    {
+        int b = (next + i) % route->nbackends;
+        uint32_t active = __atomic_load_n(&state[b].active, __ATOMIC_RELAXED);
+
+        if (backend_candidate(route, b, tried, pass) && active < least)
+        {
+            least = active;
+            best = b;
+        }
+    }
+    return (best);
+}
+
+/* Two random candidates, the less loaded wins: nearly as good as least
+   connections while reading only two counters. */
+static int pick_p2c(struct Route *route, uint32_t tried, int pass)
+{
+    struct BackendState *state = proxy.state->backend[route - proxy.route];
+    static uint64_t seed = 0;
+    int candidates[MAX_BACKENDS];
+    int n = 0, a, b;
+
+    for (int i = 0; i < route->nbackends; i++)
+    {
+        if (backend_candidate(route, i, tried, pass))
+            candidates[n++] = i;
+    }
+    if (n <= 1)
+        return (n ? candidates[0] : -1);
+    /* Forked processes would otherwise all draw the same numbers. */
+    if (seed == 0)
+        seed = mix_hash((uint64_t)getpid() << 32 ^ (uint64_t)monotonic_usec()) | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    a = seed % n;
+    b = (seed >> 32) % (n - 1);
+    if (b >= a)
+        b++;
+    a = candidates[a];
+    b = candidates[b];
+    return (__atomic_load_n(&state[b].active, __ATOMIC_RELAXED) < __atomic_load_n(&state[a].active, __ATOMIC_RELAXED) ? b : a);
+}
+
+/* Consistent hashing with bounded loads: walk the ring clockwise from the
+   key and take the first backend carrying no more than PROXY_HASH_LOAD
+   times the average, so a hot key spills over to the next backend only
+   while it is hot. Keys are the path without the query, or a header. */
+static int pick_hash(struct Route *route, struct HTTPRequest *req, uint32_t tried, int pass)
+{
+    struct BackendState *state = proxy.state->backend[route - proxy.route];
+    char *key = NULL;
+    size_t len = 0;
+    uint64_t total = 0, h;
+    int lo = 0, hi = route->nring, n = 0;
+    uint32_t bound;
+    int first = -1;
+
+    if (route->hash_header && (key = lookup_header_field_value(req, route->hash_header)))
+        len = strcspn(key, "\r\n");
+    if (!key)
+    {
+        key = req->path;
+        len = strcspn(key, "?");
+    }
+    h = mix_hash(pack_hash(key, len));
+    for (int b = 0; b < route->nbackends; b++)
+    {
+        if (backend_candidate(route, b, tried, pass))
+        {
+            total += __atomic_load_n(&state[b].active, __ATOMIC_RELAXED);
+            n++;
+        }
+    }
+    if (n == 0)
+        return (-1);
+    bound = (uint32_t)(PROXY_HASH_LOAD * (total + 1) / n + 0.999);
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (route->ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (int i = 0; i < route->nring; i++)
+    {
+        int b = route->ring[(lo + i) % route->nring].backend;
+
+        if (!backend_candidate(route, b, tried, pass))
+            continue;
+        if (first < 0)
+            first = b;
+        if (__atomic_load_n(&state[b].active, __ATOMIC_RELAXED) < bound)
+            return (b);
+    }
+    return (first);
+}
+
+static int backend_candidate(struct Route *route, int b, uint32_t tried, int pass)
+{
+    if (pass == 2)
+        return (1);
+    if (tried & (1U << b))
+        return (0);
+    return (pass == 1 || __atomic_load_n(&proxy.state->backend[route - proxy.route][b].down_until, __ATOMIC_RELAXED) <= time(NULL));
+}
+
+/* The active count is given back by finish_request() too, so that a
+   process exiting halfway through a response does not leak it. */
+static void hold_backend(struct Route *route, int b)
+{
+    proxy.held = &proxy.state->backend[route - proxy.route][b].active;
+    __atomic_add_fetch(proxy.held, 1, __ATOMIC_RELAXED);
+}
+
+static void release_backend(void)
+{
+    if (!proxy.held)
+        return;
+    __atomic_sub_fetch(proxy.held, 1, __ATOMIC_RELAXED);
+    proxy.held = NULL;
+}
+
+/* The finalizer of splitmix64; FNV-1a alone spreads similar names poorly. */
+static uint64_t mix_hash(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (h);
+}
+
+static void backend_failed(struct Route *route, int b)
+{
+    struct BackendState *state = &proxy.state->backend[route - proxy.route][b];
+
+    metric_add(&state->failures, 1);
+    if (__atomic_add_fetch(&state->fails, 1, __ATOMIC_RELAXED) >= PROXY_MAX_FAILS)
+    {
+        if (__atomic_exchange_n(&state->down_until, time(NULL) + PROXY_FAIL_TIMEOUT, __ATOMIC_RELAXED) <= time(NULL))
+            log_message("backend %s is down for %ds", route->backend[b].name, PROXY_FAIL_TIMEOUT);
+        __atomic_store_n(&state->fails, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static int connect_backend(struct Backend *backend)
+{
+    struct pollfd pfd;
+    struct timeval tv;
+    socklen_t errlen = sizeof(int);
+    int one = 1;
+    int err = 0;
+    int fd;
+
+    fd = socket(backend->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return (-1);
+    if (connect(fd, (struct sockaddr *)&backend->addr, backend->addrlen) < 0)
+    {
+        int n;
+
+        if (errno != EINPROGRESS)
+        {
+            err = errno;
+            close(fd);
+            errno = err;
+            return (-1);
+        }
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        do
+            n = poll(&pfd, 1, proxy.connect_timeout * 1000);
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            err = n == 0 ? ETIMEDOUT : errno;
+        else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+            err = errno;
+        if (err)
+        {
+            close(fd);
+            errno = err;
+            return (-1);
+        }
+    }
+    /* Blocking from here on, with --proxy-timeout on every read and
+       write rather than on the exchange as a whole. */
+    fcntl(fd, F_SETFL, 0);
+    tv.tv_sec = proxy.timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return (fd);
+}
+
+/* With upgrade the request is the opening handshake of a WebSocket,
+   which needs HTTP/1.1 and keeps the connection. */
+static int send_upstream_request(int fd, struct HTTPRequest *req, struct Backend *backend, int upgrade)
+{
+    struct HTTPHeaderField *h, *fields[64];
+    struct iovec iov[2];
+    char path[PATH_MAX];
+    char *query = strchr(req->path, '?');
+    char *forwarded = NULL;
+    char *buf = NULL;
+    size_t len = 0;
+    int nfields = 0;
+    int has_host = 0;
+    FILE *f;
+    int n = 1;
+
+    /* The backend gets the path the route was chosen by, not its own
+       reading of the raw one. */
+    if (normalize_path(req->path, path, sizeof(path)) < 0)
+        return (-1);
+    f = open_memstream(&buf, &len);
+    if (!f)
+        log_exit("open_memstream(3) failed: %s", strerror(errno));
+    fprintf(f, "%s ", req->method);
+    output_url_escaped(f, path);
+    if (query)
+        output_query_escaped(f, query, strcspn(query, "#"));
+    fprintf(f, " HTTP/1.%d\r\n", upgrade);
+    /* The parser keeps fields in reverse; send them as received. */
+    for (h = req->header; h && nfields < 64; h = h->next)
+        fields[nfields++] = h;
+    while (nfields-- > 0)
+    {
+        h = fields[nfields];
+        /* The body has been read already, so Expect is answered. */
+        if (hop_by_hop(h->name, strlen(h->name)) || strcasecmp(h->name, "Content-Length") == 0 ||
+            strcasecmp(h->name, "Expect") == 0)
+            continue;
+        if (strcasecmp(h->name, "X-Forwarded-For") == 0)
+        {
+            forwarded = h->value;
+            continue;
+        }
+        has_host |= strcasecmp(h->name, "Host") == 0;
+        fprintf(f, "%s: %.*s\r\n", h->name, (int)strcspn(h->value, "\r\n"), h->value);
+    }
+    if (!has_host)
+        fprintf(f, "Host: %s\r\n", backend->name);
+    if (forwarded)
+        fprintf(f, "X-Forwarded-For: %.*s, %s\r\n", (int)strcspn(forwarded, "\r\n"), forwarded, conn.peer);
+    else
+        fprintf(f, "X-Forwarded-For: %s\r\n", conn.peer);
+    fprintf(f, "X-Forwarded-Proto: %s\r\n", tls.cert ? "https" : "http");
+    if (req->length > 0)
+        fprintf(f, "Content-Length: %ld\r\n", req->length);
+    if (upgrade)
+        fprintf(f, "Upgrade: websocket\r\nConnection: Upgrade\r\n\r\n");
+    else
+        fprintf(f, "Connection: close\r\n\r\n");
+    fclose(f);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
+    /* A body in memory goes out with the head. */
+    if (req->length > 0 && req_body.data)
+    {
+        iov[1].iov_base = req_body.data;
+        iov[1].iov_len = req->length;
+        req_body.delivered = req->length;
+        n = 2;
+    }
+    if (writev_all(fd, iov, n) < 0 || send_body(fd) < 0)
+    {
+        free(buf);
+        return (-1);
+    }
+    free(buf);
+    return (0);
+}
+
+/* Returns the bytes read up to and past the blank line ending the
+   response head, or -1 with errno set. */
+static ssize_t read_upstream_head(int fd, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    while (len < size)
+    {
+        ssize_t n = read(fd, buf + len, size - len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = ECONNRESET;
+            return (-1);
+        }
+        len += n;
+        if (memmem(buf, len, "\r\n\r\n", 4))
+            return (len);
+    }
+    errno = E2BIG;
+    return (-1);
+}
+
+/* The status line is rebuilt with our own common fields; upstream fields
+   pass through except the hop-by-hop ones and those we set ourselves. */
+static void relay_response(struct HTTPRequest *req, FILE *out, int fd, char *head, size_t len)
+{
+    char *end = (char *)memmem(head, len, "\r\n\r\n", 4) + 4;
+    char *line;
+    char status[64];
+    size_t rest;
+
+    line = memchr(head, '\n', end - head) + 1;
+    if (strncmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ' || !isdigit(head[9]) || !isdigit(head[10]) ||
+        !isdigit(head[11]) || (size_t)(line - head - 11) > sizeof(status))
+    {
+        log_message("malformed response from upstream");
+        output_common_header_fields(req, out, "502 Bad Gateway");
+        fprintf(out, "Content-Length: 0\r\n\r\n");
+        return;
+    }
+    snprintf(status, sizeof(status), "%.*s", (int)(line - head - 9 - (line[-2] == '\r' ? 2 : 1)), head + 9);
+    if (atoi(status) >= 500 && serve_stale(req, out))
+        return;
+    output_common_header_fields(req, out, status);
+    start_capture(req, out, status);
+    copy_upstream_fields(out, line, end, NULL);
+    fputs("\r\n", out);
+    rest = head + len - end;
+    if (strcmp(req->method, "HEAD") == 0)
+    {
+        fflush(out);
+        return;
+    }
+    if (rest > 0 && fwrite(end, 1, rest, out) < rest)
+        log_exit("failed to write to socket: %s", strerror(errno));
+    fflush(out);
+    relay_body(fd);
+}
+
+/* Copies the header fields of an upstream response head from line up to
+   the blank line at end, except the hop-by-hop ones, those we set
+   ourselves and skip. */
+static void copy_upstream_fields(FILE *out, char *line, char *end, char *skip)
+{
+    char *next;
+
+    for (; line < end - 2; line = next)
+    {
+        size_t n;
+
+        next = memchr(line, '\n', end - line) + 1;
+        n = strcspn(line, ":\r\n");
+        if (n < (size_t)(next - line) && line[n] == ':' &&
+            (hop_by_hop(line, n) || (n == 4 && strncasecmp(line, "Date", 4) == 0) ||
+             (n == 6 && strncasecmp(line, "Server", 6) == 0) ||
+             (skip && strlen(skip) == n && strncasecmp(line, skip, n) == 0)))
+            continue;
+        fwrite(line, 1, next - line, out);
+    }
+}
+
+/* Moves the rest of the body from the upstream socket to the client
+   through a pipe with splice(2), without copying it into user space. */
+static void relay_body(int fd)
+{
+    int p[2];
+
+    /* A response the microcache may keep is copied until it turns out
+       to be too large for an entry, and so is any response the TLS
+       session has to encrypt. */
+    while (cache_req.capturing || !direct_output())
+    {
+        char buf[BUFSIZ];
+        ssize_t n;
+
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            log_exit("failed to read from upstream: %s", errno == EAGAIN ? "timed out" : strerror(errno));
+        if (n == 0)
+        {
+            fflush(conn.out);
+            return;
+        }
+        if (fwrite(buf, 1, n, conn.out) < (size_t)n)
+            log_exit("failed to write to socket: %s", strerror(errno));
+    }
+    fflush(conn.out);
+    if (cache_req.discard)
+        return;
+    if (pipe2(p, O_CLOEXEC) < 0)
+        log_exit("pipe(2) failed: %s", strerror(errno));
+    while (1)
+    {
+        ssize_t n, m;
+
+        n = splice(fd, NULL, p[1], NULL, PROXY_SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            log_exit("failed to read from upstream: %s", errno == EAGAIN ? "timed out" : strerror(errno));
+        if (n == 0)
+            break;
+        while (n > 0)
+        {
+            m = splice(p[0], NULL, conn.fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m < 0)
+                log_exit("failed to write to socket: %s", strerror(errno));
+            if (conn.stamp[STAMP_FIRST_WRITE] == 0)
+                trace_stamp(STAMP_FIRST_WRITE);
+            conn.bytes_sent += m;
+            n -= m;
+        }
+    }
+    close(p[0]);
+    close(p[1]);
+}
+
+static int hop_by_hop(char *name, size_t len)
+{
+    static char *names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding",
+                            "Upgrade", NULL};
+
+    for (char **n = names; *n; n++)
+    {
+        if (strlen(*n) == len && strncasecmp(name, *n, len) == 0)
+            return (1);
+    }
+    return (0);
+}
+
+/* One request per connection, so the request id is always the same and
+   FCGI_KEEP_CONN is never set: the application closes when done. The
+   body goes out in FCGI_STDIN records as it comes. */
+static int send_fastcgi_request(int fd, struct HTTPRequest *req)
+{
+    unsigned char begin[8] = {0, FCGI_RESPONDER, 0, 0, 0, 0, 0, 0};
+    char *host, *port;
+    struct HTTPHeaderField *h;
+    char path[PATH_MAX];
+    char script[PATH_MAX * 2];
+    char *query, *val;
+    char *buf = NULL;
+    char *data;
+    size_t len = 0, off;
+    ssize_t chunk;
+    FILE *f;
+
+    if (normalize_path(req->path, path, sizeof(path)) < 0)
+        strcpy(path, "/");
+    query = strchr(req->path, '?');
+    local_address(&host, &port);
+    f = open_memstream(&buf, &len);
+    if (!f)
+        log_exit("open_memstream(3) failed: %s", strerror(errno));
+    add_fastcgi_param(f, "GATEWAY_INTERFACE", "CGI/1.1", 7);
+    add_fastcgi_param(f, "SERVER_SOFTWARE", SERVER_NAME "/" SERVER_VERSION, strlen(SERVER_NAME "/" SERVER_VERSION));
+    add_fastcgi_param(f, "SERVER_PROTOCOL", req->http2 ? "HTTP/2.0" : req->protocol_minor_version ? "HTTP/1.1" : "HTTP/1.0", 8);
+    add_fastcgi_param(f, "SERVER_ADDR", host, strlen(host));
+    add_fastcgi_param(f, "SERVER_PORT", port, strlen(port));
+    add_fastcgi_param(f, "REMOTE_ADDR", conn.peer, strlen(conn.peer));
+    if (tls.cert)
+        add_fastcgi_param(f, "HTTPS", "on", 2);
+    add_fastcgi_param(f, "REQUEST_METHOD", req->method, strlen(req->method));
+    add_fastcgi_param(f, "REQUEST_URI", req->path, strlen(req->path));
+    add_fastcgi_param(f, "DOCUMENT_ROOT", document_root, strlen(document_root));
+    add_fastcgi_param(f, "DOCUMENT_URI", path, strlen(path));
+    add_fastcgi_param(f, "SCRIPT_NAME", path, strlen(path));
+    add_fastcgi_param(f, "QUERY_STRING", query ? query + 1 : "", query ? strlen(query + 1) : 0);
+    snprintf(script, sizeof(script), "%s%s", document_root, path);
+    add_fastcgi_param(f, "SCRIPT_FILENAME", script, strlen(script));
+    if ((val = lookup_header_field_value(req, "Content-Type")))
+        add_fastcgi_param(f, "CONTENT_TYPE", val, strcspn(val, "\r\n"));
+    if (req->length > 0)
+    {
+        char n[32];
+
+        add_fastcgi_param(f, "CONTENT_LENGTH", n, snprintf(n, sizeof(n), "%ld", req->length));
+    }
+    for (h = req->header; h; h = h->next)
+    {
+        char name[256];
+        size_t i;
+
+        /* Proxy would become HTTP_PROXY, which CGI code takes for the
+           proxy to use (httpoxy). */
+        if (strcasecmp(h->name, "Content-Type") == 0 || strcasecmp(h->name, "Content-Length") == 0 ||
+            strcasecmp(h->name, "Proxy") == 0 || strlen(h->name) + 6 > sizeof(name))
+            continue;
+        strcpy(name, "HTTP_");
+        for (i = 0; h->name[i]; i++)
+            name[i + 5] = h->name[i] == '-' ? '_' : toupper((unsigned char)h->name[i]);
+        name[i + 5] = '\0';
+        add_fastcgi_param(f, name, h->value, strcspn(h->value, "\r\n"));
+    }
+    fclose(f);
+    if (write_fastcgi_record(fd, FCGI_BEGIN_REQUEST, (char *)begin, sizeof(begin)) < 0)
+    {
+        free(buf);
+        return (-1);
+    }
+    for (off = 0; off < len; off += FCGI_RECORD_MAX)
+    {
+        if (write_fastcgi_record(fd, FCGI_PARAMS, buf + off, len - off < FCGI_RECORD_MAX ? len - off : FCGI_RECORD_MAX) < 0)
+        {
+            free(buf);
+            return (-1);
+        }
+    }
+    free(buf);
+    if (write_fastcgi_record(fd, FCGI_PARAMS, NULL, 0) < 0)
+        return (-1);
+    while ((chunk = body_chunk(&data)) > 0)
+    {
+        for (off = 0; off < (size_t)chunk; off += FCGI_STDIN_CHUNK)
+        {
+            size_t n = chunk - off < FCGI_STDIN_CHUNK ? chunk - off : FCGI_STDIN_CHUNK;
+
+            if (write_fastcgi_record(fd, FCGI_STDIN, data + off, n) < 0)
+                return (-1);
+        }
+    }
+    return (write_fastcgi_record(fd, FCGI_STDIN, NULL, 0));
+}
+
+/* Looked up once, so that an HTTP/2 stream can do it before it lets go of
+   the socket. */
+static void local_address(char **host, char **port)
+{
+    static char h[NI_MAXHOST] = "", p[NI_MAXSERV] = "";
+    static int known = 0;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if (!known && getsockname(conn.fd, (struct sockaddr *)&addr, &addrlen) == 0)
+        getnameinfo((struct sockaddr *)&addr, addrlen, h, sizeof(h), p, sizeof(p),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+    known = 1;
+    if (host)
+        *host = h;
+    if (port)
+        *port = p;
+}
+
+/* Lengths below 128 take one byte, others four with the top bit set. */
+static void add_fastcgi_param(FILE *f, char *name, char *value, size_t len)
+{
+    size_t lens[2] = {strlen(name), len};
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (lens[i] < 128)
+            fputc(lens[i], f);
+        else
+        {
+            fputc((lens[i] >> 24) | 0x80, f);
+            fputc((lens[i] >> 16) & 0xff, f);
+            fputc((lens[i] >> 8) & 0xff, f);
+            fputc(lens[i] & 0xff, f);
+        }
+    }
+    fputs(name, f);
+    fwrite(value, 1, len, f);
+}
+
+static int write_fastcgi_record(int fd, int type, char *data, size_t len)
+{
+    unsigned char header[8] = {FCGI_VERSION, type, 0, FCGI_REQUEST_ID, len >> 8, len & 0xff, 0, 0};
+    struct iovec iov[2];
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    return (writev_all(fd, iov, len ? 2 : 1));
+}
+
+/* Collects stdout up to the blank line that ends the CGI header. */
+static ssize_t read_fastcgi_head(int fd, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    fcgi.fd = fd;
+    fcgi.content = 0;
+    fcgi.padding = 0;
+    fcgi.ended = 0;
+    fcgi.pos = 0;
+    fcgi.len = 0;
+    while (len < size)
+    {
+        ssize_t n = read_fastcgi(buf + len, size - len);
+
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = ECONNRESET;
+            return (-1);
+        }
+        len += n;
+        if (cgi_header_end(buf, len))
+            return (len);
+    }
+    errno = E2BIG;
+    return (-1);
+}
+
+/* CGI allows bare newlines; returns where the body starts, or NULL. */
+static char *cgi_header_end(char *buf, size_t len)
+{
+    for (char *p = buf; p + 1 < buf + len; p++)
+    {
+        if (*p != '\n')
+            continue;
+        if (p[1] == '\n')
+            return (p + 2);
+        if (p[1] == '\r' && p + 2 < buf + len && p[2] == '\n')
+            return (p + 3);
+    }
+    return (NULL);
+}
+
+/* Returns stdout bytes, 0 once the request has ended, -1 on errors.
+   Stderr is passed on to our log. */
+static ssize_t read_fastcgi(char *buf, size_t size)
+{
+    while (!fcgi.ended)
+    {
+        unsigned char *h;
+        size_t n;
+
+        if (fcgi.content == 0 && fcgi.padding == 0)
+        {
+            if (fill_fastcgi(8) < 0)
+                return (-1);
+            h = (unsigned char *)fcgi.buf + fcgi.pos;
+            fcgi.type = h[1];
+            fcgi.content = h[4] << 8 | h[5];
+            fcgi.padding = h[6];
+            fcgi.pos += 8;
+            if (fcgi.type == FCGI_END_REQUEST)
+                fcgi.ended = 1;
+            continue;
+        }
+        if (fcgi.content == 0)
+        {
+            n = fcgi.len - fcgi.pos < fcgi.padding ? fcgi.len - fcgi.pos : fcgi.padding;
+            if (n == 0 && fill_fastcgi(1) < 0)
+                return (-1);
+            fcgi.pos += n;
+            fcgi.padding -= n;
+            continue;
+        }
+        if (fcgi.pos == fcgi.len && fill_fastcgi(1) < 0)
+            return (-1);
+        n = fcgi.len - fcgi.pos < fcgi.content ? fcgi.len - fcgi.pos : fcgi.content;
+        if (fcgi.type == FCGI_STDOUT)
+        {
+            n = n < size ? n : size;
+            memcpy(buf, fcgi.buf + fcgi.pos, n);
+            fcgi.pos += n;
+            fcgi.content -= n;
+            return (n);
+        }
+        if (fcgi.type == FCGI_STDERR)
+            log_message("fastcgi: %.*s", (int)(fcgi.buf[fcgi.pos + n - 1] == '\n' ? n - 1 : n), fcgi.buf + fcgi.pos);
+        fcgi.pos += n;
+        fcgi.content -= n;
+    }
+    return (0);
+}
+
+/* Makes at least need bytes available at fcgi.pos. */
+static int fill_fastcgi(size_t need)
+{
+    if (fcgi.pos > 0)
+    {
+        memmove(fcgi.buf, fcgi.buf + fcgi.pos, fcgi.len - fcgi.pos);
+        fcgi.len -= fcgi.pos;
+        fcgi.pos = 0;
+    }
+    while (fcgi.len < need)
+    {
+        ssize_t n = read(fcgi.fd, fcgi.buf + fcgi.len, sizeof(fcgi.buf) - fcgi.len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = ECONNRESET;
+            return (-1);
+        }
+        fcgi.len += n;
+    }
+    return (0);
+}
+
+/* CGI headers become ours: Status sets the status line, a bare Location
+   redirects. The body has no length, which is fine as the connection
+   closes after it. */
+static void relay_fastcgi_response(struct HTTPRequest *req, FILE *out, char *head, size_t len)
+{
+    char status[64] = "200 OK";
+    char *end, *line, *next;
+    char buf[BUFSIZ];
+    ssize_t n;
+
+    end = cgi_header_end(head, len);
+    for (line = head; line < end; line = next)
+    {
+        next = memchr(line, '\n', end - line) + 1;
+        if (strncasecmp(line, "Status:", 7) == 0)
+            snprintf(status, sizeof(status), "%.*s", (int)strcspn(line + 7 + strspn(line + 7, " \t"), "\r\n"),
+                     line + 7 + strspn(line + 7, " \t"));
+        else if (strncasecmp(line, "Location:", 9) == 0 && strcmp(status, "200 OK") == 0)
+            strcpy(status, "302 Found");
+    }
+    if (atoi(status) >= 500 && serve_stale(req, out))
+        return;
+    output_common_header_fields(req, out, status);
+    start_capture(req, out, status);
+    for (line = head; line < end; line = next)
+    {
+        size_t k = strcspn(line, ":\r\n");
+
+        next = memchr(line, '\n', end - line) + 1;
+        if (line[k] != ':' || (k == 6 && strncasecmp(line, "Status", 6) == 0) || hop_by_hop(line, k))
+            continue;
+        fprintf(out, "%.*s\r\n", (int)strcspn(line, "\r\n"), line);
+    }
+    fputs("\r\n", out);
+    if (strcmp(req->method, "HEAD") == 0)
+    {
+        fflush(out);
+        return;
+    }
+    if (head + len > end && fwrite(end, 1, head + len - end, out) < (size_t)(head + len - end))
+        log_exit("failed to write to socket: %s", strerror(errno));
+    while ((n = read_fastcgi(buf, sizeof(buf))) > 0)
+    {
+        if (fwrite(buf, 1, n, out) < (size_t)n)
+            log_exit("failed to write to socket: %s", strerror(errno));
+    }
+    if (n < 0)
+        log_exit("failed to read from fastcgi: %s", errno == EAGAIN ? "timed out" : strerror(errno));
+    fflush(out);
+}
+
+static void setup_microcache(void)
+{
+    size_t nsets;
+
+    if ((microcache.size == 0 && !disk_cache.dir) || proxy.nroutes == 0)
+        return;
+    if (microcache.size > 0)
+    {
+        nsets = (size_t)microcache.size * 1048576 / (sizeof(struct CacheEntry) * MICROCACHE_WAYS);
+        microcache.nsets = nsets > 0 ? nsets : 1;
+        /* Entries are only backed by memory once a response is stored. */
+        microcache.entry = (struct CacheEntry *)mmap(NULL, sizeof(struct CacheEntry) * MICROCACHE_WAYS * microcache.nsets,
+                                                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (microcache.entry == MAP_FAILED)
+            log_exit("mmap(2) failed: %s", strerror(errno));
+    }
+    setup_disk_cache();
+    microcache.lease = (struct CacheLease *)mmap(NULL, sizeof(struct CacheLease) * MICROCACHE_LEASES,
+                                                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (microcache.lease == MAP_FAILED)
+        log_exit("mmap(2) failed: %s", strerror(errno));
+}
+/* Only GET and HEAD without credentials are looked up, since a shared
+   cache must not hand one user's response to another. */
+static int microcache_key(struct HTTPRequest *req, struct Route *route)
+{
+    char *host = lookup_header_field_value(req, "Host");
+    int n;
+
+    if (!microcache.lease || (strcmp(req->method, "GET") != 0 && strcmp(req->method, "HEAD") != 0) ||
+        lookup_header_field_value(req, "Authorization"))
+        return (0);
+    if (host)
+        host += strspn(host, " \t");
+    n = snprintf(cache_req.key, sizeof(cache_req.key), "%s %.*s %s", route->prefix,
+                 host ? (int)strcspn(host, "\r\n") : 0, host ? host : "", req->path);
+    if (n < 0 || (size_t)n >= sizeof(cache_req.key))
+        return (0);
+    cache_req.key_len = n;
+    cache_req.hash = pack_hash(cache_req.key, n);
+    cache_req.active = 1;
+    return (1);
+}
+
+/* Returns a private copy of the entry for the request's key, or NULL. */
+static struct CacheEntry *microcache_get(void)
+{
+    struct CacheEntry *set = NULL, *copy = NULL;
+
+    if (microcache.entry)
+        set = &microcache.entry[(cache_req.hash % microcache.nsets) * MICROCACHE_WAYS];
+    for (int w = 0; set && w < MICROCACHE_WAYS; w++)
+    {
+        struct CacheEntry *e = &set[w];
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == 0 || (seq & 1) || __atomic_load_n(&e->hash, __ATOMIC_RELAXED) != cache_req.hash)
+            continue;
+        if (!copy)
+            copy = (struct CacheEntry *)xmalloc(sizeof(struct CacheEntry));
+        memcpy(copy, e, sizeof(*copy) - sizeof(copy->data));
+        if (copy->len > MICROCACHE_ENTRY_SIZE || copy->head_len > copy->len)
+            continue;
+        memcpy(copy->data, e->data, copy->len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        if (copy->hash == cache_req.hash && copy->key_len == cache_req.key_len &&
+            memcmp(copy->key, cache_req.key, cache_req.key_len) == 0)
+        {
+            copy->status_line[sizeof(copy->status_line) - 1] = '\0';
+            return (copy);
+        }
+    }
+    free(copy);
+    return (disk_cache.header ? disk_cache_get() : NULL);
+}
+/* Stores the captured response if its status and header fields allow;
+   returns whether it did. */
+static int microcache_put(void)
+{
+    struct CacheEntry *e;
+    long fresh, swr, sie, now;
+    char *end;
+    size_t head_len;
+    int status;
+    int stored = 0;
+
+    if (!cache_req.capturing)
+        return (0);
+    cache_req.capturing = 0;
+    cache_req.buf[cache_req.len] = '\0';
+    if (cache_req.len >= 2 && memcmp(cache_req.buf, "\r\n", 2) == 0)
+        head_len = 2;
+    else if ((end = (char *)memmem(cache_req.buf, cache_req.len, "\r\n\r\n", 4)) != NULL)
+        head_len = end + 4 - cache_req.buf;
+    else
+        return (0);
+    status = atoi(cache_req.status_line);
+    if (status != 200 && status != 203 && status != 301 && status != 404 && status != 410)
+        return (0);
+    if (cache_policy(cache_req.buf, head_len, cache_req.len - head_len, &fresh, &swr, &sie) < 0)
+        return (0);
+    e = (struct CacheEntry *)xmalloc(sizeof(struct CacheEntry));
+    now = monotonic_usec();
+    e->hash = cache_req.hash;
+    e->status = status;
+    e->stored = now;
+    e->fresh_until = now + fresh * 1000000L;
+    e->stale_until = e->fresh_until + swr * 1000000L;
+    e->error_until = e->fresh_until + sie * 1000000L;
+    e->key_len = cache_req.key_len;
+    e->head_len = head_len;
+    e->len = cache_req.len;
+    e->slab = -1;
+    e->offset = 0;
+    memcpy(e->key, cache_req.key, cache_req.key_len);
+    snprintf(e->status_line, sizeof(e->status_line), "%s", cache_req.status_line);
+    if (microcache.entry && cache_req.len <= MICROCACHE_ENTRY_SIZE)
+    {
+        memcpy(e->data, cache_req.buf, cache_req.len);
+        stored = microcache_store(e);
+    }
+    if (disk_cache.header)
+        stored |= disk_cache_put(e, cache_req.buf);
+    free(e);
+    return (stored);
+}
+
+/* Copies an entry into the memory tier, replacing the same key, an empty
+   way or the oldest entry of its set. */
+static int microcache_store(struct CacheEntry *src)
+{
+    struct CacheEntry *set, *e = NULL;
+    uint32_t seq;
+
+    set = &microcache.entry[(src->hash % microcache.nsets) * MICROCACHE_WAYS];
+    for (int w = 0; w < MICROCACHE_WAYS && !e; w++)
+    {
+        if (__atomic_load_n(&set[w].hash, __ATOMIC_RELAXED) == src->hash)
+            e = &set[w];
+    }
+    for (int w = 0; w < MICROCACHE_WAYS && !e; w++)
+    {
+        if (__atomic_load_n(&set[w].seq, __ATOMIC_RELAXED) == 0)
+            e = &set[w];
+    }
+    if (!e)
+    {
+        e = &set[0];
+        for (int w = 1; w < MICROCACHE_WAYS; w++)
+        {
+            if (__atomic_load_n(&set[w].stored, __ATOMIC_RELAXED) < __atomic_load_n(&e->stored, __ATOMIC_RELAXED))
+                e = &set[w];
+        }
+    }
+    seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return (0);
+    e->hash = src->hash;
+    e->status = src->status;
+    e->stored = src->stored;
+    e->fresh_until = src->fresh_until;
+    e->stale_until = src->stale_until;
+    e->error_until = src->error_until;
+    e->key_len = src->key_len;
+    e->head_len = src->head_len;
+    e->len = src->len;
+    e->slab = -1;
+    e->offset = 0;
+    memcpy(e->key, src->key, src->key_len);
+    memcpy(e->status_line, src->status_line, sizeof(e->status_line));
+    memcpy(e->data, src->data, src->len);
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+    return (1);
+}
+
+/* Opens or creates the index and slab files before chroot(2). An index
+   left by an earlier run with the same geometry is used as it is. */
+static void setup_disk_cache(void)
+{
+    struct DiskCacheHeader *h;
+    char path[PATH_MAX];
+    uint32_t nslabs, nslots;
+    size_t size;
+    struct stat st;
+
+    if (!disk_cache.dir)
+        return;
+    nslabs = disk_cache.size / (DISK_CACHE_SLAB_SIZE / 1048576);
+    if (nslabs < 2)
+        nslabs = 2;
+    if (nslabs > DISK_CACHE_MAX_SLABS)
+        log_exit("--disk-cache-size is at most %d MiB", DISK_CACHE_MAX_SLABS * (DISK_CACHE_SLAB_SIZE / 1048576));
+    /* One slot per 16 KiB of slab space. */
+    for (nslots = 1; nslots < nslabs * (DISK_CACHE_SLAB_SIZE / 16384); nslots *= 2)
+        ;
+    size = sizeof(struct DiskCacheHeader) + sizeof(struct DiskSlot) * nslots;
+    if (mkdir(disk_cache.dir, 0700) < 0 && errno != EEXIST)
+        log_exit("%s: %s", disk_cache.dir, strerror(errno));
+    snprintf(path, sizeof(path), "%s/index", disk_cache.dir);
+    disk_cache.index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (disk_cache.index_fd < 0 || fstat(disk_cache.index_fd, &st) < 0)
+        log_exit("%s: %s", path, strerror(errno));
+    if ((size_t)st.st_size != size && (ftruncate(disk_cache.index_fd, 0) < 0 || ftruncate(disk_cache.index_fd, size) < 0))
+        log_exit("%s: %s", path, strerror(errno));
+    h = (struct DiskCacheHeader *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_cache.index_fd, 0);
+    if (h == MAP_FAILED)
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    if (h->magic != DISK_CACHE_MAGIC || h->version != DISK_CACHE_VERSION || h->nslabs != nslabs ||
+        h->nslots != nslots || h->slab_size != DISK_CACHE_SLAB_SIZE)
+    {
+        memset(h, 0, size);
+        h->version = DISK_CACHE_VERSION;
+        h->nslabs = nslabs;
+        h->nslots = nslots;
+        h->slab_size = DISK_CACHE_SLAB_SIZE;
+        __atomic_store_n(&h->magic, DISK_CACHE_MAGIC, __ATOMIC_RELEASE);
+    }
+    else
+        log_message("reusing disk cache index %s", path);
+    for (uint32_t i = 0; i < nslabs; i++)
+    {
+        snprintf(path, sizeof(path), "%s/slab.%u", disk_cache.dir, i);
+        disk_cache.fd[i] = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (disk_cache.fd[i] < 0 || ftruncate(disk_cache.fd[i], DISK_CACHE_SLAB_SIZE) < 0)
+            log_exit("%s: %s", path, strerror(errno));
+    }
+    disk_cache.header = h;
+    disk_cache.slot = (struct DiskSlot *)(h + 1);
+}
+
+static struct CacheEntry *disk_cache_get(void)
+{
+    struct DiskCacheHeader *h = disk_cache.header;
+    char key[MICROCACHE_KEY_MAX];
+    struct DiskObject obj;
+    struct DiskSlot slot;
+    struct CacheEntry *e;
+    long mono = monotonic_usec();
+    time_t now = time(NULL);
+
+    for (uint32_t i = 0; i < DISK_CACHE_PROBES; i++)
+    {
+        struct DiskSlot *s = &disk_cache.slot[(cache_req.hash + i) & (h->nslots - 1)];
+        uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        int fd;
+
+        if ((seq & 1) || __atomic_load_n(&s->hash, __ATOMIC_RELAXED) != cache_req.hash)
+            continue;
+        memcpy(&slot, s, sizeof(slot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq || !disk_slot_live(&slot, now))
+            continue;
+        fd = disk_cache.fd[slot.slab];
+        /* Pinned before the last generation check; see disk_cache_advance(). */
+        if (disk_slab_lock(slot.slab, F_RDLCK, F_SETLK) < 0)
+            continue;
+        if (pread(fd, &obj, sizeof(obj), slot.offset) != (ssize_t)sizeof(obj) || obj.magic != DISK_OBJECT_MAGIC ||
+            obj.key_len != cache_req.key_len || obj.head_len > obj.len ||
+            pread(fd, key, obj.key_len, slot.offset + sizeof(obj)) != (ssize_t)obj.key_len ||
+            memcmp(key, cache_req.key, obj.key_len) != 0 || !disk_slot_live(&slot, now))
+        {
+            disk_slab_lock(slot.slab, F_UNLCK, F_SETLK);
+            continue;
+        }
+        if (!__atomic_load_n(&h->slab[slot.slab].referenced, __ATOMIC_RELAXED))
+            __atomic_store_n(&h->slab[slot.slab].referenced, 1, __ATOMIC_RELAXED);
+        if (metrics)
+            metric_add(&core_metrics()->disk_cache_hits, 1);
+        e = (struct CacheEntry *)xmalloc(sizeof(struct CacheEntry));
+        e->hash = cache_req.hash;
+        e->status = obj.status;
+        e->stored = mono + (slot.stored - now) * 1000000L;
+        e->fresh_until = mono + (slot.fresh_until - now) * 1000000L;
+        e->stale_until = mono + (slot.stale_until - now) * 1000000L;
+        e->error_until = mono + (slot.error_until - now) * 1000000L;
+        e->key_len = obj.key_len;
+        e->head_len = obj.head_len;
+        e->len = obj.len;
+        e->slab = slot.slab;
+        e->offset = slot.offset + sizeof(obj) + obj.key_len;
+        memcpy(e->key, key, obj.key_len);
+        memcpy(e->status_line, obj.status_line, sizeof(e->status_line));
+        e->status_line[sizeof(e->status_line) - 1] = '\0';
+        /* Small responses move up to the memory tier. */
+        if (microcache.entry && obj.len <= MICROCACHE_ENTRY_SIZE &&
+            pread(fd, e->data, obj.len, e->offset) == (ssize_t)obj.len && disk_slot_live(&slot, now))
+        {
+            disk_slab_lock(slot.slab, F_UNLCK, F_SETLK);
+            e->slab = -1;
+            microcache_store(e);
+        }
+        return (e);
+    }
+    return (NULL);
+}
+
+static int disk_cache_put(struct CacheEntry *src, char *data)
+{
+    struct DiskCacheHeader *h = disk_cache.header;
+    struct DiskSlot *s = NULL;
+    struct DiskObject obj;
+    struct iovec iov[3];
+    struct flock lock;
+    size_t size = (sizeof(obj) + src->key_len + src->len + 63) & ~(size_t)63;
+    long mono = monotonic_usec();
+    time_t now = time(NULL);
+    uint64_t offset;
+    uint32_t seq;
+    int slab;
+
+    if (size > h->slab_size)
+        return (0);
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_len = 1;
+    while (fcntl(disk_cache.index_fd, F_SETLKW, &lock) < 0)
+    {
+        if (errno != EINTR)
+            return (0);
+    }
+    slab = h->hand;
+    if (h->slab[slab].used + size > h->slab_size && (slab = disk_cache_advance()) < 0)
+    {
+        lock.l_type = F_UNLCK;
+        fcntl(disk_cache.index_fd, F_SETLK, &lock);
+        return (0);
+    }
+    offset = h->slab[slab].used;
+    memset(&obj, 0, sizeof(obj));
+    obj.magic = DISK_OBJECT_MAGIC;
+    obj.status = src->status;
+    obj.key_len = src->key_len;
+    obj.head_len = src->head_len;
+    obj.len = src->len;
+    memcpy(obj.status_line, src->status_line, sizeof(obj.status_line));
+    iov[0].iov_base = &obj;
+    iov[0].iov_len = sizeof(obj);
+    iov[1].iov_base = src->key;
+    iov[1].iov_len = src->key_len;
+    iov[2].iov_base = data;
+    iov[2].iov_len = src->len;
+    if (pwritev(disk_cache.fd[slab], iov, 3, offset) != (ssize_t)(sizeof(obj) + src->key_len + src->len))
+    {
+        log_message("failed to write to disk cache: %s", strerror(errno));
+        lock.l_type = F_UNLCK;
+        fcntl(disk_cache.index_fd, F_SETLK, &lock);
+        return (0);
+    }
+    h->slab[slab].used = offset + size;
+    /* The same key, else a free or dead slot, else the oldest. */
+    for (uint32_t i = 0; i < DISK_CACHE_PROBES && !s; i++)
+    {
+        if (disk_cache.slot[(src->hash + i) & (h->nslots - 1)].hash == src->hash)
+            s = &disk_cache.slot[(src->hash + i) & (h->nslots - 1)];
+    }
+    for (uint32_t i = 0; i < DISK_CACHE_PROBES && !s; i++)
+    {
+        if (!disk_slot_live(&disk_cache.slot[(src->hash + i) & (h->nslots - 1)], now))
+            s = &disk_cache.slot[(src->hash + i) & (h->nslots - 1)];
+    }
+    if (!s)
+    {
+        s = &disk_cache.slot[src->hash & (h->nslots - 1)];
+        for (uint32_t i = 1; i < DISK_CACHE_PROBES; i++)
+        {
+            struct DiskSlot *t = &disk_cache.slot[(src->hash + i) & (h->nslots - 1)];
+
+            if (t->stored < s->stored)
+                s = t;
+        }
+    }
+    /* Writers hold the lock; an odd count is left by one that died. */
+    seq = s->seq & ~1U;
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->hash = src->hash;
+    s->slab = slab;
+    s->generation = h->slab[slab].generation;
+    s->offset = offset;
+    s->stored = now + (src->stored - mono) / 1000000;
+    s->fresh_until = now + (src->fresh_until - mono) / 1000000;
+    s->stale_until = now + (src->stale_until - mono) / 1000000;
+    s->error_until = now + (src->error_until - mono) / 1000000;
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+    lock.l_type = F_UNLCK;
+    fcntl(disk_cache.index_fd, F_SETLK, &lock);
+    return (1);
+}
+
+/* Moves the hand past slabs read from since it last passed, clearing
+   their bits, and empties the first one that was not and that nobody
+   is sending from. The generation goes up before the pin is looked
+   for: a reader pinning later sees the new one and misses, while one
+   that pinned earlier keeps the slab as it is until a later pass.
+   Returns -1 when every slab is pinned. */
+static int disk_cache_advance(void)
+{
+    struct DiskCacheHeader *h = disk_cache.header;
+    uint32_t slab = h->hand;
+
+    for (uint32_t i = 0; i < 2 * h->nslabs; i++)
+    {
+        slab = (slab + 1) % h->nslabs;
+        if (__atomic_exchange_n(&h->slab[slab].referenced, 0, __ATOMIC_RELAXED))
+            continue;
+        __atomic_add_fetch(&h->slab[slab].generation, 1, __ATOMIC_SEQ_CST);
+        if (disk_slab_lock(slab, F_WRLCK, F_GETLK) != 0)
+            continue;
+        h->slab[slab].used = 0;
+        h->hand = slab;
+        return (slab);
+    }
+    return (-1);
+}
+
+/* With F_GETLK returns 1 if another process holds a conflicting lock. */
+static int disk_slab_lock(uint32_t slab, short type, int cmd)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 1 + slab;
+    lock.l_len = 1;
+    while (fcntl(disk_cache.index_fd, cmd, &lock) < 0)
+    {
+        if (errno != EINTR)
+            return (-1);
+    }
+    return (cmd == F_GETLK ? lock.l_type != F_UNLCK : 0);
+}
+
+/* Whether a slot points into the current contents of its slab and may
+   still be served, at least on errors. */
+static int disk_slot_live(struct DiskSlot *slot, time_t now)
+{
+    struct DiskCacheHeader *h = disk_cache.header;
+
+    if (slot->hash == 0 || slot->slab >= h->nslabs ||
+        __atomic_load_n(&h->slab[slot->slab].generation, __ATOMIC_ACQUIRE) != slot->generation)
+        return (0);
+    return (slot->stale_until > now || slot->error_until > now);
+}
+
+/* The slab was pinned by disk_cache_get() and stays so until exit. */
+static void send_cached_object(struct CacheEntry *e, size_t len)
+{
+    send_file_range(disk_cache.fd[e->slab], e->offset, len);
+}
+
+/* How long a response may be served from a shared cache (RFC 9111):
+   s-maxage, else max-age, else Expires, plus the stale-while-revalidate
+   and stale-if-error windows. Returns -1 if it may not be stored. */
+static int cache_policy(char *head, size_t len, size_t body_len, long *fresh, long *swr, long *sie)
+{
+    long max_age = -1, s_maxage = -1;
+    time_t expires = (time_t)-1;
+    char *line, *next, *end = head + len;
+
+    *swr = 0;
+    *sie = 0;
+    for (line = head; line < end; line = next)
+    {
+        size_t n = strcspn(line, ":\r\n");
+        size_t vlen;
+        char *v;
+
+        next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        if (line[n] != ':')
+            continue;
+        v = line + n + 1 + strspn(line + n + 1, " \t");
+        vlen = strcspn(v, "\r\n");
+        if ((n == 10 && strncasecmp(line, "Set-Cookie", n) == 0) || (n == 4 && strncasecmp(line, "Vary", n) == 0))
+            return (-1);
+        if (n == 14 && strncasecmp(line, "Content-Length", n) == 0 && strtoul(v, NULL, 10) != body_len)
+            return (-1);
+        if (n == 7 && strncasecmp(line, "Expires", n) == 0)
+        {
+            char date[64];
+            struct tm tm;
+
+            memset(&tm, 0, sizeof(tm));
+            snprintf(date, sizeof(date), "%.*s", (int)vlen, v);
+            /* An invalid date means already expired. */
+            expires = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) ? timegm(&tm) : 0;
+        }
+        if (n == 13 && strncasecmp(line, "Cache-Control", n) == 0)
+        {
+            for (char *d = v; d < v + vlen; d += strspn(d, ", \t"))
+            {
+                size_t dlen = strcspn(d, ",\r\n");
+                long val;
+
+                if (cache_directive(d, dlen, "no-store") >= 0 || cache_directive(d, dlen, "no-cache") >= 0 ||
+                    cache_directive(d, dlen, "private") >= 0)
+                    return (-1);
+                if ((val = cache_directive(d, dlen, "s-maxage")) >= 0)
+                    s_maxage = val;
+                else if ((val = cache_directive(d, dlen, "max-age")) >= 0)
+                    max_age = val;
+                else if ((val = cache_directive(d, dlen, "stale-while-revalidate")) >= 0)
+                    *swr = val;
+                else if ((val = cache_directive(d, dlen, "stale-if-error")) >= 0)
+                    *sie = val;
+                d += dlen;
+            }
+        }
+    }
+    if (s_maxage >= 0)
+        *fresh = s_maxage;
+    else if (max_age >= 0)
+        *fresh = max_age;
+    else if (expires != (time_t)-1)
+        *fresh = expires > time(NULL) ? expires - time(NULL) : 0;
+    else
+        return (-1);
+    return (*fresh > 0 || *swr > 0 || *sie > 0 ? 0 : -1);
+}
+
+/* Returns -1 unless d is the directive name, else its value (0 if it has
+   none). */
+static long cache_directive(char *d, size_t len, char *name)
+{
+    size_t n = strlen(name);
+    long val;
+
+    while (len > 0 && (d[len - 1] == ' ' || d[len - 1] == '\t'))
+        len--;
+    if (len < n || strncasecmp(d, name, n) != 0 || (len > n && d[n] != '='))
+        return (-1);
+    if (len == n)
+        return (0);
+    val = strtol(d + n + 1 + (d[n + 1] == '"'), NULL, 10);
+    return (val > 0 ? val : 0);
+}
+
+/* Waits while another process fetches the same key. Returns the entry
+   it stored, or NULL once this process holds the lease or should go
+   upstream without it. */
+static struct CacheEntry *await_fill(void)
+{
+    struct CacheLease *lease = &microcache.lease[cache_req.hash % MICROCACHE_LEASES];
+    struct CacheEntry *e;
+
+    while (!acquire_lease())
+    {
+        if (__atomic_load_n(&lease->hash, __ATOMIC_RELAXED) != cache_req.hash ||
+            __atomic_load_n(&lease->pass_until, __ATOMIC_RELAXED) > monotonic_usec())
+            return (NULL);
+        usleep(MICROCACHE_POLL_USEC);
+        e = microcache_get();
+        if (e && monotonic_usec() < e->fresh_until)
+            return (e);
+        free(e);
+    }
+    /* The previous holder may have stored it just before letting go. */
+    e = microcache_get();
+    if (e && monotonic_usec() < e->fresh_until)
+    {
+        release_lease(1);
+        return (e);
+    }
+    free(e);
+    return (NULL);
+}
+
+/* A lease lasts as long as a fetch may take, so that one held by a
+   process that died is taken over. */
+static int acquire_lease(void)
+{
+    struct CacheLease *lease = &microcache.lease[cache_req.hash % MICROCACHE_LEASES];
+    int64_t now = monotonic_usec();
+    int64_t until = __atomic_load_n(&lease->until, __ATOMIC_RELAXED);
+    int64_t mine = now + (proxy.connect_timeout + proxy.timeout) * (proxy.retries + 1) * 1000000L;
+
+    if (until > now || !__atomic_compare_exchange_n(&lease->until, &until, mine, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return (0);
+    if (__atomic_exchange_n(&lease->hash, cache_req.hash, __ATOMIC_RELAXED) != cache_req.hash)
+        __atomic_store_n(&lease->pass_until, 0, __ATOMIC_RELAXED);
+    cache_req.lease = lease;
+    cache_req.lease_until = mine;
+    return (1);
+}
+
+static void release_lease(int stored)
+{
+    int64_t until = cache_req.lease_until;
+
+    if (!cache_req.lease)
+        return;
+    __atomic_store_n(&cache_req.lease->pass_until, stored ? 0 : monotonic_usec() + MICROCACHE_PASS_USEC,
+                     __ATOMIC_RELAXED);
+    /* Unless it expired and someone else took it over. */
+    __atomic_compare_exchange_n(&cache_req.lease->until, &until, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    cache_req.lease = NULL;
+}
+
+static void serve_cached(struct HTTPRequest *req, FILE *out, struct CacheEntry *e, char *state)
+{
+    size_t len = strcmp(req->method, "HEAD") == 0 ? e->head_len : e->len;
+
+    output_common_header_fields(req, out, e->status_line);
+    fprintf(out, "Age: %ld\r\nX-Cache: %s\r\n", (monotonic_usec() - e->stored) / 1000000, state);
+    if (e->slab >= 0)
+    {
+        fflush(out);
+        send_cached_object(e, len);
+        return;
+    }
+    if (fwrite(e->data, 1, len, out) < len)
+        log_exit("failed to write to socket: %s", strerror(errno));
+    fflush(out);
+}
+
+/* Answers with the expired entry of a failed fetch while its
+   stale-if-error window lasts. */
+static int serve_stale(struct HTTPRequest *req, FILE *out)
+{
+    if (!cache_req.stale || monotonic_usec() >= cache_req.stale->error_until)
+        return (0);
+    if (metrics)
+        metric_add(&core_metrics()->microcache_stale, 1);
+    serve_cached(req, out, cache_req.stale, "STALE");
+    return (1);
+}
+
+/* Refreshes an entry after answering with it (stale-while-revalidate).
+   The client connection is shut down first so that the client does not
+   wait for the fetch, whose response is only stored. An HTTP/2 stream
+   writes to a pipe, which is closed instead. */
+static void revalidate(struct HTTPRequest *req, FILE *out, struct Route *route)
+{
+    finish_request();
+    close_tls();
+    if (shutdown(conn.fd, SHUT_RDWR) < 0 && errno == ENOTSOCK)
+        close(conn.fd);
+    cache_req.discard = 1;
+    forward_request(req, out, route);
+    release_lease(microcache_put());
+}
+
+/* Called with the status line and common header fields written, so that
+   what is captured is exactly what a hit adds to them. */
+static void start_capture(struct HTTPRequest *req, FILE *out, char *status)
+{
+    if (!cache_req.active || strcmp(req->method, "GET") != 0)
+        return;
+    fflush(out);
+    if (!cache_req.buf)
+    {
+        cache_req.size = disk_cache.header ? DISK_CACHE_OBJECT_MAX : MICROCACHE_ENTRY_SIZE;
+        cache_req.buf = (char *)xmalloc(cache_req.size + 1);
+    }
+    snprintf(cache_req.status_line, sizeof(cache_req.status_line), "%s", status);
+    cache_req.len = 0;
+    cache_req.capturing = 1;
+}
+
+static void capture(const char *buf, size_t size)
+{
+    if (cache_req.len + size > cache_req.size)
+    {
+        cache_req.capturing = 0;
+        return;
+    }
+    memcpy(cache_req.buf + cache_req.len, buf, size);
+    cache_req.len += size;
+}
+
+static int writev_all(int fd, struct iovec *iov, int n)
+{
+    while (n > 0)
+    {
+        ssize_t done;
+
+        done = writev(fd, iov, n);
+        if (done < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (-1);
+        }
+        while (n > 0 && (size_t)done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return (0);
+}
+
+/* --websocket routes take only the opening handshake of a WebSocket
+   (RFC 6455), which is passed on to a backend much like a proxied
+   request. HTTP/2 has no Upgrade. */
+static void websocket_request(struct HTTPRequest *req, FILE *out, struct Route *route)
+{
+    char *upgrade = lookup_header_field_value(req, "Upgrade");
+    char *connection = lookup_header_field_value(req, "Connection");
+    char *version = lookup_header_field_value(req, "Sec-WebSocket-Version");
+    char *key = lookup_header_field_value(req, "Sec-WebSocket-Key");
+
+    if (req->http2 || !upgrade || !strcasestr(upgrade, "websocket") || !connection ||
+        !strcasestr(connection, "upgrade"))
+    {
+        output_common_header_fields(req, out, "426 Upgrade Required");
+        fprintf(out, "Upgrade: websocket\r\nContent-Length: 0\r\n\r\n");
+        return;
+    }
+    if (!version || atoi(version) != 13)
+    {
+        output_common_header_fields(req, out, "426 Upgrade Required");
+        fprintf(out, "Sec-WebSocket-Version: 13\r\nContent-Length: 0\r\n\r\n");
+        return;
+    }
+    if (strcmp(req->method, "GET") != 0 || req->protocol_minor_version < 1 || !key ||
+        strcspn(key, " \t\r\n") != 24)
+    {
+        bad_request(req, out);
+        return;
+    }
+    forward_request(req, out, route);
+}
+
+static int websocket_switched(char *head, size_t len)
+{
+    return (len > 12 && strncmp(head, "HTTP/1.1 101", 12) == 0);
+}
+
+/* Past the 101, frames from the client are unmasked in place and go to
+   the backend with a masking key of zero, which any WebSocket server
+   accepts and a custom one can ignore; frames from the backend go to
+   the client as they are, with splice(2) when the socket takes it. A
+   client may not send before the 101, so nothing of it is left in the
+   stdio buffer. Ends when the backend closes. */
+static void websocket_relay(struct HTTPRequest *req, FILE *out, int fd, char *head, size_t len)
+{
+    char *end = (char *)memmem(head, len, "\r\n\r\n", 4) + 4;
+    char *key = lookup_header_field_value(req, "Sec-WebSocket-Key");
+    unsigned char buf[WEBSOCKET_READ_CHUNK];
+    char accept[32];
+    int reading = 1;
+    int p[2] = {-1, -1};
+
+    websocket_accept(key, strcspn(key, " \t\r\n"), accept);
+    output_common_header_fields(req, out, "101 Switching Protocols");
+    fprintf(out, "Upgrade: websocket\r\nSec-WebSocket-Accept: %s\r\n", accept);
+    copy_upstream_fields(out, memchr(head, '\n', end - head) + 1, end, "Sec-WebSocket-Accept");
+    fputs("\r\n", out);
+    if (end < head + len && fwrite(end, 1, head + len - end, out) < (size_t)(head + len - end))
+        log_exit("failed to write to socket: %s", strerror(errno));
+    fflush(out);
+    if (direct_output() && pipe2(p, O_CLOEXEC) < 0)
+        log_exit("pipe(2) failed: %s", strerror(errno));
+    memset(&ws, 0, sizeof(ws));
+    while (1)
+    {
+        struct pollfd pfd[2];
+        int pending = reading && sock_pending();
+        int n;
+
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = conn.fd;
+        pfd[1].events = reading ? POLLIN : 0;
+        n = poll(pfd, 2, pending ? 0 : -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            log_exit("poll(2) failed: %s", strerror(errno));
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR) && websocket_forward(fd, p) == 0)
+            break;
+        if (pending || pfd[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t got = sock_read(conn.fd, buf, sizeof(buf));
+            struct iovec iov;
+
+            if (got < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            /* The backend sees the client go and closes in turn. */
+            if (got <= 0)
+            {
+                shutdown(fd, SHUT_WR);
+                reading = 0;
+                continue;
+            }
+            if (websocket_unmask(buf, got) < 0)
+            {
+                unsigned char close_frame[4] = {0x88, 2, WEBSOCKET_PROTOCOL_ERROR >> 8,
+                                                WEBSOCKET_PROTOCOL_ERROR & 0xff};
+
+                log_message("unmasked or oversized frame from WebSocket client");
+                fwrite(close_frame, 1, sizeof(close_frame), out);
+                fflush(out);
+                break;
+            }
+            iov.iov_base = buf;
+            iov.iov_len = got;
+            if (writev_all(fd, &iov, 1) < 0)
+                log_exit("failed to write to upstream: %s", strerror(errno));
+        }
+    }
+    if (p[0] >= 0)
+    {
+        close(p[0]);
+        close(p[1]);
+    }
+}
+
+/* Moves what the backend has to the client; returns 0 once it closed. */
+static int websocket_forward(int fd, int *p)
+{
+    ssize_t n, m;
+
+    if (p[0] < 0)
+    {
+        char buf[WEBSOCKET_READ_CHUNK];
+
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            return (1);
+        if (n < 0)
+            log_exit("failed to read from upstream: %s", strerror(errno));
+        if (n > 0 && (fwrite(buf, 1, n, conn.out) < (size_t)n || fflush(conn.out) != 0))
+            log_exit("failed to write to socket: %s", strerror(errno));
+        return (n > 0);
+    }
+    n = splice(fd, NULL, p[1], NULL, PROXY_SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return (1);
+    if (n < 0)
+        log_exit("failed to read from upstream: %s", strerror(errno));
+    if (n == 0)
+        return (0);
+    while (n > 0)
+    {
+        m = splice(p[0], NULL, conn.fd, NULL, n, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m < 0)
+            log_exit("failed to write to socket: %s", strerror(errno));
+        if (conn.stamp[STAMP_FIRST_WRITE] == 0)
+            trace_stamp(STAMP_FIRST_WRITE);
+        conn.bytes_sent += m;
+        n -= m;
+    }
+    return (1);
+}
+
+/* Unmasks the frames in p in place and zeroes their masking keys, so
+   that the header keeps its size. Returns -1 for a frame the client sent
+   without a mask or with a 64-bit length that has the top bit set. */
+static int websocket_unmask(unsigned char *p, size_t len)
+{
+    while (len > 0)
+    {
+        size_t size;
+
+        if (ws.left > 0)
+        {
+            size_t n = len < ws.left ? len : (size_t)ws.left;
+
+            websocket_xor(p, n, ws.key, ws.phase);
+            ws.phase = (ws.phase + n) & 3;
+            ws.left -= n;
+            p += n;
+            len -= n;
+            continue;
+        }
+        ws.head[ws.head_len++] = *p;
+        if (ws.head_len == 2 && !(p[0] & 0x80))
+            return (-1);
+        size = ws.head_len >= 2 ? websocket_head_size(ws.head) : sizeof(ws.head);
+        if (ws.head_len > size - 4)
+        {
+            ws.key[ws.head_len - (size - 4) - 1] = *p;
+            *p = 0;
+        }
+        p++;
+        len--;
+        if (ws.head_len < size)
+            continue;
+        if ((ws.head[1] & 0x7f) == 126)
+            ws.left = (uint64_t)ws.head[2] << 8 | ws.head[3];
+        else if ((ws.head[1] & 0x7f) == 127)
+        {
+            if (ws.head[2] & 0x80)
+                return (-1);
+            for (int i = 2; i < 10; i++)
+                ws.left = ws.left << 8 | ws.head[i];
+        }
+        else
+            ws.left = ws.head[1] & 0x7f;
+        ws.head_len = 0;
+        ws.phase = 0;
+    }
+    return (0);
+}
+
+/* Header size of a client frame from its first two bytes. */
+static size_t websocket_head_size(unsigned char *head)
+{
+    int len = head[1] & 0x7f;
+
+    return (2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + 4);
+}
+
+/* The key repeats every 4 bytes, so 16 of them rotated by phase cover a
+   vector; SSE2 XORs one per instruction. */
+static void websocket_xor(unsigned char *p, size_t len, unsigned char *key, unsigned int phase)
+{
+    unsigned char k[16];
+    size_t i = 0;
+
+    for (int j = 0; j < 16; j++)
+        k[j] = key[(phase + j) & 3];
+#ifdef __SSE2__
+    {
+        __m128i m = _mm_loadu_si128((const __m128i *)k);
+
+        for (; i + 16 <= len; i += 16)
+            _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + i)), m));
+    }
+#endif
+    for (; i < len; i++)
+        p[i] ^= k[i & 15];
+}
+
+/* Sec-WebSocket-Accept: base64 of the SHA-1 of the key and the GUID. */
+static void websocket_accept(char *key, size_t len, char *out)
+{
+    unsigned char buf[64 + sizeof(WEBSOCKET_GUID)];
+    unsigned char digest[20];
+
+    if (len > 64)
+        len = 64;
+    memcpy(buf, key, len);
+    memcpy(buf + len, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+    sha1(buf, len + sizeof(WEBSOCKET_GUID) - 1, digest);
+    base64_encode(digest, sizeof(digest), out);
+}
+
+/* FIPS 180-4; only ever fed a few dozen bytes. */
+static void sha1(unsigned char *data, size_t len, unsigned char *digest)
+{
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    size_t total = (len + 8) / 64 * 64 + 64;
+
+    for (size_t off = 0; off < total; off += 64)
+    {
+        uint32_t w[80];
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+        for (int i = 0; i < 64; i++)
+        {
+            size_t pos = off + i;
+            unsigned char byte;
+
+            if (pos < len)
+                byte = data[pos];
+            else if (pos == len)
+                byte = 0x80;
+            else if (pos >= total - 8)
+                byte = (uint64_t)len * 8 >> (8 * (total - 1 - pos));
+            else
+                byte = 0;
+            if (i % 4 == 0)
+                w[i / 4] = 0;
+            w[i / 4] |= (uint32_t)byte << (8 * (3 - i % 4));
+        }
+        for (int i = 16; i < 80; i++)
+        {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+
+            w[i] = x << 1 | x >> 31;
+        }
+        for (int i = 0; i < 80; i++)
+        {
+            uint32_t f, k, t;
+
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5a827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ed9eba1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+            else
+                f = b ^ c ^ d, k = 0xca62c1d6;
+            t = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = b << 30 | b >> 2;
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> (8 * (3 - i % 4));
+}
+
+static void base64_encode(unsigned char *src, size_t len, char *out)
+{
+    static char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for (size_t i = 0; i < len; i += 3)
+    {
+        uint32_t v = (uint32_t)src[i] << 16 | (i + 1 < len ? src[i + 1] << 8 : 0) | (i + 2 < len ? src[i + 2] : 0);
+
+        *out++ = alphabet[v >> 18];
+        *out++ = alphabet[(v >> 12) & 63];
+        *out++ = i + 1 < len ? alphabet[(v >> 6) & 63] : '=';
+        *out++ = i + 2 < len ? alphabet[v & 63] : '=';
+    }
+    *out = '\0';
+}
+
+/* HTTP/2 with prior knowledge. The connection process only speaks the
+   framing layer: every stream is forked off with a pipe as its output and
+   answered by respond_to() like any HTTP/1 request, then the HTTP/1
+   response coming out of the pipe is converted into HEADERS and DATA
+   frames. Streams thus run in parallel and one slow response does not hold
+   up the others. Never returns. */
+static void serve_h2(FILE *in)
+{
+    struct pollfd pfd[H2_MAX_STREAMS + 1];
+    struct H2Stream *polled[H2_MAX_STREAMS + 1];
+    char extra;
+    int closed = 0;
+    int one = 1;
+    int nfds, n;
+
+    /* The connection itself is not a request; its streams are. */
+    conn.finished = 1;
+    h2 = (struct H2Connection *)xmalloc(sizeof(struct H2Connection));
+    memset(h2, 0, sizeof(struct H2Connection));
+    h2->fd = conn.fd;
+    h2->window = H2_DEFAULT_WINDOW;
+    h2->initial_window = H2_DEFAULT_WINDOW;
+    h2->max_frame = H2_FRAME_SIZE;
+    h2->decoder.max_size = H2_HEADER_TABLE_SIZE;
+    h2->encoder.max_size = H2_HEADER_TABLE_SIZE;
+    if (fcntl(h2->fd, F_SETFL, O_NONBLOCK) < 0)
+        log_exit("fcntl(2) failed: %s", strerror(errno));
+    /* Small control frames must not wait for the ACK of earlier data. */
+    setsockopt(h2->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    /* Frames sent right behind the preface may already sit in the stdio
+       buffer; take exactly those and read the socket from then on. */
+    h2->in_len = read_buffered(in, h2->in, sizeof(h2->in));
+    if (read_buffered(in, &extra, 1) > 0)
+        log_exit("http/2 preface followed by too much data");
+    h2_send_settings();
+    while (1)
+    {
+        int timeout;
+        int pending;
+
+        if (!closed)
+            h2_process_input();
+        h2_schedule();
+        if ((closed || h2->goaway) && h2->nstreams == 0 && h2->out.len == 0)
+            exit(0);
+        pfd[0].fd = h2->fd;
+        pfd[0].events = (closed ? 0 : POLLIN) | (h2->out.len > 0 ? POLLOUT : 0);
+        nfds = 1;
+        for (int i = 0; i < H2_MAX_STREAMS && h2->out.len < H2_OUTPUT_HIGH; i++)
+        {
+            struct H2Stream *st = &h2->stream[i];
+
+            if (st->id == 0 || st->fd < 0 || (st->head_sent && st->len > 0))
+                continue;
+            pfd[nfds].fd = st->fd;
+            pfd[nfds].events = POLLIN;
+            polled[nfds++] = st;
+        }
+        if (h2->out.len > 0)
+            timeout = timeouts.write ? timeouts.write * 1000 : -1;
+        else if (h2->nstreams == 0)
+            timeout = timeouts.idle ? timeouts.idle * 1000 : -1;
+        else
+            timeout = -1;
+        /* Records are decrypted whole, so part of one may be waiting. */
+        pending = !closed && sock_pending();
+        n = poll(pfd, nfds, pending ? 0 : timeout);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            log_exit("poll(2) failed: %s", strerror(errno));
+        if (n == 0 && !pending && h2->out.len > 0)
+            log_exit("write timed out");
+        if (n == 0 && !pending)
+        {
+            h2_goaway(H2_NO_ERROR);
+            h2_flush();
+            exit(0);
+        }
+        if (pending || pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+            closed = h2_read_input() == 0;
+        if (pfd[0].revents & POLLOUT)
+            h2_flush();
+        for (int i = 1; i < nfds; i++)
+        {
+            if (pfd[i].revents && polled[i]->id != 0)
+                h2_read_stream(polled[i]);
+        }
+    }
+}
+
+/* Returns 0 once the client has closed its side. */
+static int h2_read_input(void)
+{
+    ssize_t n;
+
+    n = sock_read(h2->fd, h2->in + h2->in_len, sizeof(h2->in) - h2->in_len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return (1);
+    if (n <= 0)
+        return (0);
+    h2->in_len += n;
+    return (1);
+}
+
+/* The buffer holds a whole frame of the largest size we accept, so every
+   pass makes progress. */
+static void h2_process_input(void)
+{
+    unsigned char *p = (unsigned char *)h2->in;
+    size_t off = 0;
+
+    while (h2->in_len - off >= 9)
+    {
+        uint32_t len = (uint32_t)p[off] << 16 | p[off + 1] << 8 | p[off + 2];
+        uint32_t id = ((uint32_t)p[off + 5] << 24 | p[off + 6] << 16 | p[off + 7] << 8 | p[off + 8]) & 0x7fffffff;
+
+        if (len > H2_FRAME_SIZE)
+            h2_fail(H2_FRAME_SIZE_ERROR);
+        if (h2->in_len - off < 9 + len)
+            break;
+        h2_frame(p[off + 3], p[off + 4], id, p + off + 9, len);
+        off += 9 + len;
+    }
+    memmove(h2->in, h2->in + off, h2->in_len - off);
+    h2->in_len -= off;
+}
+
+static void h2_frame(int type, int flags, uint32_t id, unsigned char *p, uint32_t len)
+{
+    struct H2Stream *st = h2_find(id);
+    uint32_t value;
+
+    if (h2->block && (type != H2_CONTINUATION || id != h2->block_stream))
+        h2_fail(H2_PROTOCOL_ERROR);
+    switch (type)
+    {
+    case H2_DATA:
+        if (id == 0)
+            h2_fail(H2_PROTOCOL_ERROR);
+        /* Flow control covers padding too; credit it back right away. */
+        if (len > 0)
+            h2_window_update(0, len);
+        if (h2_unpad(flags, &p, &len) < 0)
+            h2_fail(H2_PROTOCOL_ERROR);
+        if (!st || st->pid)
+        {
+            if (id > h2->last_stream)
+                h2_fail(H2_PROTOCOL_ERROR);
+            h2_reset(id, H2_STREAM_CLOSED);
+            break;
+        }
+        if (st->body_len + len > MAX_REQUEST_BODY_LENGTH)
+        {
+            h2_reset(id, H2_REFUSED_STREAM);
+            h2_close(st);
+            break;
+        }
+        h2_store_body(st, p, len);
+        if (flags & H2_FLAG_END_STREAM)
+            h2_start(st);
+        else if (len > 0)
+            h2_window_update(id, len);
+        break;
+    case H2_HEADERS:
+        if (id == 0 || id % 2 == 0)
+            h2_fail(H2_PROTOCOL_ERROR);
+        if (h2_unpad(flags, &p, &len) < 0)
+            h2_fail(H2_PROTOCOL_ERROR);
+        h2->block_stream = id;
+        h2->block_end_stream = flags & H2_FLAG_END_STREAM;
+        h2->block_parent = 0;
+        h2->block_weight = H2_DEFAULT_WEIGHT;
+        if (flags & H2_FLAG_PRIORITY)
+        {
+            if (len < 5)
+                h2_fail(H2_FRAME_SIZE_ERROR);
+            h2->block_parent = ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) & 0x7fffffff;
+            h2->block_weight = p[4] + 1;
+            p += 5;
+            len -= 5;
+        }
+        h2_append_block(p, len);
+        if (flags & H2_FLAG_END_HEADERS)
+            h2_header_block();
+        break;
+    case H2_CONTINUATION:
+        if (!h2->block)
+            h2_fail(H2_PROTOCOL_ERROR);
+        h2_append_block(p, len);
+        if (flags & H2_FLAG_END_HEADERS)
+            h2_header_block();
+        break;
+    case H2_PRIORITY:
+        if (id == 0)
+            h2_fail(H2_PROTOCOL_ERROR);
+        if (len != 5)
+            h2_fail(H2_FRAME_SIZE_ERROR);
+        if (st)
+            h2_set_priority(st, ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) & 0x7fffffff, p[4] + 1);
+        break;
+    case H2_RST_STREAM:
+        if (id == 0 || id > h2->last_stream)
+            h2_fail(H2_PROTOCOL_ERROR);
+        if (len != 4)
+            h2_fail(H2_FRAME_SIZE_ERROR);
+        /* Closing the pipe stops the stream's process with SIGPIPE. */
+        if (st)
+            h2_close(st);
+        break;
+    case H2_SETTINGS:
+        if (id != 0)
+            h2_fail(H2_PROTOCOL_ERROR);
+        if (flags & H2_FLAG_ACK)
+        {
+            if (len != 0)
+                h2_fail(H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (len % 6 != 0)
+            h2_fail(H2_FRAME_SIZE_ERROR);
+        for (uint32_t i = 0; i < len; i += 6)
+        {
+            value = (uint32_t)p[i + 2] << 24 | p[i + 3] << 16 | p[i + 4] << 8 | p[i + 5];
+            h2_setting(p[i] << 8 | p[i + 1], value);
+        }
+        h2_queue_frame(H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        break;
+    case H2_PUSH_PROMISE:
+        h2_fail(H2_PROTOCOL_ERROR);
+        break;
+    case H2_PING:
+        if (id != 0)
+            h2_fail(H2_PROTOCOL_ERROR);
+        if (len != 8)
+            h2_fail(H2_FRAME_SIZE_ERROR);
+        if (!(flags & H2_FLAG_ACK))
+            h2_queue_frame(H2_PING, H2_FLAG_ACK, 0, (char *)p, 8);
+        break;
+    case H2_GOAWAY:
+        if (id != 0)
+            h2_fail(H2_PROTOCOL_ERROR);
+        h2->goaway = 1;
+        break;
+    case H2_WINDOW_UPDATE:
+        if (len != 4)
+            h2_fail(H2_FRAME_SIZE_ERROR);
+        value = ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) & 0x7fffffff;
+        if (id == 0)
+        {
+            if (value == 0 || h2->window + value > H2_MAX_WINDOW)
+                h2_fail(value == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            h2->window += value;
+        }
+        else if (st && (value == 0 || st->window + value > H2_MAX_WINDOW))
+        {
+            h2_reset(id, value == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            h2_close(st);
+        }
+        else if (st)
+            st->window += value;
+        break;
+    default:
+        /* Unknown frame types must be ignored. */
+        break;
+    }
+}
+
+static void h2_setting(int id, uint32_t value)
+{
+    switch (id)
+    {
+    case H2_SETTINGS_HEADER_TABLE_SIZE:
+        /* The table our encoder may use; a smaller one is announced at
+           the start of the next header block. */
+        if (value > H2_HEADER_TABLE_SIZE)
+            value = H2_HEADER_TABLE_SIZE;
+        if (value != h2->encoder.max_size)
+        {
+            hpack_resize(&h2->encoder, value);
+            h2->table_update = 1;
+        }
+        break;
+    case H2_SETTINGS_ENABLE_PUSH:
+        if (value > 1)
+            h2_fail(H2_PROTOCOL_ERROR);
+        break;
+    case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+        if (value > H2_MAX_WINDOW)
+            h2_fail(H2_FLOW_CONTROL_ERROR);
+        for (int i = 0; i < H2_MAX_STREAMS; i++)
+        {
+            if (h2->stream[i].id != 0)
+                h2->stream[i].window += (int64_t)value - h2->initial_window;
+        }
+        h2->initial_window = value;
+        break;
+    case H2_SETTINGS_MAX_FRAME_SIZE:
+        if (value < H2_FRAME_SIZE || value > 16777215)
+            h2_fail(H2_PROTOCOL_ERROR);
+        h2->max_frame = value;
+        break;
+    default:
+        break;
+    }
+}
+
+static int h2_unpad(int flags, unsigned char **p, uint32_t *len)
+{
+    uint32_t pad;
+
+    if (!(flags & H2_FLAG_PADDED))
+        return (0);
+    if (*len < 1)
+        return (-1);
+    pad = **p;
+    if (pad >= *len)
+        return (-1);
+    (*p)++;
+    *len -= pad + 1;
+    return (0);
+}
+
+static void h2_append_block(unsigned char *p, uint32_t len)
+{
+    if (h2->block_len + len > H2_HEADER_BLOCK_MAX)
+        h2_fail(H2_ENHANCE_YOUR_CALM);
+    h2->block = (char *)realloc(h2->block, h2->block_len + len + 1);
+    if (!h2->block)
+        log_exit("failed to allocate memory");
+    memcpy(h2->block + h2->block_len, p, len);
+    h2->block_len += len;
+}
+
+/* A complete header block opens a stream, or carries trailers, which are
+   decoded only to keep the HPACK state in step. */
+static void h2_header_block(void)
+{
+    uint32_t id = h2->block_stream;
+    struct H2Stream *st = h2_find(id);
+    struct HTTPRequest *req = NULL;
+    int refused = 0;
+
+    if (st && !st->pid && h2->block_end_stream)
+        refused = -1;
+    else if (st || id <= h2->last_stream)
+        h2_fail(H2_STREAM_CLOSED);
+    else
+    {
+        h2->last_stream = id;
+        if (h2->goaway || h2->nstreams == H2_MAX_STREAMS)
+            refused = 1;
+        else
+        {
+            req = (struct HTTPRequest *)xmalloc(sizeof(struct HTTPRequest));
+            memset(req, 0, sizeof(struct HTTPRequest));
+            req->protocol_minor_version = 1;
+            req->http2 = 1;
+        }
+    }
+    h2->block_malformed = 0;
+    if (hpack_decode(&h2->decoder, (unsigned char *)h2->block, h2->block_len, req) < 0)
+        h2_fail(H2_COMPRESSION_ERROR);
+    free(h2->block);
+    h2->block = NULL;
+    h2->block_len = 0;
+    if (refused < 0)
+    {
+        h2_start(st);
+        return;
+    }
+    if (refused)
+    {
+        h2_reset(id, H2_REFUSED_STREAM);
+        return;
+    }
+    if (!req->method || !req->path || h2->block_malformed)
+    {
+        free_request(req);
+        h2_reset(id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    st = h2_open(id, req);
+    h2_set_priority(st, h2->block_parent, h2->block_weight);
+    if (h2->block_end_stream)
+        h2_start(st);
+}
+
+static struct H2Stream *h2_open(uint32_t id, struct HTTPRequest *req)
+{
+    struct H2Stream *st = NULL;
+
+    for (int i = 0; i < H2_MAX_STREAMS && !st; i++)
+    {
+        if (h2->stream[i].id == 0)
+            st = &h2->stream[i];
+    }
+    st->id = id;
+    st->req = req;
+    st->body = NULL;
+    st->body_len = 0;
+    st->spool = -1;
+    st->pid = 0;
+    st->fd = -1;
+    st->eof = 0;
+    st->head_sent = 0;
+    st->buf = (char *)xmalloc(PROXY_HEAD_MAX);
+    st->len = 0;
+    st->window = h2->initial_window;
+    st->parent = 0;
+    st->weight = H2_DEFAULT_WEIGHT;
+    st->pass = h2->pass;
+    h2->nstreams++;
+    return (st);
+}
+
+static struct H2Stream *h2_find(uint32_t id)
+{
+    if (id == 0)
+        return (NULL);
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if (h2->stream[i].id == id)
+            return (&h2->stream[i]);
+    }
+    return (NULL);
+}
+
+/* A dependency that would form a cycle is dropped; the exclusive flag is
+   not implemented. */
+static void h2_set_priority(struct H2Stream *st, uint32_t parent, int weight)
+{
+    struct H2Stream *p;
+    int depth = 0;
+
+    st->weight = weight;
+    st->parent = parent;
+    for (p = h2_find(parent); p && depth < H2_MAX_STREAMS; p = h2_find(p->parent), depth++)
+    {
+        if (p == st)
+        {
+            st->parent = 0;
+            break;
+        }
+    }
+}
+
+/* A body is kept in memory up to the size HTTP/1 reads whole and goes
+   to a spool file beyond, as its DATA frames arrive. */
+static void h2_store_body(struct H2Stream *st, unsigned char *p, uint32_t len)
+{
+    struct iovec iov[2];
+
+    if (st->spool < 0 && st->body_len + len > BODY_BUFFER_SIZE && (st->spool = open_spool()) >= 0)
+    {
+        iov[0].iov_base = st->body;
+        iov[0].iov_len = st->body_len;
+        iov[1].iov_base = p;
+        iov[1].iov_len = len;
+        if (writev_all(st->spool, iov, 2) < 0)
+            log_exit("failed to spool request body: %s", strerror(errno));
+        free(st->body);
+        st->body = NULL;
+    }
+    else if (st->spool >= 0)
+    {
+        iov[0].iov_base = p;
+        iov[0].iov_len = len;
+        if (writev_all(st->spool, iov, 1) < 0)
+            log_exit("failed to spool request body: %s", strerror(errno));
+    }
+    else
+    {
+        st->body = (char *)realloc(st->body, st->body_len + len + 1);
+        if (!st->body)
+            log_exit("failed to allocate memory");
+        memcpy(st->body + st->body_len, p, len);
+    }
+    st->body_len += len;
+}
+
+/* The request is complete: hand it to a process of its own. */
+static void h2_start(struct H2Stream *st)
+{
+    struct HTTPRequest *req = st->req;
+    int p[2];
+    pid_t pid;
+
+    if (st->body_len > 0)
+    {
+        req->body = st->body;
+        req->length = st->body_len;
+        st->body = NULL;
+    }
+    st->req = NULL;
+    if (pipe2(p, O_CLOEXEC) < 0)
+        log_exit("pipe(2) failed: %s", strerror(errno));
+    pid = fork();
+    if (pid < 0)
+        log_exit("fork(2) failed: %s", strerror(errno));
+    if (pid == 0)
+        h2_stream_main(req, st->spool, p);
+    close(p[1]);
+    free_request(req);
+    if (st->spool >= 0)
+        close(st->spool);
+    st->spool = -1;
+    if (fcntl(p[0], F_SETFL, O_NONBLOCK) < 0)
+        log_exit("fcntl(2) failed: %s", strerror(errno));
+    st->pid = pid;
+    st->fd = p[0];
+}
+
+static void h2_stream_main(struct HTTPRequest *req, int spool_fd, int *p)
+{
+    local_address(NULL, NULL);
+    drop_tls();
+    close(h2->fd);
+    close(p[0]);
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if (h2->stream[i].fd >= 0 && h2->stream[i].id != 0)
+            close(h2->stream[i].fd);
+        if (h2->stream[i].spool >= 0 && h2->stream[i].spool != spool_fd && h2->stream[i].id != 0)
+            close(h2->stream[i].spool);
+    }
+    adopt_body(req, spool_fd);
+    conn.start = monotonic_usec();
+    conn.status = 0;
+    conn.bytes_sent = 0;
+    conn.finished = 0;
+    memset(conn.stamp, 0, sizeof(conn.stamp));
+    trace_stamp(STAMP_PARSED);
+    open_output(p[1]);
+    conn.req = req;
+    conn.method = method_slot(req->method);
+    DTRACE_PROBE4(r3u, request__parsed, conn.fd, req->method, req->path, req->length);
+    respond_to(req, conn.out);
+    finish_request();
+    exit(0);
+}
+
+/* Called when the stream's process has more output. The HTTP/1 head is
+   collected whole and converted; the body is then held one read at a time
+   until the scheduler frames it. */
+static void h2_read_stream(struct H2Stream *st)
+{
+    char *body;
+    ssize_t n;
+
+    n = read(st->fd, st->buf + st->len, PROXY_HEAD_MAX - st->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        close(st->fd);
+        st->fd = -1;
+        st->eof = 1;
+        /* Bodiless responses end their head by closing. */
+        if (!st->head_sent && st->len > 0 && st->len < PROXY_HEAD_MAX)
+        {
+            h2_send_headers(st, st->buf, st->len);
+            st->len = 0;
+            st->head_sent = 1;
+        }
+        else if (!st->head_sent)
+        {
+            h2_reset(st->id, H2_INTERNAL_ERROR);
+            h2_close(st);
+        }
+        return;
+    }
+    st->len += n;
+    if (st->head_sent)
+        return;
+    body = cgi_header_end(st->buf, st->len);
+    if (!body)
+    {
+        if (st->len == PROXY_HEAD_MAX)
+        {
+            h2_reset(st->id, H2_INTERNAL_ERROR);
+            h2_close(st);
+        }
+        return;
+    }
+    h2_send_headers(st, st->buf, body - st->buf);
+    st->len -= body - st->buf;
+    memmove(st->buf, body, st->len);
+    st->head_sent = 1;
+}
+
+/* Converts an HTTP/1 head into a HEADERS frame and as many CONTINUATION
+   frames as the peer's frame size requires. */
+static void h2_send_headers(struct H2Stream *st, char *head, size_t len)
+{
+    struct H2Buffer block = {NULL, 0, 0};
+    char *end = head + len;
+    char *p, *eol, *colon, *value;
+    char name[256];
+    char status[4] = "500";
+    size_t off, n;
+
+    p = memchr(head, ' ', len);
+    if (p && end - p > 3)
+        memcpy(status, p + 1, 3);
+    if (h2->table_update)
+    {
+        hpack_put_integer(&block, 0x20, 5, h2->encoder.max_size);
+        h2->table_update = 0;
+    }
+    hpack_encode(&h2->encoder, &block, ":status", status);
+    for (p = memchr(head, '\n', len); p && ++p < end; p = eol)
+    {
+        if (!(eol = memchr(p, '\n', end - p)))
+            eol = end;
+        colon = memchr(p, ':', eol - p);
+        if (!colon || colon - p >= (long)sizeof(name) || hop_by_hop(p, colon - p))
+            continue;
+        for (n = 0; p + n < colon; n++)
+            name[n] = tolower((unsigned char)p[n]);
+        name[n] = '\0';
+        value = colon + 1 + strspn(colon + 1, " \t");
+        n = eol - value;
+        while (n > 0 && (value[n - 1] == '\r' || value[n - 1] == ' '))
+            n--;
+        value[n] = '\0';
+        hpack_encode(&h2->encoder, &block, name, value);
+    }
+    for (off = 0; off < block.len; off += n)
+    {
+        n = block.len - off < h2->max_frame ? block.len - off : h2->max_frame;
+        h2_queue_frame(off == 0 ? H2_HEADERS : H2_CONTINUATION,
+                       off + n == block.len ? H2_FLAG_END_HEADERS : 0,
+                       st->id, block.data + off, n);
+    }
+    free(block.data);
+}
+
+/* Streams take turns by weight: each is charged virtual time in inverse
+   proportion to its weight for what it sends, and the one with the least
+   goes next. A stream yields to the stream it depends on only while that
+   one can send itself, so a slow parent holds nobody up. */
+static void h2_schedule(void)
+{
+    char dry[H2_MAX_STREAMS] = {0};
+
+    while (h2->out.len < H2_OUTPUT_HIGH)
+    {
+        struct H2Stream *best = NULL;
+        int64_t n;
+
+        for (int i = 0; i < H2_MAX_STREAMS; i++)
+        {
+            struct H2Stream *st = &h2->stream[i];
+
+            if (st->id == 0 || !st->head_sent || dry[i] || (st->len == 0 && st->fd < 0 && !st->eof))
+                continue;
+            if (!(st->eof && st->len == 0) && (st->window <= 0 || h2->window <= 0))
+                continue;
+            if (h2_blocked(st))
+                continue;
+            /* An idle stream gets no credit for the time it was idle. */
+            if (st->pass < h2->pass)
+                st->pass = h2->pass;
+            if (!best || st->pass < best->pass)
+                best = st;
+        }
+        if (!best)
+            break;
+        /* Each stream holds one read of its output, so the one whose turn
+           it is refills right here rather than wait for poll(2), or the
+           weights would not show. */
+        if (best->len == 0 && !best->eof)
+        {
+            h2_read_stream(best);
+            if (best->id == 0 || (best->len == 0 && !best->eof))
+                dry[best - h2->stream] = 1;
+            continue;
+        }
+        n = best->len;
+        if (n > best->window)
+            n = best->window;
+        if (n > h2->window)
+            n = h2->window;
+        if (n > h2->max_frame)
+            n = h2->max_frame;
+        h2_queue_frame(H2_DATA, best->eof && (size_t)n == best->len ? H2_FLAG_END_STREAM : 0,
+                       best->id, best->buf, n);
+        best->len -= n;
+        memmove(best->buf, best->buf + n, best->len);
+        best->window -= n;
+        h2->window -= n;
+        h2->pass = best->pass;
+        best->pass += ((uint64_t)n << 8) / best->weight + 1;
+        if (best->eof && best->len == 0)
+            h2_close(best);
+    }
+}
+
+static int h2_blocked(struct H2Stream *st)
+{
+    struct H2Stream *parent;
+
+    if (st->parent == 0 || !(parent = h2_find(st->parent)))
+        return (0);
+    return (parent->head_sent && parent->len > 0 && parent->window > 0 && !h2_blocked(parent));
+}
+
+static void h2_close(struct H2Stream *st)
+{
+    if (st->fd >= 0)
+        close(st->fd);
+    if (st->spool >= 0)
+        close(st->spool);
+    if (st->req)
+        free_request(st->req);
+    free(st->body);
+    free(st->buf);
+    st->fd = -1;
+    st->spool = -1;
+    st->req = NULL;
+    st->body = NULL;
+    st->id = 0;
+    h2->nstreams--;
+}
+
+static void h2_send_settings(void)
+{
+    unsigned char s[6] = {0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, H2_MAX_STREAMS >> 8, H2_MAX_STREAMS & 0xff};
+
+    h2_queue_frame(H2_SETTINGS, 0, 0, (char *)s, sizeof(s));
+}
+
+static void h2_window_update(uint32_t id, uint32_t n)
+{
+    unsigned char p[4] = {n >> 24, n >> 16, n >> 8, n};
+
+    h2_queue_frame(H2_WINDOW_UPDATE, 0, id, (char *)p, 4);
+}
+
+static void h2_reset(uint32_t id, uint32_t code)
+{
+    unsigned char p[4] = {code >> 24, code >> 16, code >> 8, code};
+
+    h2_queue_frame(H2_RST_STREAM, 0, id, (char *)p, 4);
+}
+
+static void h2_goaway(uint32_t code)
+{
+    uint32_t id = h2->last_stream;
+    unsigned char p[8] = {id >> 24, id >> 16, id >> 8, id, code >> 24, code >> 16, code >> 8, code};
+
+    h2_queue_frame(H2_GOAWAY, 0, 0, (char *)p, 8);
+    h2->goaway = 1;
+}
+
+/* Connection errors end the connection; streams still running are cut off
+   with it. */
+static void h2_fail(uint32_t code)
+{
+    h2_goaway(code);
+    if (fcntl(h2->fd, F_SETFL, 0) == 0)
+        h2_flush();
+    exit(0);
+}
+
+static void h2_queue_frame(int type, int flags, uint32_t id, char *data, size_t len)
+{
+    unsigned char head[9] = {len >> 16, len >> 8, len, type, flags, id >> 24, id >> 16, id >> 8, id};
+
+    h2_append(&h2->out, (char *)head, sizeof(head));
+    h2_append(&h2->out, data, len);
+}
+
+static void h2_flush(void)
+{
+    size_t done = 0;
+
+    while (done < h2->out.len)
+    {
+        ssize_t n = sock_write(h2->fd, h2->out.data + done, h2->out.len - done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n < 0)
+            log_exit("failed to write to socket: %s", strerror(errno));
+        done += n;
+    }
+    if (done == 0)
+        return;
+    h2->out.len -= done;
+    memmove(h2->out.data, h2->out.data + done, h2->out.len);
+}
+
+static void h2_append(struct H2Buffer *b, char *data, size_t len)
+{
+    if (b->len + len > b->size)
+    {
+        b->size = (b->len + len) * 2;
+        b->data = (char *)realloc(b->data, b->size);
+        if (!b->data)
+            log_exit("failed to allocate memory");
+    }
+    if (len > 0)
+        memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/* Decodes a header block into req, or just through the table when req
+   is NULL. Returns -1 on a compression error, or when the fields add up
+   to more than we take. */
+static int hpack_decode(struct HpackTable *t, unsigned char *p, size_t len, struct HTTPRequest *req)
+{
+    unsigned char *end = p + len;
+    char *name, *value;
+    uint32_t index;
+    int fields = 0;
+    size_t total = 0;
+
+    while (p < end)
+    {
+        if (*p & 0x80)
+        {
+            if (hpack_integer(&p, end, 7, &index) < 0 || hpack_field(t, index, &name, &value) < 0)
+                return (-1);
+            total += strlen(name) + strlen(value) + 32;
+            if (total > H2_HEADER_LIST_MAX)
+                return (-1);
+            h2_add_field(req, name, value);
+            fields++;
+            continue;
+        }
+        if ((*p & 0xe0) == 0x20)
+        {
+            /* Size updates are only allowed before the first field. */
+            if (fields > 0 || hpack_integer(&p, end, 5, &index) < 0 || index > H2_HEADER_TABLE_SIZE)
+                return (-1);
+            hpack_resize(t, index);
+            continue;
+        }
+        {
+            int incremental = (*p & 0xc0) == 0x40;
+            char *n = NULL, *v = NULL;
+
+            if (hpack_integer(&p, end, incremental ? 6 : 4, &index) < 0)
+                return (-1);
+            if (index > 0 && hpack_field(t, index, &name, &value) < 0)
+                return (-1);
+            if (index == 0 && !(n = hpack_string(&p, end)))
+                return (-1);
+            if (!(v = hpack_string(&p, end)))
+            {
+                free(n);
+                return (-1);
+            }
+            if (n)
+                name = n;
+            total += strlen(name) + strlen(v) + 32;
+            if (total <= H2_HEADER_LIST_MAX)
+                h2_add_field(req, name, v);
+            if (incremental)
+                hpack_add(t, name, v);
+            free(n);
+            free(v);
+            if (total > H2_HEADER_LIST_MAX)
+                return (-1);
+            fields++;
+        }
+    }
+    return (0);
+}
+
+/* Pseudo-header fields fill in the request line; the rest become header
+   fields the way read_header_field() leaves them, value ending in CRLF. */
+static void h2_add_field(struct HTTPRequest *req, char *name, char *value)
+{
+    struct HTTPHeaderField *h;
+    char **slot = NULL;
+
+    if (!req)
+        return;
+    if (!h2_valid_field(name, value))
+    {
+        h2->block_malformed = 1;
+        return;
+    }
+    if (strcmp(name, ":method") == 0)
+        slot = &req->method;
+    else if (strcmp(name, ":path") == 0)
+        slot = &req->path;
+    else if (strcmp(name, ":authority") == 0)
+        name = "host";
+    else if (name[0] == ':')
+        return;
+    if (slot)
+    {
+        if (*slot)
+            return;
+        *slot = (char *)xmalloc(strlen(value) + 1);
+        strcpy(*slot, value);
+        return;
+    }
+    if (strcmp(name, "host") == 0 && lookup_header_field_value(req, "host"))
+        return;
+    /* Cookies may be split into crumbs (RFC 9113 8.2.3); put them back. */
+    if (strcmp(name, "cookie") == 0)
+    {
+        for (h = req->header; h; h = h->next)
+        {
+            if (strcmp(h->name, "cookie") == 0)
+            {
+                size_t len = strcspn(h->value, "\r\n");
+                char *v = (char *)xmalloc(len + strlen(value) + 5);
+
+                sprintf(v, "%.*s; %s\r\n", (int)len, h->value, value);
+                free(h->value);
+                h->value = v;
+                return;
+            }
+        }
+    }
+    h = (struct HTTPHeaderField *)xmalloc(sizeof(struct HTTPHeaderField));
+    h->name = (char *)xmalloc(strlen(name) + 1);
+    strcpy(h->name, name);
+    h->value = (char *)xmalloc(strlen(value) + 3);
+    sprintf(h->value, "%s\r\n", value);
+    h->next = req->header;
+    req->header = h;
+}
+
+static int hpack_integer(unsigned char **p, unsigned char *end, int prefix, uint32_t *value)
+{
+    uint32_t mask = (1 << prefix) - 1;
+    uint32_t v;
+
+    if (*p >= end)
+        return (-1);
+    v = *(*p)++ & mask;
+    if (v < mask)
+    {
+        *value = v;
+        return (0);
+    }
+    for (int shift = 0; *p < end && shift <= 21; shift += 7)
+    {
+        unsigned char b = *(*p)++;
+
+        v += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *value = v;
+            return (0);
+        }
+    }
+    return (-1);
+}
+
+/* Returns a NUL-terminated copy, Huffman decoded if need be. */
+/* Fields go on into HTTP/1 requests to backends, so those that could
+   not be written there as they are make the request malformed (RFC 9113
+   8.2.1): names must be lowercase tokens, values free of CR, LF and NUL. */
+static int h2_valid_field(char *name, char *value)
+{
+    char *n = name[0] == ':' ? name + 1 : name;
+
+    if (!*n || strpbrk(value, "\r\n"))
+        return (0);
+    for (; *n; n++)
+    {
+        if (!(islower((unsigned char)*n) || isdigit((unsigned char)*n) || strchr("!#$%&'*+-.^_`|~", *n)))
+            return (0);
+    }
+    return (1);
+}
+
+/* A NUL would silently cut a string short; it is decoded as LF instead,
+   which h2_valid_field() refuses. */
+static char *hpack_string(unsigned char **p, unsigned char *end)
+{
+    int huffman;
+    uint32_t len;
+    char *s;
+
+    if (*p >= end)
+        return (NULL);
+    huffman = **p & 0x80;
+    if (hpack_integer(p, end, 7, &len) < 0 || len > (size_t)(end - *p))
+        return (NULL);
+    if (huffman)
+        s = huffman_decode(*p, len);
+    else
+    {
+        s = (char *)xmalloc(len + 1);
+        for (uint32_t i = 0; i < len; i++)
+            s[i] = (*p)[i] ? (*p)[i] : '\n';
+        s[len] = '\0';
+    }
+    *p += len;
+    return (s);
+}
+
+/* Canonical decoding: codes of each length are consecutive, so a code of
+   length L is symbol offset[L] + code - first[L] in length order. */
+static char *huffman_decode(unsigned char *src, size_t len)
+{
+    static uint16_t symbol[HPACK_EOS + 1];
+    static uint32_t first[31];
+    static uint16_t count[31], offset[31];
+    static int ready = 0;
+    uint32_t code = 0;
+    int bits = 0;
+    size_t n = 0;
+    char *out;
+
+    if (!ready)
+    {
+        int k = 0;
+
+        for (int l = 1; l <= 30; l++)
+        {
+            offset[l] = k;
+            for (int s = 0; s <= HPACK_EOS; s++)
+            {
+                if (hpack_huffman_len[s] != l)
+                    continue;
+                if (count[l]++ == 0)
+                    first[l] = hpack_huffman_code[s];
+                symbol[k++] = s;
+            }
+        }
+        ready = 1;
+    }
+    out = (char *)xmalloc(len * 8 / 5 + 1);
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int b = 7; b >= 0; b--)
+        {
+            code = code << 1 | ((src[i] >> b) & 1);
+            bits++;
+            if (code - first[bits] < count[bits])
+            {
+                int s = symbol[offset[bits] + code - first[bits]];
+
+                if (s == HPACK_EOS)
+                {
+                    free(out);
+                    return (NULL);
+                }
+                out[n++] = s ? s : '\n';
+                code = 0;
+                bits = 0;
+            }
+            else if (bits == 30)
+            {
+                free(out);
+                return (NULL);
+            }
+        }
+    }
+    /* What is left must be padding: at most 7 bits of EOS, all ones. */
+    if (bits > 7 || code != (1U << bits) - 1)
+    {
+        free(out);
+        return (NULL);
+    }
+    out[n] = '\0';
+    return (out);
+}
+
+static int hpack_field(struct HpackTable *t, uint32_t index, char **name, char **value)
 {
-    while (1)
+    struct HpackField *f;
+
+    if (index == 0)
+        return (-1);
+    if (index <= HPACK_STATIC_ENTRIES)
     {
-        struct sockaddr_storage addr;
-        socklen_t addrlen = sizeof(addr);
-        int sock;
-        int pid;
+        *name = hpack_static[index - 1].name;
+        *value = hpack_static[index - 1].value;
+        return (0);
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= (uint32_t)t->count)
+        return (-1);
+    f = &t->field[(t->head + index) % HPACK_DYNAMIC_ENTRIES];
+    *name = f->name;
+    *value = f->value;
+    return (0);
+}
 
-        sock = accept(server_fd, (struct sockaddr *)&addr, &addrlen);
-        if (sock < 0)
-            log_exit("accept(2) failed: %s", strerror(errno));
-        pid = fork();
-        if (pid < 0)
-            exit(3);
-        if (pid == 0)
-        {
-            FILE *inf = fdopen(sock, "r");
-            FILE *outf = fdopen(sock, "w");
+/* The dynamic table is a ring with the newest entry at head; an entry
+   costs its name and value plus 32 bytes. */
+static void hpack_add(struct HpackTable *t, char *name, char *value)
+{
+    size_t size = strlen(name) + strlen(value) + 32;
+    struct HpackField *f;
+    char *n, *v;
 
-            service(inf, outf, docroot);
-            exit(0);
-        }
-        close(sock);
+    /* Copied first: name may be an entry that is about to be evicted. */
+    n = (char *)xmalloc(strlen(name) + 1);
+    strcpy(n, name);
+    v = (char *)xmalloc(strlen(value) + 1);
+    strcpy(v, value);
+    while (t->count > 0 && t->size + size > t->max_size)
+        hpack_evict(t);
+    if (size > t->max_size)
+    {
+        free(n);
+        free(v);
+        return;
     }
+    t->head = (t->head + HPACK_DYNAMIC_ENTRIES - 1) % HPACK_DYNAMIC_ENTRIES;
+    f = &t->field[t->head];
+    f->name = n;
+    f->value = v;
+    t->count++;
+    t->size += size;
 }
 
-static void service(FILE *in, FILE *out, char *docroot)
+static void hpack_evict(struct HpackTable *t)
 {
-    struct HTTPRequest *req;
+    struct HpackField *f = &t->field[(t->head + t->count - 1) % HPACK_DYNAMIC_ENTRIES];
 
-    req = read_request(in);
-    respond_to(req, out, docroot);
-    free_request(req);
+    t->size -= strlen(f->name) + strlen(f->value) + 32;
+    free(f->name);
+    free(f->value);
+    t->count--;
 }
 
-static struct HTTPRequest *read_request(FILE *in)
+static void hpack_resize(struct HpackTable *t, size_t max_size)
 {
-    struct HTTPRequest *req;
-    struct HTTPHeaderField *h;
+    t->max_size = max_size;
+    while (t->count > 0 && t->size > t->max_size)
+        hpack_evict(t);
+}
 
-    req = (struct HTTPRequest *)xmalloc(sizeof(struct HTTPRequest));
-    read_request_line(req, in);
-    req->header = NULL;
-    while ((h = read_header_field(in)))
+/* Fields that change with every response are not worth a table entry,
+   and Set-Cookie is never indexed anywhere. */
+static void hpack_encode(struct HpackTable *t, struct H2Buffer *b, char *name, char *value)
+{
+    static char *volatile_names[] = {"content-length", "date", "age", "etag", "last-modified", NULL};
+    uint32_t name_index = 0;
+    char *n, *v;
+    int first = 0x40, prefix = 6;
+
+    for (uint32_t i = 1; i <= HPACK_STATIC_ENTRIES + (uint32_t)t->count; i++)
     {
-        h->next = req->header;
-        req->header = h;
+        if (hpack_field(t, i, &n, &v) < 0 || strcmp(n, name) != 0)
+            continue;
+        if (strcmp(v, value) == 0)
+        {
+            hpack_put_integer(b, 0x80, 7, i);
+            return;
+        }
+        if (!name_index)
+            name_index = i;
     }
-    req->length = content_length(req);
-    if (req->length != 0)
+    if (strcmp(name, "set-cookie") == 0)
     {
-        if (req->length > MAX_REQUEST_BODY_LENGTH)
-            log_exit("request body too long");
-        req->body = xmalloc(req->length);
-        if (fread(req->body, req->length, sizeof(char), in) < 1)
-            log_exit("failed to read request body");
+        first = 0x10;
+        prefix = 4;
     }
-    else
-        req->body = NULL;
-    return (req);
+    for (char **p = volatile_names; *p && first == 0x40; p++)
+    {
+        if (strcmp(name, *p) == 0)
+        {
+            first = 0x00;
+            prefix = 4;
+        }
+    }
+    hpack_put_integer(b, first, prefix, name_index);
+    if (!name_index)
+        hpack_put_string(b, name);
+    hpack_put_string(b, value);
+    if (first == 0x40)
+        hpack_add(t, name, value);
 }
 
-static void read_request_line(struct HTTPRequest *req, FILE *in)
+static void hpack_put_integer(struct H2Buffer *b, int first, int prefix, uint32_t value)
 {
-    char buf[BUFSIZ];
-    char *p;
-    char *path;
+    uint32_t mask = (1 << prefix) - 1;
+    char c;
 
-    if (!fgets(buf, sizeof(buf), in))
-        log_exit("no request line");
-    p = strchr(buf, ' ');
-    if (!p)
-        log_exit("parse error on request line (1): %s", buf);
-    *p++ = '\0';
-    req->method = (char *)xmalloc(p - buf);
-    strcpy(req->method, buf);
-    uppcase(req->method);
-    path = p;
-    p = strchr(path, ' ');
-    if (!p)
-        log_exit("parse error on request line (2): %s", buf);
-    *p++ = '\0';
-    req->path = (char *)xmalloc(p - path);
-    strcpy(req->path, path);
-    if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0)
-        log_exit("parse error on request line (3): %s", buf);
-    p += strlen("HTTP/1.");
-    req->protocol_minor_version = atoi(p);
+    if (value < mask)
+    {
+        c = first | value;
+        h2_append(b, &c, 1);
+        return;
+    }
+    c = first | mask;
+    h2_append(b, &c, 1);
+    for (value -= mask; value >= 0x80; value >>= 7)
+    {
+        c = (value & 0x7f) | 0x80;
+        h2_append(b, &c, 1);
+    }
+    c = value;
+    h2_append(b, &c, 1);
 }
 
-static void uppcase(char *str)
+/* Huffman coded when that is shorter. */
+static void hpack_put_string(struct H2Buffer *b, char *s)
 {
-    for (size_t i = 0; i < strlen(str); i++)
+    size_t len = strlen(s);
+    uint64_t bits = 0, acc = 0;
+    int nacc = 0;
+    char c;
+
+    for (size_t i = 0; i < len; i++)
+        bits += hpack_huffman_len[(unsigned char)s[i]];
+    if ((bits + 7) / 8 >= len)
     {
-        if (islower(str[i]))
-            str[i] += 'A' - 'a';
+        hpack_put_integer(b, 0x00, 7, len);
+        h2_append(b, s, len);
+        return;
+    }
+    hpack_put_integer(b, 0x80, 7, (bits + 7) / 8);
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char sym = s[i];
+
+        acc = acc << hpack_huffman_len[sym] | hpack_huffman_code[sym];
+        nacc += hpack_huffman_len[sym];
+        while (nacc >= 8)
+        {
+            nacc -= 8;
+            c = acc >> nacc;
+            h2_append(b, &c, 1);
+        }
+    }
+    if (nacc > 0)
+    {
+        c = (acc << (8 - nacc)) | (0xff >> nacc);
+        h2_append(b, &c, 1);
     }
 }
 
-static struct HTTPHeaderField *read_header_field(FILE *in)
+static void method_not_allowed(struct HTTPRequest *req, FILE *out)
 {
-    struct HTTPHeaderField *h;
-    char buf[BUFSIZ];
-    char *p;
-
-    if (!fgets(buf, sizeof(buf), in))
-        log_exit("failed to read request header field: %s", strerror(errno));
-    if (strcmp(buf, "\n") == 0 || strcmp(buf, "\r\n") == 0)
-        return (NULL);
+    output_common_header_fields(req, out, "405 Method Not Allowed");
+}
 
-    p = strchr(buf, ':');
-    if (!p)
-        log_exit("parse error on request header field: %s", buf);
-    *p++ = '\0';
-    h = (struct HTTPHeaderField *)xmalloc(sizeof(struct HTTPHeaderField));
-    h->name = (char *)xmalloc(p - buf);
-    strcpy(h->name, buf);
-    p += strspn(p, " \t");
-    h->value = (char *)xmalloc(strlen(p) + 1);
-    strcpy(h->value, p);
-    return (h);
+static void not_implemented(struct HTTPRequest *req, FILE *out)
+{
+    output_common_header_fields(req, out, "501 Not Implemented");
 }
 
-static long content_length(struct HTTPRequest *req)
+static void not_found(struct HTTPRequest *req, FILE *out)
 {
-    char *val;
-    long len;
+    output_common_header_fields(req, out, "404 Not Found");
+}
 
-    val = lookup_header_field_value(req, "Content-Length");
-    if (!val)
-        return (0);
-    len = atol(val);
-    if (len < 0)
-        log_exit("negative Content-Length value");
-    return (len);
+static void bad_request(struct HTTPRequest *req, FILE *out)
+{
+    output_common_header_fields(req, out, "400 Bad Request");
 }
 
-static char *lookup_header_field_value(struct HTTPRequest *req, char *name)
+/* A cached miss answers without touching the filesystem; a cached hit
+   still has to open the file, which also revalidates it. */
+static struct FileInfo *resolve_file(char *raw)
 {
-    struct HTTPHeaderField *h;
+    struct PathCacheEntry hit;
+    struct FileInfo *info;
+    char path[PATH_MAX];
+    uint64_t generation = 0;
 
-    h = req->header;
-    while (h)
+    if (path_cache_get(raw, &hit))
     {
-        if (strcasecmp(h->name, name) == 0)
-            return (h->value);
-        h = h->next;
+        if (metrics)
+            metric_add(&core_metrics()->path_cache_hits, 1);
+        if (hit.ok || hit.dir)
+            return (get_fileinfo(hit.path));
+        info = (struct FileInfo *)xmalloc(sizeof(struct FileInfo));
+        info->path = (char *)xmalloc(strlen(hit.path) + 1);
+        strcpy(info->path, hit.path);
+        info->ok = 0;
+        info->dir = 0;
+        info->size = 0;
+        info->fd = -1;
+        return (info);
     }
-    return (NULL);
-}
-
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot)
-{
-    if (strcmp(req->method, "GET") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "HEAD") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "POST") == 0)
-        method_not_allowed(req, out);
-    else
-        not_implemented(req, out);
+    if (path_cache.entry && metrics)
+        metric_add(&core_metrics()->path_cache_misses, 1);
+    if (normalize_path(raw, path, sizeof(path)) < 0)
+        return (NULL);
+    /* Taken before resolving, so that a change meanwhile retires it. */
+    watch_current(&generation);
+    info = get_fileinfo(path);
+    path_cache_put(raw, info, path, generation);
+    return (info);
 }
 
-static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot)
+/* Percent-decodes, drops the query and fragment and removes dot segments
+   (RFC 3986, 5.2.4), so that the result always starts with "/" and can
+   never climb above the docroot. Returns the length, or -1 for a path
+   that cannot be served. */
+static int normalize_path(char *raw, char *out, size_t size)
 {
-    struct FileInfo *info;
+    size_t len = strlen(raw);
+    size_t n = 0;
+    char *seg, *end;
+    char *buf;
 
-    info = get_fileinfo(docroot, req->path);
-    if (!info->ok)
+    if (raw[0] != '/' || len >= size)
+        return (-1);
+    if (!path_needs_normalizing(raw, len))
     {
-        free_fileinfo(info);
-        not_found(req, out);
-        return;
+        memcpy(out, raw, len + 1);
+        return (len);
     }
-    output_common_header_fields(req, out, "200 OK");
-    fprintf(out, "Content-Length: %ld\r\n", info->size);
-    fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
-    fprintf(out, "\r\n");
-    if (strcmp(req->method, "HEAD") != 0)
+    buf = (char *)xmalloc(len + 1);
+    for (size_t i = 0; i < len && raw[i] != '?' && raw[i] != '#'; i++)
     {
-        int fd;
-        char buf[BUFSIZ];
-        ssize_t n;
+        int c = (unsigned char)raw[i];
 
-        fd = open(info->path, O_RDONLY);
-        if (fd < 0)
-            log_exit("failed to open %s: %s", info->path, strerror(errno));
-        while (1)
+        if (c == '%')
         {
-            n = read(fd, buf, sizeof(buf));
-            if (n < 0)
-                log_exit("failed to read %s: %s", info->path, strerror(errno));
-            if (n == 0)
-                break;
-            if (fwrite(buf, sizeof(char), n, out) < (size_t)n)
-                log_exit("failed to write to socket: %s", strerror(errno));
+            int hi = hex_value(raw[i + 1]);
+            int lo = hi < 0 ? -1 : hex_value(raw[i + 2]);
+
+            if (lo < 0 || (hi == 0 && lo == 0))
+            {
+                free(buf);
+                return (-1);
+            }
+            c = hi << 4 | lo;
+            i += 2;
         }
-        close(fd);
+        buf[n++] = c;
     }
-    fflush(out);
-    free_fileinfo(info);
+    buf[n] = '\0';
+    /* Segments are copied over one at a time; ".." rewinds out to the
+       previous "/", and a path ending in a dot segment keeps its slash. */
+    n = 0;
+    for (seg = buf + 1;; seg = end + 1)
+    {
+        size_t seglen;
+
+        end = strchr(seg, '/');
+        if (!end)
+            end = seg + strlen(seg);
+        seglen = end - seg;
+        if (seglen == 2 && seg[0] == '.' && seg[1] == '.')
+        {
+            while (n > 0 && out[--n] != '/')
+                ;
+        }
+        else if (seglen > 0 && !(seglen == 1 && seg[0] == '.'))
+        {
+            out[n++] = '/';
+            memcpy(out + n, seg, seglen);
+            n += seglen;
+        }
+        if (*end == '\0')
+        {
+            if (n == 0 || seglen == 0 || (seglen == 1 && seg[0] == '.') ||
+                (seglen == 2 && seg[0] == '.' && seg[1] == '.'))
+                out[n++] = '/';
+            break;
+        }
+    }
+    out[n] = '\0';
+    free(buf);
+    return (n);
 }
 
-static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status)
+/* Most paths are already normal. This looks for the bytes that say
+   otherwise: "%", "?", "#", or a "/" followed by "." or another "/". */
+static int path_needs_normalizing(char *path, size_t len)
 {
-    time_t t;
-    struct tm *tm;
-    char buf[BUFSIZ];
+    size_t i = 0;
 
-    t = time(NULL);
-    tm = gmtime(&t);
-    if (!tm)
-        log_exit("gmtime() failed: %s", strerror(errno));
-    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", tm);
-    fprintf(out, "HTTP/1.%d %s\r\n", req->protocol_minor_version, status);
-    fprintf(out, "Date: %s\r\n", buf);
-    fprintf(out, "Server: %s/%s\r\n", SERVER_NAME, SERVER_VERSION);
-    fprintf(out, "Connection: close\r\n");
+#ifdef __SSE2__
+    /* The load at i + 1 may read the terminating NUL but never past it. */
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(path + i));
+        __m128i next = _mm_loadu_si128((const __m128i *)(path + i + 1));
+        __m128i hit;
+
+        hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('%')),
+                           _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('?')), _mm_cmpeq_epi8(v, _mm_set1_epi8('#'))));
+        hit = _mm_or_si128(hit, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+                                              _mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8('.')),
+                                                           _mm_cmpeq_epi8(next, _mm_set1_epi8('/')))));
+        if (_mm_movemask_epi8(hit))
+            return (1);
+    }
+#endif
+    for (; i < len; i++)
+    {
+        char c = path[i];
+
+        if (c == '%' || c == '?' || c == '#')
+            return (1);
+        if (c == '/' && (path[i + 1] == '.' || path[i + 1] == '/'))
+            return (1);
+    }
+    return (0);
 }
 
-static char *guess_content_type(struct FileInfo *info)
+static int hex_value(int c)
 {
-    (void)info;
-    return ("text/html");
+    if (c >= '0' && c <= '9')
+        return (c - '0');
+    if (c >= 'a' && c <= 'f')
+        return (c - 'a' + 10);
+    if (c >= 'A' && c <= 'F')
+        return (c - 'A' + 10);
+    return (-1);
 }
 
-static void method_not_allowed(struct HTTPRequest *req, FILE *out)
+/* Anonymous shared memory: inherited by every connection process, and
+   simply rebuilt empty after a reload. */
+static void setup_path_cache(void)
 {
-    output_common_header_fields(req, out, "405 Method Not Allowed");
+    int slots;
+
+    if (path_cache.slots == 0 || path_cache.ttl == 0)
+        return;
+    for (slots = 1; slots < path_cache.slots; slots *= 2)
+        ;
+    path_cache.slots = slots;
+    path_cache.entry = (struct PathCacheEntry *)mmap(NULL, sizeof(struct PathCacheEntry) * slots,
+                                                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (path_cache.entry == MAP_FAILED)
+        log_exit("mmap(2) failed: %s", strerror(errno));
 }
 
-static void not_implemented(struct HTTPRequest *req, FILE *out)
+static int path_cache_get(char *raw, struct PathCacheEntry *hit)
 {
-    output_common_header_fields(req, out, "501 Not Implemented");
+    struct PathCacheEntry *e;
+    size_t len = strlen(raw);
+    uint64_t h, generation;
+    uint32_t seq;
+
+    if (!path_cache.entry || len >= PATH_CACHE_KEY_MAX)
+        return (0);
+    h = pack_hash(raw, len);
+    e = &path_cache.entry[h & (path_cache.slots - 1)];
+    seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return (0);
+    memcpy(hit, e, sizeof(*hit));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+        return (0);
+    hit->raw[PATH_CACHE_KEY_MAX - 1] = '\0';
+    hit->path[PATH_CACHE_KEY_MAX - 1] = '\0';
+    if (hit->hash != h || strcmp(hit->raw, raw) != 0)
+        return (0);
+    if (hit->generation && watch_current(&generation))
+        return (hit->generation == generation);
+    return (hit->expires > time(NULL));
 }
 
-static void not_found(struct HTTPRequest *req, FILE *out)
+static void path_cache_put(char *raw, struct FileInfo *info, char *path, uint64_t generation)
 {
-    output_common_header_fields(req, out, "404 Not Found");
+    struct PathCacheEntry *e;
+    size_t len = strlen(raw);
+    uint64_t h;
+    uint32_t seq;
+
+    if (!path_cache.entry || len >= PATH_CACHE_KEY_MAX || strlen(path) >= PATH_CACHE_KEY_MAX)
+        return;
+    h = pack_hash(raw, len);
+    e = &path_cache.entry[h & (path_cache.slots - 1)];
+    seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+    /* Someone else is filling this slot; their entry is as good as ours. */
+    if ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    e->hash = h;
+    e->ok = info->ok;
+    e->dir = info->dir;
+    e->generation = generation;
+    e->expires = time(NULL) + path_cache.ttl;
+    memcpy(e->raw, raw, len + 1);
+    strcpy(e->path, path);
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
-static struct FileInfo *get_fileinfo(char *docroot, char *urlpath)
+/* Takes a normalized path and opens the file it names; fstat(2) on the
+   descriptor replaces a separate lstat(2) of the path. */
+static struct FileInfo *get_fileinfo(char *urlpath)
 {
     struct FileInfo *info;
     struct stat st;
 
     info = (struct FileInfo *)xmalloc(sizeof(struct FileInfo));
-    info->path = build_fspath(docroot, urlpath);
+    info->path = (char *)xmalloc(strlen(urlpath) + 1);
+    strcpy(info->path, urlpath);
     info->ok = 0;
-    if (lstat(info->path, &st) < 0)
+    info->dir = 0;
+    info->size = 0;
+    info->fd = open_beneath(urlpath);
+    if (info->fd < 0)
+        return (info);
+    if (fstat(info->fd, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+    {
+        close(info->fd);
+        info->fd = -1;
         return (info);
-    if (!S_ISREG(st.st_mode))
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        /* Kept open: the index and listing are read through it. */
+        info->dir = 1;
         return (info);
+    }
     info->ok = 1;
     info->size = st.st_size;
     return (info);
 }
 
-static char *build_fspath(char *docroot, char *urlpath)
+/* Requests are resolved relative to a descriptor of the docroot held
+   from startup, inherited by every connection process. */
+static void open_docroot(char *root)
 {
-    char *path;
+    struct open_how how;
+    int fd;
+
+    docroot_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (docroot_fd < 0)
+        log_exit("failed to open %s: %s", root, strerror(errno));
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH;
+    fd = syscall(SYS_openat2, docroot_fd, ".", &how, sizeof(how));
+    if (fd >= 0)
+        close(fd);
+    else if (errno == ENOSYS)
+    {
+        log_message("openat2(2) is not available, resolving without RESOLVE_BENEATH");
+        have_openat2 = 0;
+    }
+}
+
+/* RESOLVE_BENEATH fails any walk that would leave the docroot, through
+   ".." or an absolute or escaping symlink, and RESOLVE_NO_MAGICLINKS
+   refuses /proc style links; containment no longer depends on --chroot.
+   The walk starts at the held directory rather than at "/". O_NOFOLLOW
+   keeps the old rule that the file itself must not be a symlink. Older
+   kernels fall back to openat(2), where path normalization still keeps
+   ".." out. */
+static int open_beneath(char *path)
+{
+    struct open_how how;
+    char *rel = path[1] ? path + 1 : ".";
 
-    path = (char *)xmalloc(sizeof(char) * (strlen(docroot) + 1 + strlen(urlpath) + 1));
-    sprintf(path, "%s/%s", docroot, urlpath);
-    return (path);
+    if (!have_openat2)
+        return (openat(docroot_fd, rel, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    return (syscall(SYS_openat2, docroot_fd, rel, &how, sizeof(how)));
 }
 
 static void free_fileinfo(struct FileInfo *info)
 {
+    if (info->fd >= 0)
+        close(info->fd);
     free(info->path);
     free(info);
 }
@@ -585,6 +7988,21 @@ static void log_exit(char *fmt, ...)
     exit(1);
 }
 
+static void log_message(char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (debug_mode)
+    {
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+    }
+    else
+        vsyslog(LOG_NOTICE, fmt, ap);
+    va_end(ap);
+}
+
 static void *xmalloc(size_t sz)
 {
     void *p;
@@ -598,7 +8016,10 @@ static void *xmalloc(size_t sz)
 static void install_signal_handlers(void)
 {
     trap_signal(SIGPIPE, signal_exit, SA_RESTART);
-    trap_signal(SIGCHLD, noop_handler, SA_RESTART | SA_NOCLDWAIT);
+    trap_signal(SIGCHLD, reap_children, SA_RESTART);
+    trap_signal(SIGHUP, request_reload, 0);
+    trap_signal(SIGUSR2, request_upgrade, 0);
+    trap_signal(SIGUSR1, request_reopen, 0);
 }
 
 static void trap_signal(int sig, __sighandler_t handler, int flags)
@@ -617,7 +8038,67 @@ static void signal_exit(int sig)
     log_exit("exit by signal %d", sig);
 }
 
-static void noop_handler(int sig)
+/* The alarm can land inside malloc(3) or stdio, so this does only what
+   is async-signal-safe and leaves by _exit(), past finish_connection():
+   the counter is a lock-free add to shared memory, and the message goes
+   to stderr only, as syslog(3) is not safe here. */
+static void deadline_exit(int sig)
+{
+    char *phase = deadline_phase ? deadline_phase : "deadline";
+    struct iovec iov[2] = {{phase, strlen(phase)}, {" timeout\n", 9}};
+
+    (void)sig;
+    if (metrics)
+        metric_add(&core_metrics()->failed, 1);
+    if (debug_mode)
+        writev(STDERR_FILENO, iov, 2);
+    if (conn.fd >= 0)
+        shutdown(conn.fd, SHUT_RDWR);
+    _exit(1);
+}
+
+static void reap_children(int sig)
+{
+    int saved_errno = errno;
+    pid_t pid;
+
+    (void)sig;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+    {
+        if (pid == access_log.pid)
+            access_log.pid = 0;
+        else if (pid == watcher.pid)
+        {
+            /* Until a new watcher has rescanned, changes go unseen. */
+            watcher.pid = 0;
+            __atomic_store_n(&watcher.state->complete, 0, __ATOMIC_RELEASE);
+        }
+        else if (pid != successor_pid && !is_helper(pid) && !forget_admin(pid))
+            active_connections--;
+    }
+    errno = saved_errno;
+}
+
+static void request_reload(int sig)
+{
+    (void)sig;
+    reload_requested = 1;
+}
+
+static void request_upgrade(int sig)
+{
+    (void)sig;
+    upgrade_requested = 1;
+}
+
+static void request_reopen(int sig)
+{
+    (void)sig;
+    reopen_requested = 1;
+}
+
+static void logger_reopen_handler(int sig)
 {
     (void)sig;
+    logger_reopen = 1;
 }
@@ -0,0 +1,523 @@
+/*
+ * r3u pack: an immutable image of a docroot, shared by the server and the
+ * r3u-pack tool.
+ *
+ * The image is one contiguous, position independent blob:
+ *
+ *   struct PackHeader
+ *   struct PackEntry[count]     sorted by path
+ *   uint32_t bucket[nbuckets]   open addressing hash index, entry + 1
+ *   path strings and precomputed header blocks
+ *   bodies                      page aligned region
+ *
+ * All references are byte offsets from the start of the image. An entry
+ * has an identity variant and optionally a gzip variant; each variant
+ * carries the header fields that follow the common ones (Content-Length,
+ * Content-Type, Content-Encoding, Vary, ETag, Last-Modified and the blank
+ * line) so that serving it is a single writev(2).
+ *
+ * The integers are in host byte order; a pack is built and served on the
+ * same architecture.
+ */
+#ifndef R3U_PACK_H
+#define R3U_PACK_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PACK_MAGIC 0x50553352 /* "R3UP" */
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+#define PACK_HEADER_MAX 512
+#define PACK_GZIP_MIN 256
+
+enum
+{
+    PACK_IDENTITY,
+    PACK_GZIP,
+    PACK_VARIANTS,
+};
+
+struct PackVariant
+{
+    uint64_t header;
+    uint64_t etag;
+    uint64_t body;
+    uint64_t size;
+    uint32_t header_len;
+    uint32_t etag_len;
+};
+
+struct PackEntry
+{
+    uint64_t hash;
+    uint64_t path;
+    uint32_t path_len;
+    uint32_t reserved;
+    struct PackVariant variant[PACK_VARIANTS];
+};
+
+struct PackHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t count;
+    uint32_t nbuckets;
+    uint64_t size;
+    struct PackEntry entry[];
+};
+
+/* Compresses len bytes at in into a malloc(3)ed gzip stream, or returns
+   NULL to store the file uncompressed only. */
+typedef char *(*pack_compress_fn)(char *in, size_t len, size_t *out_len);
+
+/* A docroot file found while building a pack. */
+struct PackFile
+{
+    char *path;
+    char *key;
+    struct stat st;
+    char *gzip;
+    size_t gzip_len;
+    char header[PACK_VARIANTS][PACK_HEADER_MAX];
+    size_t etag[PACK_VARIANTS];
+    size_t etag_len[PACK_VARIANTS];
+};
+
+static struct PackFile *pack_files = NULL;
+static size_t pack_nfiles = 0;
+static size_t pack_cap = 0;
+static size_t pack_rootlen = 0;
+static char pack_errmsg[256];
+
+/* FNV-1a */
+static inline uint64_t pack_hash(const char *path, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)path[i];
+        h *= 0x100000001b3ULL;
+    }
+    return (h);
+}
+
+static inline uint32_t *pack_buckets(struct PackHeader *p)
+{
+    return ((uint32_t *)&p->entry[p->count]);
+}
+
+static inline struct PackEntry *pack_lookup(struct PackHeader *p, const char *path)
+{
+    uint32_t *buckets = pack_buckets(p);
+    size_t len = strlen(path);
+    uint64_t h = pack_hash(path, len);
+
+    for (uint32_t b = h & (p->nbuckets - 1); buckets[b]; b = (b + 1) & (p->nbuckets - 1))
+    {
+        struct PackEntry *e = &p->entry[buckets[b] - 1];
+
+        if (e->hash == h && e->path_len == len && memcmp((char *)p + e->path, path, len) == 0)
+            return (e);
+    }
+    return (NULL);
+}
+
+static inline int pack_within(uint64_t off, uint64_t len, uint64_t size)
+{
+    return (off <= size && len <= size - off);
+}
+
+/* A pack comes from outside the server, so every offset is checked once
+   at load time; lookups can then trust the image. */
+static int pack_validate(struct PackHeader *p, size_t size)
+{
+    uint64_t index;
+
+    if (size < sizeof(struct PackHeader) || p->magic != PACK_MAGIC)
+        return (snprintf(pack_errmsg, sizeof(pack_errmsg), "not a pack"), -1);
+    if (p->version != PACK_VERSION)
+        return (snprintf(pack_errmsg, sizeof(pack_errmsg), "unsupported pack version %u", p->version), -1);
+    if (p->size != size)
+        return (snprintf(pack_errmsg, sizeof(pack_errmsg), "truncated pack"), -1);
+    if (p->nbuckets == 0 || (p->nbuckets & (p->nbuckets - 1)) || p->nbuckets <= p->count)
+        return (snprintf(pack_errmsg, sizeof(pack_errmsg), "bad hash index"), -1);
+    index = sizeof(struct PackHeader) + (uint64_t)sizeof(struct PackEntry) * p->count +
+            (uint64_t)sizeof(uint32_t) * p->nbuckets;
+    if (index > size)
+        return (snprintf(pack_errmsg, sizeof(pack_errmsg), "truncated index"), -1);
+    for (uint32_t b = 0; b < p->nbuckets; b++)
+    {
+        if (pack_buckets(p)[b] > p->count)
+            return (snprintf(pack_errmsg, sizeof(pack_errmsg), "bad hash index"), -1);
+    }
+    for (uint32_t i = 0; i < p->count; i++)
+    {
+        struct PackEntry *e = &p->entry[i];
+
+        if (!pack_within(e->path, (uint64_t)e->path_len + 1, size) || ((char *)p)[e->path + e->path_len] != '\0')
+            return (snprintf(pack_errmsg, sizeof(pack_errmsg), "bad path in entry %u", i), -1);
+        for (int v = 0; v < PACK_VARIANTS; v++)
+        {
+            struct PackVariant *pv = &e->variant[v];
+
+            if (v != PACK_IDENTITY && pv->header_len == 0)
+                continue;
+            if (!pack_within(pv->header, pv->header_len, size) || !pack_within(pv->body, pv->size, size) ||
+                pv->etag < pv->header || !pack_within(pv->etag, pv->etag_len, pv->header + pv->header_len))
+                return (snprintf(pack_errmsg, sizeof(pack_errmsg), "bad variant in entry %u", i), -1);
+        }
+    }
+    return (0);
+}
+
+static char *pack_mime_type(const char *path)
+{
+    static char *types[][2] = {
+        {"html", "text/html; charset=utf-8"},
+        {"htm", "text/html; charset=utf-8"},
+        {"css", "text/css; charset=utf-8"},
+        {"js", "text/javascript; charset=utf-8"},
+        {"mjs", "text/javascript; charset=utf-8"},
+        {"json", "application/json"},
+        {"map", "application/json"},
+        {"txt", "text/plain; charset=utf-8"},
+        {"xml", "application/xml"},
+        {"svg", "image/svg+xml"},
+        {"png", "image/png"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"},
+        {"webp", "image/webp"},
+        {"avif", "image/avif"},
+        {"ico", "image/x-icon"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"ttf", "font/ttf"},
+        {"otf", "font/otf"},
+        {"wasm", "application/wasm"},
+        {"pdf", "application/pdf"},
+        {"zip", "application/zip"},
+        {"gz", "application/gzip"},
+        {"mp3", "audio/mpeg"},
+        {"mp4", "video/mp4"},
+        {"webm", "video/webm"},
+    };
+    const char *ext;
+
+    ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/'))
+        return ("application/octet-stream");
+    ext++;
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (strcasecmp(ext, types[i][0]) == 0)
+            return (types[i][1]);
+    }
+    return ("application/octet-stream");
+}
+
+/* Already compressed formats gain nothing from gzip. */
+static int pack_compressible(const char *mime)
+{
+    return (strncmp(mime, "text/", 5) == 0 || strstr(mime, "json") || strstr(mime, "xml") ||
+            strcmp(mime, "application/wasm") == 0 || strcmp(mime, "font/ttf") == 0 ||
+            strcmp(mime, "font/otf") == 0 || strcmp(mime, "image/x-icon") == 0);
+}
+
+static int pack_fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(pack_errmsg, sizeof(pack_errmsg), fmt, ap);
+    va_end(ap);
+    return (-1);
+}
+
+static int pack_collect(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    struct PackFile *f;
+
+    (void)ftw;
+    if (type == FTW_DNR)
+        return (pack_fail("failed to read directory %s", path));
+    /* Only regular files, never symlinks: the same rule the server applies
+       to a live docroot. */
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return (0);
+    if (pack_nfiles == pack_cap)
+    {
+        struct PackFile *p;
+
+        pack_cap = pack_cap ? pack_cap * 2 : 256;
+        p = (struct PackFile *)realloc(pack_files, pack_cap * sizeof(struct PackFile));
+        if (!p)
+            return (pack_fail("out of memory"));
+        pack_files = p;
+    }
+    f = &pack_files[pack_nfiles];
+    memset(f, 0, sizeof(*f));
+    f->path = strdup(path);
+    if (!f->path)
+        return (pack_fail("out of memory"));
+    f->key = f->path + pack_rootlen;
+    f->st = *st;
+    pack_nfiles++;
+    return (0);
+}
+
+static int pack_compare(const void *a, const void *b)
+{
+    return (strcmp(((struct PackFile *)a)->key, ((struct PackFile *)b)->key));
+}
+
+static int pack_read_file(struct PackFile *f, char *dest)
+{
+    off_t done = 0;
+    int fd;
+
+    fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return (pack_fail("failed to open %s: %s", f->path, strerror(errno)));
+    while (done < f->st.st_size)
+    {
+        ssize_t n;
+
+        n = read(fd, dest + done, f->st.st_size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            close(fd);
+            if (n == 0)
+                return (pack_fail("%s changed while packing", f->path));
+            return (pack_fail("failed to read %s: %s", f->path, strerror(errno)));
+        }
+        done += n;
+    }
+    close(fd);
+    return (0);
+}
+
+static int pack_compress_file(struct PackFile *f, pack_compress_fn compress)
+{
+    char *buf;
+
+    if (f->st.st_size < PACK_GZIP_MIN || !pack_compressible(pack_mime_type(f->key)))
+        return (0);
+    buf = (char *)malloc(f->st.st_size);
+    if (!buf)
+        return (pack_fail("out of memory"));
+    if (pack_read_file(f, buf) < 0)
+    {
+        free(buf);
+        return (-1);
+    }
+    f->gzip = compress(buf, f->st.st_size, &f->gzip_len);
+    free(buf);
+    /* Not worth a second variant unless it saves a tenth. */
+    if (f->gzip && f->gzip_len > (size_t)f->st.st_size - f->st.st_size / 10)
+    {
+        free(f->gzip);
+        f->gzip = NULL;
+    }
+    return (0);
+}
+
+/* Everything after the common header fields is fixed per variant. */
+static void pack_prepare_headers(struct PackFile *f)
+{
+    char modified[64];
+    char *mime = pack_mime_type(f->key);
+    char *vary = f->gzip ? "Vary: Accept-Encoding\r\n" : "";
+    struct tm tm;
+    int n;
+
+    gmtime_r(&f->st.st_mtime, &tm);
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    n = snprintf(f->header[PACK_IDENTITY], PACK_HEADER_MAX, "Content-Length: %lld\r\nContent-Type: %s\r\n%sETag: ",
+                 (long long)f->st.st_size, mime, vary);
+    f->etag[PACK_IDENTITY] = n;
+    f->etag_len[PACK_IDENTITY] = snprintf(f->header[PACK_IDENTITY] + n, PACK_HEADER_MAX - n, "\"%llx-%llx\"",
+                                          (unsigned long long)f->st.st_mtime, (unsigned long long)f->st.st_size);
+    n += f->etag_len[PACK_IDENTITY];
+    snprintf(f->header[PACK_IDENTITY] + n, PACK_HEADER_MAX - n, "\r\nLast-Modified: %s\r\n\r\n", modified);
+    if (!f->gzip)
+        return;
+    n = snprintf(f->header[PACK_GZIP], PACK_HEADER_MAX,
+                 "Content-Length: %zu\r\nContent-Type: %s\r\nContent-Encoding: gzip\r\n%sETag: ", f->gzip_len,
+                 mime, vary);
+    f->etag[PACK_GZIP] = n;
+    f->etag_len[PACK_GZIP] = snprintf(f->header[PACK_GZIP] + n, PACK_HEADER_MAX - n, "\"%llx-%llx-gz\"",
+                                      (unsigned long long)f->st.st_mtime, (unsigned long long)f->st.st_size);
+    n += f->etag_len[PACK_GZIP];
+    snprintf(f->header[PACK_GZIP] + n, PACK_HEADER_MAX - n, "\r\nLast-Modified: %s\r\n\r\n", modified);
+}
+
+static void pack_free_files(void)
+{
+    for (size_t i = 0; i < pack_nfiles; i++)
+    {
+        free(pack_files[i].path);
+        free(pack_files[i].gzip);
+    }
+    free(pack_files);
+    pack_files = NULL;
+    pack_nfiles = pack_cap = 0;
+}
+
+static size_t pack_body_align(size_t len, size_t pagesize)
+{
+    return (len >= pagesize ? pagesize : PACK_ALIGN);
+}
+
+static size_t pack_align(size_t off, size_t align)
+{
+    return ((off + align - 1) & ~(align - 1));
+}
+
+/* Packs the regular files under root into fd, which is truncated to the
+   size of the image. compress may be NULL. Returns the size of the image,
+   or 0 with pack_errmsg set. */
+static size_t pack_build(const char *root, int fd, pack_compress_fn compress)
+{
+    struct PackHeader *p;
+    size_t size, off, strings, pagesize;
+    uint32_t nbuckets;
+    char *image;
+
+    pack_errmsg[0] = '\0';
+    pack_rootlen = strlen(root);
+    while (pack_rootlen > 0 && root[pack_rootlen - 1] == '/')
+        pack_rootlen--;
+    if (nftw(root, pack_collect, 64, FTW_PHYS) != 0)
+    {
+        if (!pack_errmsg[0])
+            pack_fail("failed to walk %s: %s", root, strerror(errno));
+        pack_free_files();
+        return (0);
+    }
+    if (pack_nfiles > UINT32_MAX / 4)
+    {
+        pack_free_files();
+        return (pack_fail("too many files"), 0);
+    }
+    qsort(pack_files, pack_nfiles, sizeof(struct PackFile), pack_compare);
+    for (nbuckets = 16; nbuckets < pack_nfiles * 2; nbuckets *= 2)
+        ;
+    pagesize = sysconf(_SC_PAGESIZE);
+    strings = sizeof(struct PackHeader) + sizeof(struct PackEntry) * pack_nfiles + sizeof(uint32_t) * nbuckets;
+    off = strings;
+    for (size_t i = 0; i < pack_nfiles; i++)
+    {
+        struct PackFile *f = &pack_files[i];
+
+        if (compress && pack_compress_file(f, compress) < 0)
+        {
+            pack_free_files();
+            return (0);
+        }
+        pack_prepare_headers(f);
+        off += strlen(f->key) + 1 + strlen(f->header[PACK_IDENTITY]) + strlen(f->header[PACK_GZIP]);
+    }
+    /* Bodies start page aligned; large ones keep page alignment, small
+       ones are only packed to cache lines. */
+    off = pack_align(off, pagesize);
+    for (size_t i = 0; i < pack_nfiles; i++)
+    {
+        struct PackFile *f = &pack_files[i];
+
+        off = pack_align(off, pack_body_align(f->st.st_size, pagesize)) + f->st.st_size;
+        if (f->gzip)
+            off = pack_align(off, pack_body_align(f->gzip_len, pagesize)) + f->gzip_len;
+    }
+    size = off;
+    if (ftruncate(fd, size) < 0)
+    {
+        pack_free_files();
+        return (pack_fail("ftruncate(2) failed: %s", strerror(errno)), 0);
+    }
+    image = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED)
+    {
+        pack_free_files();
+        return (pack_fail("mmap(2) failed: %s", strerror(errno)), 0);
+    }
+    p = (struct PackHeader *)image;
+    p->magic = PACK_MAGIC;
+    p->version = PACK_VERSION;
+    p->count = pack_nfiles;
+    p->nbuckets = nbuckets;
+    p->size = size;
+    off = strings;
+    for (size_t i = 0; i < pack_nfiles; i++)
+    {
+        struct PackFile *f = &pack_files[i];
+        struct PackEntry *e = &p->entry[i];
+        uint32_t b;
+
+        e->path_len = strlen(f->key);
+        e->path = off;
+        memcpy(image + off, f->key, e->path_len + 1);
+        off += e->path_len + 1;
+        for (int v = 0; v < PACK_VARIANTS; v++)
+        {
+            struct PackVariant *pv = &e->variant[v];
+
+            pv->header_len = strlen(f->header[v]);
+            pv->header = off;
+            pv->etag = off + f->etag[v];
+            pv->etag_len = f->etag_len[v];
+            memcpy(image + off, f->header[v], pv->header_len);
+            off += pv->header_len;
+        }
+        e->hash = pack_hash(f->key, e->path_len);
+        for (b = e->hash & (nbuckets - 1); pack_buckets(p)[b]; b = (b + 1) & (nbuckets - 1))
+            ;
+        pack_buckets(p)[b] = i + 1;
+    }
+    off = pack_align(off, pagesize);
+    for (size_t i = 0; i < pack_nfiles; i++)
+    {
+        struct PackFile *f = &pack_files[i];
+        struct PackEntry *e = &p->entry[i];
+
+        off = pack_align(off, pack_body_align(f->st.st_size, pagesize));
+        e->variant[PACK_IDENTITY].body = off;
+        e->variant[PACK_IDENTITY].size = f->st.st_size;
+        if (pack_read_file(f, image + off) < 0)
+        {
+            munmap(image, size);
+            pack_free_files();
+            return (0);
+        }
+        off += f->st.st_size;
+        if (f->gzip)
+        {
+            off = pack_align(off, pack_body_align(f->gzip_len, pagesize));
+            e->variant[PACK_GZIP].body = off;
+            e->variant[PACK_GZIP].size = f->gzip_len;
+            memcpy(image + off, f->gzip, f->gzip_len);
+            off += f->gzip_len;
+        }
+    }
+    munmap(image, size);
+    pack_free_files();
+    return (size);
+}
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * r3u-pack: compiles a directory into a pack that r3u_http serves with
+ * --snapshot=file (see r3u_pack.h for the format).
+ *
+ *   gcc -Wall -Wextra -Werror -O2 -o r3u-pack tools/r3u_pack.c -lz
+ *   ./r3u-pack --gzip --output=site.r3u root
+ *
+ * The pack is written next to the output under a temporary name and
+ * renamed into place, so a running server never maps a partial file.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <zlib.h>
+
+#include "../r3u_pack.h"
+
+#define PACK_USAGE "Usage: %s [--gzip [--level=n]] --output=file <dir>\n"
+
+static struct option pack_longopts[] = {
+    {"gzip", no_argument, NULL, 'z'},
+    {"level", required_argument, NULL, 'l'},
+    {"output", required_argument, NULL, 'o'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0},
+};
+
+static int gzip_level = Z_BEST_COMPRESSION;
+
+static char *gzip_compress(char *in, size_t len, size_t *out_len);
+static void die(char *fmt, ...);
+
+int main(int argc, char **argv)
+{
+    pack_compress_fn compress = NULL;
+    struct PackHeader *p;
+    char *output = NULL;
+    char tmp[PATH_MAX];
+    size_t size;
+    uint32_t gzipped = 0;
+    int opt;
+    int fd;
+
+    while ((opt = getopt_long(argc, argv, "", pack_longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'z':
+            compress = gzip_compress;
+            break;
+        case 'l':
+            gzip_level = atoi(optarg);
+            if (gzip_level < 1 || gzip_level > 9)
+                die("--level must be between 1 and 9");
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            fprintf(stdout, PACK_USAGE, argv[0]);
+            exit(0);
+        default:
+            fprintf(stderr, PACK_USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if (!output || optind != argc - 1)
+    {
+        fprintf(stderr, PACK_USAGE, argv[0]);
+        exit(1);
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", output, (int)getpid());
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        die("%s: %s", tmp, strerror(errno));
+    size = pack_build(argv[optind], fd, compress);
+    if (size == 0)
+    {
+        unlink(tmp);
+        die("%s: %s", argv[optind], pack_errmsg);
+    }
+    /* Read back what the server will see before it can see it. */
+    p = (struct PackHeader *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED || pack_validate(p, size) < 0)
+    {
+        unlink(tmp);
+        die("%s: %s", tmp, p == MAP_FAILED ? strerror(errno) : pack_errmsg);
+    }
+    for (uint32_t i = 0; i < p->count; i++)
+        gzipped += p->entry[i].variant[PACK_GZIP].header_len != 0;
+    printf("%s: %u files, %u gzip variants, %zu bytes\n", output, p->count, gzipped, size);
+    munmap(p, size);
+    if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp, output) < 0)
+    {
+        unlink(tmp);
+        die("%s: %s", output, strerror(errno));
+    }
+    exit(0);
+}
+
+static char *gzip_compress(char *in, size_t len, size_t *out_len)
+{
+    z_stream z;
+    char *out;
+    size_t cap;
+
+    memset(&z, 0, sizeof(z));
+    /* 16 + MAX_WBITS asks zlib for a gzip wrapper. */
+    if (deflateInit2(&z, gzip_level, Z_DEFLATED, 16 + MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return (NULL);
+    cap = deflateBound(&z, len);
+    out = (char *)malloc(cap);
+    if (!out)
+    {
+        deflateEnd(&z);
+        return (NULL);
+    }
+    z.next_in = (Bytef *)in;
+    z.avail_in = len;
+    z.next_out = (Bytef *)out;
+    z.avail_out = cap;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+    {
+        deflateEnd(&z);
+        free(out);
+        return (NULL);
+    }
+    *out_len = z.total_out;
+    deflateEnd(&z);
+    return (out);
+}
+
+static void die(char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}